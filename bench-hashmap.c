@@ -0,0 +1,513 @@
+// hsearch_r is a GNU extension.
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <math.h>
+#include <search.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "hashmap.h"
+
+// Every run is forked off, so its peak memory and heap start from the same state as every other run's.
+//
+//   bench-hashmap -e chained,swiss,robin,open -w hit,miss,read,write,churn,grow,presized -k short,long,int
+//                 -d uniform,zipf -n 1000000 -o 4000000 -s results.tsv
+//   bench-hashmap ... -c results.tsv -p 10    exits 1 when a run lost more than 10% of its ops/sec
+
+#define BENCH_SAMPLE 32  // One op in this many is timed on its own for the latency percentiles.
+#define BENCH_ZIPF_THETA 0.99
+#define BENCH_LONG_KEY 64
+#define BENCH_MAX_RESULTS 1024
+
+enum { KEY_SHORT, KEY_LONG, KEY_INT };
+enum { DIST_UNIFORM, DIST_ZIPF };
+
+typedef struct {
+    char*    name;
+    uint32_t fill;     // Keys inserted before the clock starts: none, or all of them.
+    uint32_t reads;    // Percent of ops that are lookups, the rest insert an absent key or remove a present one.
+    bool     miss;     // Lookups ask for keys that were never inserted.
+    bool     presize;  // The table is created for all the keys up front.
+} workload_t;
+
+static workload_t workloads[] = {
+    {"hit", 1, 100, false, false},  {"miss", 1, 100, true, false}, {"read", 1, 95, false, false},
+    {"write", 1, 50, false, false}, {"churn", 1, 0, false, false}, {"grow", 0, 0, false, false},
+    {"presized", 0, 0, false, true},
+};
+
+typedef struct {
+    char* name;
+    void* (*create)(size_t capacity, int kind);
+    bool (*insert)(void* table, void* key, uint32_t len, void* value);
+    void* (*get)(void* table, void* key, uint32_t len);
+    bool (*remove)(void* table, void* key, uint32_t len);
+    void (*destroy)(void* table);
+    bool removes;  // hsearch tables cannot forget a key,
+    bool grows;    // nor take more keys than they were created for.
+} target_t;
+
+typedef struct {
+    char   target[16], workload[16], keys[8], dist[8];
+    size_t n;
+    double ops;
+} result_t;
+
+// Keys live in one array each, and are handed to the tables as pointer and length.
+static void**    keys;
+static void**    absent;
+static uint32_t* lens;
+static uint64_t  rng = 0x9E3779B97F4A7C15ull;
+
+uint64_t next_random() {
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return rng * 0x2545F4914F6CDD1Dull;
+}
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+size_t current_rss_kb() {
+    long  pages = 0, resident = 0;
+    FILE* f     = fopen("/proc/self/statm", "r");
+    if (f && fscanf(f, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+    if (f)
+        fclose(f);
+    return (size_t) resident * (size_t) sysconf(_SC_PAGESIZE) / 1024;
+}
+
+int compare_double(const void* a, const void* b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+// What reading the clock twice costs on its own, taken off every latency sample.
+double clock_overhead() {
+    double samples[1001];
+    for (size_t i = 0; i < 1001; i++) {
+        double before = now();
+        samples[i]    = now() - before;
+    }
+    qsort(samples, 1001, sizeof(double), compare_double);
+    return samples[500];
+}
+
+// Zipfian ranks as in Gray et al., "Quickly generating billion-record synthetic databases", scrambled over the keys so
+// the hot ones do not sit next to each other.
+typedef struct {
+    size_t n;
+    double alpha, zetan, eta, half;
+} zipf_t;
+
+void zipf_init(zipf_t* z, size_t n) {
+    z->n     = n;
+    z->zetan = 0;
+    for (size_t i = 1; i <= n; i++) {
+        z->zetan += 1 / pow((double) i, BENCH_ZIPF_THETA);
+    }
+    z->half  = 1 + pow(0.5, BENCH_ZIPF_THETA);
+    z->alpha = 1 / (1 - BENCH_ZIPF_THETA);
+    z->eta   = (1 - pow(2.0 / n, 1 - BENCH_ZIPF_THETA)) / (1 - z->half / z->zetan);
+}
+
+size_t zipf_next(zipf_t* z) {
+    double u    = (double) (next_random() >> 11) / (double) (1ull << 53);
+    double uz   = u * z->zetan;
+    size_t rank = uz < 1 ? 0 : uz < z->half ? 1 : (size_t) (z->n * pow(z->eta * u - z->eta + 1, z->alpha));
+    return (size_t) (wyhash_u64(rank, 0) % z->n);
+}
+
+// hashmap_t, with integer keys stored as 8-byte binary keys.
+void* hashmap_create(size_t capacity, int kind) {
+    hashmap_t* map = malloc(sizeof(hashmap_t));
+    uint32_t   flags = kind == KEY_INT ? HASHMAP_BINARY_KEYS : 0;
+    hashmap_init_with(map, (uint32_t) capacity, NULL, NULL, NULL, flags);
+    return map;
+}
+
+void* swiss_create(size_t capacity, int kind) {
+    // The swisstable engine only takes string keys, so integers are spelled out by the key generator instead.
+    hashmap_t* map = malloc(sizeof(hashmap_t));
+    hashmap_init_with(map, (uint32_t) capacity, NULL, NULL, NULL, HASHMAP_ENGINE_SWISS);
+    return map;
+}
+
+void* robin_create(size_t capacity, int kind) {
+    // Robin Hood tables only take string keys as well.
+    hashmap_t* map = malloc(sizeof(hashmap_t));
+    hashmap_init_with(map, (uint32_t) capacity, NULL, NULL, NULL, HASHMAP_ENGINE_ROBINHOOD);
+    return map;
+}
+
+bool hashmap_bench_insert(void* table, void* key, uint32_t len, void* value) {
+    hashmap_t* map = table;
+    return (map->__flags & HASHMAP_BINARY_KEYS ? hashmap_insert_bytes(map, key, len, value, false)
+                                               : hashmap_insert(map, key, value, false)) == 0;
+}
+
+void* hashmap_bench_get(void* table, void* key, uint32_t len) {
+    hashmap_t* map = table;
+    return map->__flags & HASHMAP_BINARY_KEYS ? hashmap_get_bytes(map, key, len, NULL) : hashmap_get(map, key, NULL);
+}
+
+bool hashmap_bench_remove(void* table, void* key, uint32_t len) {
+    hashmap_t* map = table;
+    return (map->__flags & HASHMAP_BINARY_KEYS ? hashmap_remove_bytes(map, key, len) : hashmap_remove(map, key)) == 0;
+}
+
+void hashmap_bench_destroy(void* table) {
+    hashmap_destroy(table);
+    free(table);
+}
+
+// A reference open-addressing table: linear probing over (hash, key, length, value) slots, tombstones on remove, and
+// a rebuild at 7/8 full counting tombstones.
+typedef struct {
+    uint64_t hash;  // 0 for empty, 1 for a tombstone.
+    void*    key;
+    uint32_t len;
+    void*    value;
+} open_slot_t;
+
+typedef struct {
+    open_slot_t* slots;
+    size_t       mask, used, size;
+} open_table_t;
+
+uint64_t open_hash(void* key, uint32_t len) {
+    uint64_t hash = wyhash(key, len, 0);
+    return hash < 2 ? hash + 2 : hash;
+}
+
+void* open_create(size_t capacity, int kind) {
+    open_table_t* table = malloc(sizeof(open_table_t));
+    size_t        size  = 16;
+    while (size - size / 8 < capacity) {
+        size <<= 1;
+    }
+    table->slots = calloc(size, sizeof(open_slot_t));
+    table->mask  = size - 1;
+    table->used  = 0;
+    table->size  = 0;
+    return table;
+}
+
+open_slot_t* open_find(open_table_t* table, void* key, uint32_t len, uint64_t hash) {
+    for (size_t i = hash & table->mask;; i = (i + 1) & table->mask) {
+        open_slot_t* slot = &table->slots[i];
+        if (slot->hash == 0)
+            return NULL;
+        if (slot->hash == hash && slot->len == len && memcmp(slot->key, key, len) == 0)
+            return slot;
+    }
+}
+
+// Mostly tombstones are swept out at the same size, otherwise the table doubles.
+void open_rebuild(open_table_t* table) {
+    open_slot_t* old  = table->slots;
+    size_t       size = table->mask + 1;
+    size_t       grow = table->size * 2 > size ? 2 * size : size;
+    table->slots      = calloc(grow, sizeof(open_slot_t));
+    table->mask       = grow - 1;
+    table->used       = table->size;
+    for (size_t i = 0; i < size; i++) {
+        if (old[i].hash < 2)
+            continue;
+        size_t j = old[i].hash & table->mask;
+        while (table->slots[j].hash != 0) {
+            j = (j + 1) & table->mask;
+        }
+        table->slots[j] = old[i];
+    }
+    free(old);
+}
+
+bool open_insert(void* p, void* key, uint32_t len, void* value) {
+    open_table_t* table = p;
+    uint64_t      hash  = open_hash(key, len);
+    if (open_find(table, key, len, hash))
+        return false;
+    if (table->used + 1 > (table->mask + 1) - (table->mask + 1) / 8)
+        open_rebuild(table);
+    size_t i = hash & table->mask;
+    while (table->slots[i].hash >= 2) {
+        i = (i + 1) & table->mask;
+    }
+    table->used += table->slots[i].hash == 0;
+    table->size++;
+    table->slots[i] = (open_slot_t){hash, key, len, value};
+    return true;
+}
+
+void* open_get(void* table, void* key, uint32_t len) {
+    open_slot_t* slot = open_find(table, key, len, open_hash(key, len));
+    return slot ? slot->value : NULL;
+}
+
+bool open_remove(void* p, void* key, uint32_t len) {
+    open_table_t* table = p;
+    open_slot_t*  slot  = open_find(table, key, len, open_hash(key, len));
+    if (slot == NULL)
+        return false;
+    slot->hash = 1;
+    table->size--;
+    return true;
+}
+
+void open_destroy(void* p) {
+    open_table_t* table = p;
+    free(table->slots);
+    free(table);
+}
+
+// glibc's hsearch: string keys, a fixed size given up front, and no way to remove.
+void* hsearch_create(size_t capacity, int kind) {
+    struct hsearch_data* table = calloc(1, sizeof(struct hsearch_data));
+    hcreate_r(capacity < 16 ? 16 : capacity * 2, table);
+    return table;
+}
+
+bool hsearch_insert(void* table, void* key, uint32_t len, void* value) {
+    ENTRY  item = {key, value}, *found;
+    return hsearch_r(item, ENTER, &found, table) != 0;
+}
+
+void* hsearch_get(void* table, void* key, uint32_t len) {
+    ENTRY item = {key, NULL}, *found;
+    return hsearch_r(item, FIND, &found, table) ? found->data : NULL;
+}
+
+void hsearch_destroy(void* table) {
+    hdestroy_r(table);
+    free(table);
+}
+
+static target_t targets[] = {
+    {"chained", hashmap_create, hashmap_bench_insert, hashmap_bench_get, hashmap_bench_remove, hashmap_bench_destroy,
+     true, true},
+    {"swiss", swiss_create, hashmap_bench_insert, hashmap_bench_get, hashmap_bench_remove, hashmap_bench_destroy, true,
+     true},
+    {"robin", robin_create, hashmap_bench_insert, hashmap_bench_get, hashmap_bench_remove, hashmap_bench_destroy, true,
+     true},
+    {"open", open_create, open_insert, open_get, open_remove, open_destroy, true, true},
+    {"hsearch", hsearch_create, hsearch_insert, hsearch_get, NULL, hsearch_destroy, false, false},
+};
+
+static char* key_names[]  = {"short", "long", "int"};
+static char* dist_names[] = {"uniform", "zipf"};
+
+// Short keys are decimal strings, long keys are 64-character strings with the number at the end, and integers are
+// scattered 64-bit values. Absent keys are spelled so that they can never collide with present ones.
+void make_keys(int kind, size_t n, bool strings) {
+    keys   = malloc(n * sizeof(void*));
+    absent = malloc(n * sizeof(void*));
+    lens   = malloc(n * sizeof(uint32_t));
+    for (size_t i = 0; i < n; i++) {
+        if (kind == KEY_INT && !strings) {
+            uint64_t* k = malloc(2 * sizeof(uint64_t));
+            k[0]        = wyhash_u64(i, 1) << 1;
+            k[1]        = k[0] | 1;
+            keys[i]     = &k[0];
+            absent[i]   = &k[1];
+            lens[i]     = sizeof(uint64_t);
+            continue;
+        }
+        char* k = malloc(2 * (BENCH_LONG_KEY + 1));
+        if (kind == KEY_LONG) {
+            snprintf(k, BENCH_LONG_KEY + 1, "%0*zu", BENCH_LONG_KEY, i);
+            snprintf(k + BENCH_LONG_KEY + 1, BENCH_LONG_KEY + 1, "-%0*zu", BENCH_LONG_KEY - 1, i);
+        } else if (kind == KEY_INT) {
+            unsigned long long value = wyhash_u64(i, 1) << 1;
+            snprintf(k, BENCH_LONG_KEY + 1, "%llu", value);
+            snprintf(k + BENCH_LONG_KEY + 1, BENCH_LONG_KEY + 1, "%llu", value | 1);
+        } else {
+            snprintf(k, BENCH_LONG_KEY + 1, "%zu", i);
+            snprintf(k + BENCH_LONG_KEY + 1, BENCH_LONG_KEY + 1, "-%zu", i);
+        }
+        keys[i]   = k;
+        absent[i] = k + BENCH_LONG_KEY + 1;
+        lens[i]   = (uint32_t) strlen(k);
+    }
+}
+
+// Runs one configuration and writes its result line. Lookups and updates are checked against a presence bitmap.
+void run(target_t* target, workload_t* workload, int kind, int dist, size_t n, size_t ops, int out) {
+    make_keys(kind, n,
+              target->create == swiss_create || target->create == robin_create || target->create == hsearch_create);
+    zipf_t zipf;
+    if (dist == DIST_ZIPF)
+        zipf_init(&zipf, n);
+    if (workload->fill == 0)
+        ops = n;
+    bool*   present = calloc(n, sizeof(bool));
+    double* samples = malloc((ops / BENCH_SAMPLE + 1) * sizeof(double));
+    size_t  sampled = 0, errors = 0;
+    size_t  rss     = current_rss_kb();
+    double  timer   = clock_overhead();
+    void*   table   = target->create(workload->presize || workload->fill ? n : 16, kind);
+    for (size_t i = 0; workload->fill && i < n; i++) {
+        present[i] = target->insert(table, keys[i], lens[i], (void*) (i + 1));
+    }
+    double tic = now();
+    for (size_t op = 0; op < ops; op++) {
+        size_t i      = workload->fill == 0 ? op : dist == DIST_ZIPF ? zipf_next(&zipf) : next_random() % n;
+        bool   read   = workload->reads > 0 && next_random() % 100 < workload->reads;
+        double before = op % BENCH_SAMPLE == 0 ? now() : 0;
+        if (read && workload->miss) {
+            errors += target->get(table, absent[i], lens[i]) != NULL;
+        } else if (read) {
+            errors += target->get(table, keys[i], lens[i]) != (present[i] ? (void*) (i + 1) : NULL);
+        } else if (present[i] && target->removes) {
+            errors += !target->remove(table, keys[i], lens[i]);
+            present[i] = false;
+        } else if (!present[i]) {
+            errors += !target->insert(table, keys[i], lens[i], (void*) (i + 1));
+            present[i] = true;
+        }
+        if (op % BENCH_SAMPLE == 0)
+            samples[sampled++] = now() - before - timer;
+    }
+    double toc = now();
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    qsort(samples, sampled, sizeof(double), compare_double);
+    double peak = (size_t) usage.ru_maxrss > rss ? (double) (usage.ru_maxrss - rss) / 1024 : 0;
+    dprintf(out, "%s\t%s\t%s\t%s\t%zu\t%.0f\t%.0f\t%.0f\t%.0f\t%.1f\t%zu\n", target->name, workload->name,
+            key_names[kind], dist_names[dist], n, ops / (toc - tic), samples[sampled / 2] * 1e9,
+            samples[sampled * 99 / 100] * 1e9, samples[sampled * 999 / 1000] * 1e9, peak, errors);
+    target->destroy(table);
+}
+
+size_t load_results(const char* path, result_t* results) {
+    FILE* f = fopen(path, "r");
+    char  line[512];
+    size_t count = 0;
+    while (f && count < BENCH_MAX_RESULTS && fgets(line, sizeof(line), f)) {
+        result_t* r = &results[count];
+        if (sscanf(line, "%15s %15s %7s %7s %zu %lf", r->target, r->workload, r->keys, r->dist, &r->n, &r->ops) == 6)
+            count++;
+    }
+    if (f)
+        fclose(f);
+    return count;
+}
+
+bool split_has(char* list, const char* name) {
+    if (list == NULL)
+        return true;
+    size_t len = strlen(name);
+    for (char* p = list; (p = strstr(p, name)) != NULL; p += len) {
+        if ((p == list || p[-1] == ',') && (p[len] == ',' || p[len] == '\0'))
+            return true;
+    }
+    return false;
+}
+
+int main(int argc, char* argv[]) {
+    char*  engines   = NULL;
+    char*  names     = NULL;
+    char*  kinds     = "short";
+    char*  dists     = "uniform";
+    char*  save      = NULL;
+    char*  check     = NULL;
+    size_t n         = 1000000;
+    size_t ops       = 4000000;
+    double tolerance = 10;
+    for (int c; (c = getopt(argc, argv, "e:w:k:d:n:o:s:c:p:")) != -1;) {
+        switch (c) {
+            case 'e': engines = optarg; break;
+            case 'w': names = optarg; break;
+            case 'k': kinds = optarg; break;
+            case 'd': dists = optarg; break;
+            case 'n': n = strtoull(optarg, NULL, 10); break;
+            case 'o': ops = strtoull(optarg, NULL, 10); break;
+            case 's': save = optarg; break;
+            case 'c': check = optarg; break;
+            case 'p': tolerance = strtod(optarg, NULL); break;
+            default:
+                fprintf(stderr, "usage: %s [-e targets] [-w workloads] [-k keys] [-d dists] [-n keys] [-o ops]\n"
+                                "       [-s save.tsv] [-c baseline.tsv] [-p tolerance%%]\n", argv[0]);
+                return 2;
+        }
+    }
+    result_t* baseline    = calloc(BENCH_MAX_RESULTS, sizeof(result_t));
+    size_t    nbaseline   = check ? load_results(check, baseline) : 0;
+    FILE*     saved       = save ? fopen(save, "w") : NULL;
+    int       regressions = 0;
+    printf("%-8s %-9s %-6s %-8s %9s %12s %8s %8s %8s %9s %s\n", "target", "workload", "keys", "dist", "n", "ops/s",
+           "p50 ns", "p99 ns", "p999 ns", "peak MB", "errors");
+    for (size_t t = 0; t < sizeof(targets) / sizeof(targets[0]); t++) {
+        for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+            for (int kind = KEY_SHORT; kind <= KEY_INT; kind++) {
+                for (int dist = DIST_UNIFORM; dist <= DIST_ZIPF; dist++) {
+                    if (!split_has(engines, targets[t].name) || !split_has(names, workloads[w].name) ||
+                        !split_has(kinds, key_names[kind]) || !split_has(dists, dist_names[dist]))
+                        continue;
+                    // Without removes only the read-only workloads mean the same thing, and without growing only the
+                    // presized inserts do.
+                    if (!targets[t].removes && workloads[w].fill && workloads[w].reads < 100)
+                        continue;
+                    if (!targets[t].grows && !workloads[w].fill && !workloads[w].presize)
+                        continue;
+                    int pipes[2];
+                    if (pipe(pipes) != 0)
+                        return 2;
+                    fflush(stdout);
+                    if (fork() == 0) {
+                        close(pipes[0]);
+                        run(&targets[t], &workloads[w], kind, dist, n, ops, pipes[1]);
+                        _exit(0);
+                    }
+                    close(pipes[1]);
+                    char    line[512];
+                    ssize_t len = read(pipes[0], line, sizeof(line) - 1);
+                    close(pipes[0]);
+                    wait(NULL);
+                    if (len <= 0) {
+                        printf("%-8s %-9s %-6s %-8s failed\n", targets[t].name, workloads[w].name, key_names[kind],
+                               dist_names[dist]);
+                        regressions++;
+                        continue;
+                    }
+                    line[len] = '\0';
+                    result_t r;
+                    double   p50, p99, p999, peak;
+                    size_t   errors;
+                    sscanf(line, "%15s %15s %7s %7s %zu %lf %lf %lf %lf %lf %zu", r.target, r.workload, r.keys,
+                           r.dist, &r.n, &r.ops, &p50, &p99, &p999, &peak, &errors);
+                    printf("%-8s %-9s %-6s %-8s %9zu %12.0f %8.0f %8.0f %8.0f %9.1f %zu", r.target, r.workload,
+                           r.keys, r.dist, r.n, r.ops, p50, p99, p999, peak, errors);
+                    if (saved)
+                        fputs(line, saved);
+                    for (size_t i = 0; i < nbaseline; i++) {
+                        result_t* b = &baseline[i];
+                        if (strcmp(b->target, r.target) || strcmp(b->workload, r.workload) || strcmp(b->keys, r.keys) ||
+                            strcmp(b->dist, r.dist) || b->n != r.n)
+                            continue;
+                        double change = 100 * (r.ops - b->ops) / b->ops;
+                        printf("  %+.1f%%%s", change, change < -tolerance ? " REGRESSION" : "");
+                        regressions += change < -tolerance;
+                    }
+                    regressions += errors > 0;
+                    printf("\n");
+                }
+            }
+        }
+    }
+    if (saved)
+        fclose(saved);
+    free(baseline);
+    return regressions ? 1 : 0;
+}
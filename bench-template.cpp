@@ -0,0 +1,157 @@
+// Compares the function-pointer C API with the hashmap.hpp template on the same keys, in the same order.
+//
+//   bench-template [n]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <string>
+
+#include "hashmap.hpp"
+
+#define N (1000 * 1024)
+
+static uint64_t rng = 0x9E3779B97F4A7C15ull;
+
+uint64_t next_random() {
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return rng * 0x2545F4914F6CDD1Dull;
+}
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Integer keys ride in the key pointer itself, hashed with the same mix the template applies to std::hash.
+uint32_t hash_u64(void* key) {
+    return (uint32_t) (((uint64_t) (uintptr_t) key * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+int equal_u64(void* a, void* b) {
+    return a != b;
+}
+
+void report(const char* name, const char* keys, size_t n, double insert, double hit, double miss, size_t check) {
+    printf("%-9s %-6s N = %zu, insert %7.2f ns, hit %7.2f ns, miss %7.2f ns%s\n", name, keys, n, insert * 1e9 / n,
+           hit * 1e9 / n, miss * 1e9 / n, check == n ? "" : "  !!![ERROR]!!!");
+}
+
+void benchmark_u64(uint64_t* keys, uint64_t* absent, size_t n) {
+    size_t found = 0;
+    {
+        hashmap_t map;
+        hashmap_init(&map, 16, hash_u64, equal_u64, NULL);
+        double t0 = now();
+        for (size_t i = 0; i < n; i++) {
+            hashmap_insert(&map, (void*) (uintptr_t) keys[i], (void*) (uintptr_t) i, true);
+        }
+        double t1 = now();
+        for (size_t i = 0; i < n; i++) {
+            found += (uintptr_t) hashmap_get(&map, (void*) (uintptr_t) keys[i], NULL) == i;
+        }
+        double t2 = now();
+        for (size_t i = 0; i < n; i++) {
+            found += hashmap_get(&map, (void*) (uintptr_t) absent[i], NULL) != NULL;
+        }
+        double t3 = now();
+        report("C API", "u64", n, t1 - t0, t2 - t1, t3 - t2, found);
+        hashmap_destroy(&map);
+    }
+    found = 0;
+    {
+        hashmap<uint64_t, uint64_t> map;
+        double                      t0 = now();
+        for (size_t i = 0; i < n; i++) {
+            map.insert(keys[i], i, true);
+        }
+        double t1 = now();
+        for (size_t i = 0; i < n; i++) {
+            found += map.get(keys[i], UINT64_MAX) == i;
+        }
+        double t2 = now();
+        for (size_t i = 0; i < n; i++) {
+            found += map.exists(absent[i]);
+        }
+        double t3 = now();
+        report("template", "u64", n, t1 - t0, t2 - t1, t3 - t2, found);
+    }
+}
+
+// Short decimal strings, so the template's std::string keys stay inside their inline buffer.
+void benchmark_str(size_t n) {
+    char(*strs)[16] = (char(*)[16]) calloc(2 * n, sizeof(*strs));
+    for (size_t i = 0; i < n; i++) {
+        sprintf(strs[i], "%zu", 2 * i + 1);
+        sprintf(strs[n + i], "%zu", 2 * i);
+    }
+    size_t found = 0;
+    {
+        hashmap_t map;
+        hashmap_init(&map, 16, NULL, NULL, NULL);
+        double t0 = now();
+        for (size_t i = 0; i < n; i++) {
+            hashmap_insert(&map, strs[i], (void*) (uintptr_t) i, true);
+        }
+        double t1 = now();
+        for (size_t i = 0; i < n; i++) {
+            found += (uintptr_t) hashmap_get(&map, strs[i], NULL) == i;
+        }
+        double t2 = now();
+        for (size_t i = 0; i < n; i++) {
+            found += hashmap_get(&map, strs[n + i], NULL) != NULL;
+        }
+        double t3 = now();
+        report("C API", "string", n, t1 - t0, t2 - t1, t3 - t2, found);
+        hashmap_destroy(&map);
+    }
+    found = 0;
+    {
+        // Probes go through a std::string like the stored keys; building it is part of the measured cost.
+        hashmap<std::string, uint64_t> map;
+        double                          t0 = now();
+        for (size_t i = 0; i < n; i++) {
+            map.insert(strs[i], i, true);
+        }
+        double t1 = now();
+        for (size_t i = 0; i < n; i++) {
+            found += map.get(strs[i], UINT64_MAX) == i;
+        }
+        double t2 = now();
+        for (size_t i = 0; i < n; i++) {
+            found += map.exists(strs[n + i]);
+        }
+        double t3 = now();
+        report("template", "string", n, t1 - t0, t2 - t1, t3 - t2, found);
+        // A moved-from map is empty and takes inserts again.
+        hashmap<std::string, uint64_t> moved(std::move(map));
+        if (map.size() != 0 || map.exists(strs[0]) || map.remove(strs[0]) == 0 || map.insert(strs[0], 1) != 0 ||
+            map.get(strs[0], 0) != 1 || moved.size() != n || moved.get(strs[0], UINT64_MAX) != 0)
+            printf("moved-from map  !!![ERROR]!!!\n");
+        map = std::move(moved);
+        if (map.size() != n || moved.insert(strs[n], 2) != 0 || moved.get(strs[n], 0) != 2)
+            printf("moved-from map  !!![ERROR]!!!\n");
+    }
+    free(strs);
+}
+
+int main(int argc, char const* argv[]) {
+    size_t    n      = argc > 1 ? strtoull(argv[1], NULL, 10) : N;
+    uint64_t* keys   = (uint64_t*) malloc(n * sizeof(uint64_t));
+    uint64_t* absent = (uint64_t*) malloc(n * sizeof(uint64_t));
+    // Present keys are odd and absent ones even, so the two sets never meet.
+    for (size_t i = 0; i < n; i++) {
+        keys[i]   = next_random() | 1;
+        absent[i] = next_random() & ~1ull;
+    }
+    benchmark_u64(keys, absent, n);
+    benchmark_str(n);
+    free(keys);
+    free(absent);
+    return 0;
+}
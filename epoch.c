@@ -0,0 +1,115 @@
+#include "epoch.h"
+
+#include <stdlib.h>
+
+// A record holds (epoch << 1) | 1 while its thread is inside a read-side section and 0 otherwise.
+#define __EPOCH_ACTIVE 1u
+
+int __epoch_try_advance(epoch_t *epoch);
+int __epoch_reclaim(epoch_t *epoch, uint64_t safe);
+
+int epoch_init(epoch_t *epoch) {
+    epoch->__global  = 2;
+    epoch->__records = NULL;
+    epoch->__head    = NULL;
+    epoch->__tail    = NULL;
+    epoch->__pending = 0;
+    return 0;
+}
+
+int epoch_free(epoch_t *epoch) {
+    // No reader may be active any more: everything still pending is reclaimed now.
+    __epoch_reclaim(epoch, UINT64_MAX);
+    for (struct __epoch_record *record = epoch->__records, *next; record; record = next) {
+        next = record->next;
+        free(record);
+    }
+    epoch->__records = NULL;
+    return 0;
+}
+
+struct __epoch_record *epoch_register(epoch_t *epoch) {
+    // Reuse a record released by a thread that has gone away before allocating a new one.
+    struct __epoch_record *record = __atomic_load_n(&epoch->__records, __ATOMIC_ACQUIRE);
+    for (; record; record = record->next) {
+        bool expected = false;
+        if (__atomic_compare_exchange_n(&record->used, &expected, true, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            return record;
+        }
+    }
+    return_if(NULL, posix_memalign((void **) &record, sizeof(*record), sizeof(*record)) != 0);
+    record->owner = epoch;
+    record->state = 0;
+    record->used  = true;
+    record->next  = __atomic_load_n(&epoch->__records, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&epoch->__records, &record->next, record, true, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED)) {
+    }
+    return record;
+}
+
+void epoch_unregister(struct __epoch_record *record) {
+    __atomic_store_n(&record->state, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&record->used, false, __ATOMIC_RELEASE);
+}
+
+void epoch_enter(struct __epoch_record *record) {
+    uint64_t global = __atomic_load_n(&record->owner->__global, __ATOMIC_RELAXED);
+    __atomic_store_n(&record->state, (global << 1) | __EPOCH_ACTIVE, __ATOMIC_RELAXED);
+    // Order the announcement before any read of the shared structure.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void epoch_exit(struct __epoch_record *record) {
+    __atomic_store_n(&record->state, 0, __ATOMIC_RELEASE);
+}
+
+int epoch_retire(epoch_t *epoch, void (*reclaim)(void *, void *), void *ctx, void *ptr) {
+    struct __epoch_retired *retired = (struct __epoch_retired *) malloc(sizeof(struct __epoch_retired));
+    return_if_null(-1, retired);
+    retired->epoch   = __atomic_load_n(&epoch->__global, __ATOMIC_RELAXED);
+    retired->reclaim = reclaim;
+    retired->ctx     = ctx;
+    retired->ptr     = ptr;
+    retired->next    = NULL;
+    if (epoch->__tail)
+        epoch->__tail->next = retired;
+    else
+        epoch->__head = retired;
+    epoch->__tail = retired;
+    epoch->__pending++;
+    return 0;
+}
+
+int epoch_collect(epoch_t *epoch) {
+    return_if(0, epoch->__head == NULL);
+    __epoch_try_advance(epoch);
+    // Readers can lag at most one epoch behind, so anything retired two epochs ago is unreachable.
+    return __epoch_reclaim(epoch, __atomic_load_n(&epoch->__global, __ATOMIC_RELAXED) - 2);
+}
+
+int __epoch_try_advance(epoch_t *epoch) {
+    uint64_t global = __atomic_load_n(&epoch->__global, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    struct __epoch_record *record = __atomic_load_n(&epoch->__records, __ATOMIC_ACQUIRE);
+    for (; record; record = record->next) {
+        uint64_t state = __atomic_load_n(&record->state, __ATOMIC_ACQUIRE);
+        return_if(-1, (state & __EPOCH_ACTIVE) && (state >> 1) != global);
+    }
+    __atomic_store_n(&epoch->__global, global + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int __epoch_reclaim(epoch_t *epoch, uint64_t safe) {
+    int count = 0;
+    while (epoch->__head && epoch->__head->epoch <= safe) {
+        struct __epoch_retired *retired = epoch->__head;
+        epoch->__head                   = retired->next;
+        retired->reclaim(retired->ctx, retired->ptr);
+        free(retired);
+        epoch->__pending--;
+        count++;
+    }
+    if (epoch->__head == NULL) epoch->__tail = NULL;
+    return count;
+}
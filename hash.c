@@ -1,5 +1,28 @@
 #include "hash.h"
 
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+
+uint64_t __wyhash_mix(uint64_t a, uint64_t b);
+
+// wyhash (final version 4) constants; the seed is what makes the output unpredictable.
+#define __WYHASH_P0 0x2d358dccaa6c78a5ull
+#define __WYHASH_P1 0x8bb84b93962eacc9ull
+#define __WYHASH_P2 0x4b33a62ed433d4a3ull
+#define __WYHASH_P3 0x4d5a2da51de1aa47ull
+
+#define __wyhash_mum(A, B)                                    \
+    do {                                                      \
+        __uint128_t __product = (__uint128_t) (A) * (B);      \
+        (A)                   = (uint64_t) __product;         \
+        (B)                   = (uint64_t) (__product >> 64); \
+    } while (0)
+#define __wyhash_read8(P) ({ uint64_t __v; memcpy(&__v, (P), 8); __v; })
+#define __wyhash_read4(P) ({ uint32_t __v; memcpy(&__v, (P), 4); (uint64_t) __v; })
+#define __wyhash_read3(P, N) \
+    ((((uint64_t) (P)[0]) << 16) | (((uint64_t) (P)[(N) >> 1]) << 8) | (uint64_t) (P)[(N) -1])
+
 // SDBM Hash Function
 unsigned int sdbm_hash(char *str) {
     unsigned int hash = 0;
@@ -91,4 +114,71 @@ unsigned int ap_hash(char *str) {
         }
     }
     return (hash & 0x7FFFFFFF);
-}
\ No newline at end of file
+}
+
+uint64_t wyhash(const void *key, size_t len, uint64_t seed) {
+    const uint8_t *p = (const uint8_t *) key;
+    uint64_t       a, b;
+    seed ^= __wyhash_mix(seed ^ __WYHASH_P0, __WYHASH_P1);
+    if (len <= 16) {
+        if (len >= 4) {
+            // Two overlapping 4-byte reads from each end cover every length from 4 to 16.
+            a = (__wyhash_read4(p) << 32) | __wyhash_read4(p + ((len >> 3) << 2));
+            b = (__wyhash_read4(p + len - 4) << 32) | __wyhash_read4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = __wyhash_read3(p, len);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            // Three independent lanes keep the multipliers busy on long keys.
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = __wyhash_mix(__wyhash_read8(p) ^ __WYHASH_P1, __wyhash_read8(p + 8) ^ seed);
+                see1 = __wyhash_mix(__wyhash_read8(p + 16) ^ __WYHASH_P2, __wyhash_read8(p + 24) ^ see1);
+                see2 = __wyhash_mix(__wyhash_read8(p + 32) ^ __WYHASH_P3, __wyhash_read8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = __wyhash_mix(__wyhash_read8(p) ^ __WYHASH_P1, __wyhash_read8(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = __wyhash_read8(p + i - 16);
+        b = __wyhash_read8(p + i - 8);
+    }
+    a ^= __WYHASH_P1;
+    b ^= seed;
+    __wyhash_mum(a, b);
+    return __wyhash_mix(a ^ __WYHASH_P0 ^ len, b ^ __WYHASH_P1);
+}
+
+uint64_t wyhash_str(const char *str, uint64_t seed) {
+    return wyhash(str, strlen(str), seed);
+}
+
+uint64_t wyhash_u64(uint64_t key, uint64_t seed) {
+    return __wyhash_mix(key ^ __WYHASH_P0, seed ^ __WYHASH_P1);
+}
+
+uint64_t hash_seed() {
+    // Seeds come from the kernel so that keys colliding under them cannot be picked from outside. Without getrandom,
+    // or before the kernel has entropy, every call still gets a different seed, from a base that changes from run to
+    // run with the clock and the address layout.
+    uint64_t seed;
+    if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) == (ssize_t) sizeof(seed)) return seed;
+    static uint64_t counter = 0;
+    uint64_t        base    = (uint64_t) time(NULL) ^ ((uint64_t) clock() << 32) ^ (uint64_t) (uintptr_t) &counter;
+    return wyhash_u64(base, __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED));
+}
+
+uint64_t __wyhash_mix(uint64_t a, uint64_t b) {
+    __wyhash_mum(a, b);
+    return a ^ b;
+}
@@ -1,46 +1,136 @@
 #include "hashmap.h"
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "core.h"
 #include "hash.h"
+#include "robinhood.h"
+#include "swisstable.h"
 
+int  __hm_init(hashmap_t *, uint32_t capacity, uint32_t (*hash)(void *), int (*equal)(void *, void *),
+               memory_pool_t *pool, uint32_t flags, uint32_t load);
+int  __hm_init_like(hashmap_t *, hashmap_t *newmap, uint32_t capacity, uint32_t load);
+int  __hm_rehash(hashmap_t *, hashmap_t *newmap, uint32_t capacity, uint32_t load);
+int  __hm_replace(hashmap_t *, hashmap_t *newmap);
+int  __hm_rehash_sorted(hashmap_t *, hashmap_t *newmap);
+int  __hm_rehash_skiplists(hashmap_t *, hashmap_t *newmap);
+uint32_t __hm_compact_capacity(uint32_t size);
+int  __hm_maybe_shrink(hashmap_t *, int removed);
+int  __hm_rehash_lru(hashmap_t *, hashmap_t *newmap);
+void __hm_lru_link(hashmap_t *, int32_t entry);
+void __hm_lru_unlink(hashmap_t *, int32_t entry);
+void __hm_lru_add(hashmap_t *, int32_t entry);
+void __hm_lru_touch(hashmap_t *, int32_t entry);
+bool __hm_lru_check(hashmap_t *, int32_t entry, bool promote);
+int  __hm_lru_evict(hashmap_t *, int32_t entry);
+void __hm_lru_trim(hashmap_t *);
+uint32_t __hm_lru_charge(hashmap_t *, int32_t entry);
 int  __hm_resize(hashmap_t *, uint32_t capacity);
+bool __hm_growable(hashmap_t *, uint32_t capacity);
+int  __hm_grow(hashmap_t *, uint32_t capacity);
+int  __hm_grow_arrays(hashmap_t *, uint32_t capacity, bool buckets);
+int  __hm_grow_spares(hashmap_t *, uint32_t old, skiplist_t ***spares, uint32_t *nspares);
+void __hm_free_spares(hashmap_t *, skiplist_t **spares, uint32_t nspares);
+uint32_t __hm_skiplist_moving(skiplist_t *skiplist, uint32_t mask);
+bool __hm_overloaded(hashmap_t *);
 int  __hm_ensure_capacity(hashmap_t *map);
+int  __hm_start_migration(hashmap_t *, uint32_t capacity);
+int  __hm_finish_migration(hashmap_t *);
+int  __hm_migrate(hashmap_t *, uint32_t hash);
+int  __hm_migrate_bucket(hashmap_t *, uint32_t at);
+skiplist_t *__hm_unmoved_skiplist(hashmap_t *, uint32_t hash);
+int  __hm_free_old(hashmap_t *);
+void __hm_foreach_buckets(hashmap_t *, struct __hashmap_bucket *buckets, uint32_t capacity,
+                          void (*predicate)(void *, void *, void *), void *args);
+void __hm_foreach_dense(hashmap_t *, void (*predicate)(void *, void *, void *), void *args);
+uint32_t __hm_next_live(hashmap_t *, uint32_t i);
+uint32_t __hm_live_count(hashmap_t *);
+void __hm_stats_buckets(struct __hashmap_bucket *buckets, struct __hashmap_entry *entries, void **vs,
+                        uint32_t capacity, hashmap_stats_t *stats);
+uint32_t __hm_chain_length(struct __hashmap_entry *entries, int32_t head);
+uint64_t __hm_nanotime();
+void __hm_prefetch_batch(hashmap_t *, void **keys, uint32_t *hashes, size_t n);
+void     __hm_parallel(uint32_t nthreads, void (*run)(void *, uint32_t), void *args);
+void    *__hm_parallel_thread(void *task);
+uint32_t __hm_threads(uint32_t nthreads, size_t work);
+void     __hm_live_fill(hashmap_t *, uint32_t n);
+struct __hm_build;
+void __hm_build_hash(void *build, uint32_t thread);
+void __hm_build_scatter(void *build, uint32_t thread);
+void __hm_build_link(void *build, uint32_t thread);
+int  __hm_build_finish(struct __hm_build *build);
+int  __hm_rehash_lists(hashmap_t *, hashmap_t *newmap);
+void __hm_rehash_count(void *relink, uint32_t thread);
+void __hm_rehash_relink(void *relink, uint32_t thread);
+void __hm_grow_relink(void *relink, uint32_t thread);
+int  __hm_init_swisstable(hashmap_t *);
+int  __hm_free_swisstable(hashmap_t *);
+int  __hm_init_robinhood(hashmap_t *);
+int  __hm_free_robinhood(hashmap_t *);
 int  __hm_ensure_ownpool(hashmap_t *);
 int  __hm_free_ownpool(hashmap_t *);
 int  __hm_free_buckets(hashmap_t *);
+int  __hm_alloc_entries(hashmap_t *, uint32_t capacity);
 int  __hm_free_entries(hashmap_t *);
+void __hm_unmap_entries(hashmap_t *, struct __hashmap_entry *entries, void **vs, void *keys, uint32_t capacity);
+int  __hm_free_skiplist(hashmap_t *, skiplist_t *skiplist);
+void __hm_reclaim_skiplist(void *map, void *skiplist);
+void __hm_reclaim_bytes(void *ownpool, void *ptr);
+skiplist_t *__hm_own_skiplist(hashmap_t *, struct __hashmap_bucket *bucket);
+int  __hm_close_snapshot(hashmap_t *);
+int  __hm_cow_save(hashmap_t *, void *slot);
+bool __hm_cow_shared(hashmap_t *, void **slot);
+int  __hm_cow_retire(hashmap_t *, void (*reclaim)(void *, void *), void *ctx, void *ptr);
+int  __hm_cow_replace(hashmap_t *, hashmap_t *newmap);
+int  __hm_free_views(hashmap_t *);
+int  __hm_compare_keys(void *a, void *b);
+int  __hm_compare_u64(void *a, void *b);
+int  __hm_copy_key(hashmap_t *, struct __hashmap_key *slot, struct __hashmap_key *key);
+void __hm_drop_key(hashmap_t *, struct __hashmap_key *slot);
+struct __hashmap_key *__hm_box_key(hashmap_t *, struct __hashmap_key *key);
+void __hm_drop_box(hashmap_t *, struct __hashmap_key *box);
 int  __hm_convert_to_list(hashmap_t *, struct __hashmap_bucket *bucket);
+int  __hm_cow_list(hashmap_t *, int32_t holder, uint32_t count);
 int  __hm_convert_to_skiplist(hashmap_t *, struct __hashmap_bucket *bucket);
-bool __hm_exists(hashmap_t *, void *key);
-bool __hm_list_exists(hashmap_t *, struct __hashmap_bucket *bucket, void *key);
-bool __hm_skiplist_exists(hashmap_t *, struct __hashmap_bucket *bucket, void *key);
+int32_t __hm_pop_entry(hashmap_t *);
+void __hm_reclaim_entry(void *map, void *entry);
+void __hm_reclaim_chain(void *map, void *head);
+bool __hm_exists(hashmap_t *, void *key, uint32_t hash);
+bool __hm_list_exists(hashmap_t *, int32_t head, void *key, uint32_t hash);
+bool __hm_skiplist_exists(hashmap_t *, skiplist_t *skiplist, void *key, uint32_t hash);
 int  __hm_insert(hashmap_t *, void *key, void *value, uint32_t hash, bool update);
 int  __hm_list_insert(hashmap_t *, struct __hashmap_bucket *bucket, void *key, void *value, uint32_t hash, bool update);
+int32_t __hm_list_slot(hashmap_t *);
+void __hm_list_link(hashmap_t *, struct __hashmap_bucket *bucket, int32_t entry, void *key, void *value,
+                    uint32_t hash);
 int  __hm_skiplist_insert(hashmap_t *, struct __hashmap_bucket *bucket, void *key, void *value, uint32_t hash,
                           bool update);
 int  __hm_try_list_insert(hashmap_t *, struct __hashmap_bucket *bucket, void *key, void *value, uint32_t hash,
                           bool update);
-int  __hm_remove(hashmap_t *, void *key);
-int  __hm_list_remove(hashmap_t *, struct __hashmap_bucket *bucket, void *key);
-int  __hm_skiplist_remove(hashmap_t *, struct __hashmap_bucket *bucket, void *key);
-int  __hm_try_skiplist_remove(hashmap_t *, struct __hashmap_bucket *bucket, void *key);
-int  __hm_set(hashmap_t *, void *key, void *value);
-int  __hm_list_set(hashmap_t *, struct __hashmap_bucket *bucket, void *key, void *value);
-int  __hm_skiplist_set(hashmap_t *, struct __hashmap_bucket *bucket, void *key, void *value);
-void *__hm_get(hashmap_t *map, void *key, void *default_value);
-void *__hm_list_get(hashmap_t *, struct __hashmap_bucket *bucket, void *key, void *default_value);
-void *__hm_skiplist_get(hashmap_t *, struct __hashmap_bucket *bucket, void *key, void *default_value);
-
-#define __hm_set_entry(ENTRY, K, V, HASH, NEXT) \
-    do {                                        \
-        (ENTRY)->k    = (K);                    \
-        (ENTRY)->v    = (V);                    \
-        (ENTRY)->hash = (HASH);                 \
-        (ENTRY)->next = (NEXT);                 \
+int  __hm_remove(hashmap_t *, void *key, uint32_t hash);
+int  __hm_list_remove(hashmap_t *, struct __hashmap_bucket *bucket, void *key, uint32_t hash);
+int  __hm_list_unlink(hashmap_t *, struct __hashmap_bucket *bucket, int32_t prev, int32_t entry);
+void __hm_list_free(hashmap_t *, int32_t entry);
+int  __hm_skiplist_remove(hashmap_t *, struct __hashmap_bucket *bucket, void *key, uint32_t hash);
+int  __hm_try_skiplist_remove(hashmap_t *, struct __hashmap_bucket *bucket, void *key, uint32_t hash);
+int  __hm_set(hashmap_t *, void *key, void *value, uint32_t hash);
+int  __hm_list_set(hashmap_t *, struct __hashmap_bucket *bucket, void *key, void *value, uint32_t hash);
+int  __hm_skiplist_set(hashmap_t *, struct __hashmap_bucket *bucket, void *key, void *value, uint32_t hash);
+void *__hm_get(hashmap_t *map, void *key, void *default_value, uint32_t hash);
+void *__hm_list_get(hashmap_t *, int32_t head, void *key, void *default_value, uint32_t hash);
+void *__hm_skiplist_get(hashmap_t *, skiplist_t *skiplist, void *key, void *default_value, uint32_t hash);
+
+#define __hm_set_entry(MAP, I, K, V, HASH, NEXT) \
+    do {                                         \
+        if ((MAP)->__ks) (MAP)->__ks[I] = (K);   \
+        (MAP)->__vs[I]           = (V);          \
+        (MAP)->__entries[I].hash = (HASH);       \
+        (MAP)->__entries[I].next = (NEXT);       \
     } while (0)
 
 #define __hm_capacity_for(CAPACITY)          \
@@ -55,39 +145,180 @@ void *__hm_skiplist_get(hashmap_t *, struct __hashmap_bucket *bucket, void *key,
     })
 
 #define __hm_bucket_for(MAP, HASH) (&(MAP)->__buckets[(HASH) & ((MAP)->__capacity - 1)])
+// Non-zero when the bucket of the hash could not be moved out of the old table. Changes then fail, while lookups read
+// the old bucket (see __hm_unmoved).
+#define __hm_migrate_for(MAP, HASH) ((MAP)->__old_buckets ? __hm_migrate((MAP), (HASH)) : 0)
+#define __hm_unmoved(MAP, HASH) ((MAP)->__old_buckets ? __hm_unmoved_skiplist((MAP), (HASH)) : NULL)
+// Old buckets move from the last one down, and the ones past those left to move are given back (see __hm_migrate), so
+// an old bucket is only read below them.
+#define __hm_old_moved(MAP, AT) \
+    ((AT) >= (MAP)->__old_capacity - (MAP)->__migrated || (MAP)->__old_buckets[AT].index == __HM_MIGRATED_INDEX)
 #define __hm_alloc_skiplist(POOL) (skiplist_t *) mpalloc((POOL), sizeof(skiplist_t))
-#define __hm_alloc_buckets(POOL, N) (struct __hashmap_bucket *) mpalloc((POOL), (N) * sizeof(struct __hashmap_bucket))
-#define __hm_alloc_entries(POOL, N) (struct __hashmap_entry *) mpalloc((POOL), (N) * sizeof(struct __hashmap_entry))
-#define __hm_load_max(CAPACITY) (((CAPACITY) >> 1) + ((CAPACITY) >> 2))
+#define __hm_alloc_buckets(POOL, N) \
+    (struct __hashmap_bucket *) mpmap((POOL), (size_t) (N) * sizeof(struct __hashmap_bucket))
+#define __hm_unmap_buckets(POOL, BUCKETS, N) mpunmap((POOL), (BUCKETS), (size_t) (N) * sizeof(struct __hashmap_bucket))
+#define __hm_key_size(MAP) ((MAP)->__flags & HASHMAP_BINARY_KEYS ? sizeof(struct __hashmap_key) : sizeof(void *))
+#define __hm_entry_size(MAP) (sizeof(struct __hashmap_entry) + sizeof(void *) + __hm_key_size(MAP))
+#define __hm_slot_size(MAP) (sizeof(struct __hashmap_bucket) + __hm_entry_size(MAP))
+// A map holds at most LOAD percent of its capacity (see hashmap_set_load_factor).
+#define __hm_load_limit(LOAD, CAPACITY) ((uint32_t) ((uint64_t) (CAPACITY) * (LOAD) / 100))
+// Entries a table of this capacity has room for. A compact map has none past its load limit, the others one per bucket,
+// which leaves room for entries that epoch reclamation has not handed back yet.
+#define __hm_entry_slots(MAP, CAPACITY) \
+    ((MAP)->__flags & HASHMAP_COMPACT ? __hm_load_limit((MAP)->__load, (CAPACITY)) : (CAPACITY))
+#define __hm_table_size(MAP, CAPACITY)                       \
+    ((size_t) (CAPACITY) * sizeof(struct __hashmap_bucket) + \
+     (size_t) __hm_entry_slots((MAP), (CAPACITY)) * __hm_entry_size(MAP))
+#define __hm_underloaded(MAP)                                       \
+    ((MAP)->__shrink && hashmap_capacity(MAP) > HASHMAP_MIN_SIZE && \
+     (uint64_t) hashmap_size(MAP) * 100 < (uint64_t) hashmap_capacity(MAP) * (MAP)->__shrink)
+// One bit per entry index tells the entries in chains from the ones on the free list (see hashmap_cursor_fetch).
+#define __hm_live_size(SLOTS) ((((size_t) (SLOTS) + 63) >> 6) * sizeof(uint64_t))
+#define __hm_live_set(MAP, I) ((MAP)->__live[(I) >> 6] |= 1ull << ((I) & 63))
+#define __hm_live_clear(MAP, I) ((MAP)->__live[(I) >> 6] &= ~(1ull << ((I) & 63)))
+// Cache maps link their entries by index from the most to the least recently used one (see hashmap_set_cache).
+#define __hm_lru_size(SLOTS) ((size_t) (SLOTS) * sizeof(struct __hashmap_lru))
+#define __hm_lru_update(MAP, I) ((MAP)->__lru ? __hm_lru_touch((MAP), (I)) : (void) 0)
+#define __hm_lru_expiry(TTL_MS) ((TTL_MS) ? __hm_nanotime() + (TTL_MS) * 1000000ull : 0)
+#define __hm_over_budget(MAP)                                                       \
+    (((MAP)->__cache.max_entries && (MAP)->__size > (MAP)->__cache.max_entries) || \
+     ((MAP)->__cache.max_bytes && (MAP)->__bytes > (MAP)->__cache.max_bytes))
+// Counters kept on the slow paths only, and only in builds with HASHMAP_STATS (see hashmap_stats).
+#ifdef HASHMAP_STATS
+#define __hm_count(MAP, COUNTER, N) ((MAP)->__counters.COUNTER += (N))
+#define __hm_now() __hm_nanotime()
+#else
+#define __hm_count(MAP, COUNTER, N) ((void) (N))
+#define __hm_now() ((uint64_t) 0)
+#endif
+// A map opened from a snapshot lives in a read-only file mapping (see hashmap_snapshot.c).
+#define __hm_read_only(MAP) ((MAP)->__flags & HASHMAP_SNAPSHOT)
+// While views of the map are live, every slot of the table arrays is passed here before it is written, and what views
+// still read is freed only once they are gone (see hashmap_view.c). Non-zero when the slot could not be saved, and
+// then it must not be written.
+#define __hm_cow(MAP, SLOT) ((MAP)->__cow ? __hm_cow_save((MAP), (SLOT)) : 0)
+#define __hm_cow_entry(MAP, I)                                                                       \
+    (__hm_cow((MAP), &(MAP)->__entries[I]) || __hm_cow((MAP), &(MAP)->__vs[I]) ||                    \
+     __hm_cow((MAP), (MAP)->__keys ? (void *) &(MAP)->__keys[I] : (void *) &(MAP)->__ks[I]))
+
+// Binary keys live in __keys, next to the entry of the same index, rather than behind the entry's k pointer.
+#define __hm_key_data(KEY) ((KEY)->len <= HASHMAP_INLINE_KEY ? (KEY)->bytes : (KEY)->ptr)
+#define __hm_key_view(VIEW, KEY, LEN)            \
+    do {                                         \
+        (VIEW)->len = (LEN);                     \
+        if ((LEN) <= HASHMAP_INLINE_KEY)         \
+            memcpy((VIEW)->bytes, (KEY), (LEN)); \
+        else                                     \
+            (VIEW)->ptr = (uint8_t *) (KEY);     \
+    } while (0)
+#define __hm_entry_key(MAP, I) ((MAP)->__keys ? (void *) &(MAP)->__keys[I] : (MAP)->__ks[I])
+// The stored hash settles most mismatches, so a chain walk only reads the key of an entry that probably matches.
+#define __hm_entry_equal(MAP, I, KEY, HASH)                                                    \
+    ((MAP)->__entries[I].hash == (HASH) &&                                                     \
+     ((MAP)->__keys                       ? __hm_compare_keys(&(MAP)->__keys[I], (KEY)) == 0   \
+      : (MAP)->__flags & HASHMAP_U64_KEYS ? (MAP)->__ks[I] == (KEY)                            \
+                                          : hashmap_equal((MAP), (MAP)->__ks[I], (KEY)) == 0))
+#define __hm_bytes_hash(MAP, KEY, LEN) ((uint32_t) wyhash((KEY), (LEN), (MAP)->__seed))
+// Integer keys are the key pointers themselves, so they are never allocated, and are compared where they are stored.
+#define __hm_u64_key(KEY) ((void *) (uintptr_t) (KEY))
+#define __hm_u64_hash(MAP, KEY) ((uint32_t) wyhash_u64((KEY), (MAP)->__seed))
+#define __hm_hash(MAP, KEY) \
+    ((MAP)->__flags & HASHMAP_U64_KEYS ? __hm_u64_hash((MAP), (uintptr_t) (KEY)) : hashmap_hash((MAP), (KEY)))
+_Static_assert(sizeof(void *) >= sizeof(uint64_t), "integer keys are stored in key pointers");
+
+// Bucket and chain links a lock-free reader may follow (see hashmap_rcu.c) are published with release stores.
+#define __hm_load(PTR) __atomic_load_n((PTR), __ATOMIC_ACQUIRE)
+#define __hm_store(PTR, VALUE) __atomic_store_n((PTR), (VALUE), __ATOMIC_RELEASE)
+
+enum { __HM_EMPTY = 0, __HM_LIST = 1, __HM_SKIPLIST = 2, __HM_MIGRATED = 3 };
+
+// A bucket is a single index: 0 when empty, one more than the head entry of a chain, or one less than minus the entry
+// whose value slot holds the bucket's skiplist. An entry index of -1 thus makes an empty bucket.
+#define __HM_MIGRATED_INDEX INT32_MIN
+#define __hm_type(INDEX)                              \
+    ((INDEX) > 0                      ? __HM_LIST     \
+     : (INDEX) == 0                   ? __HM_EMPTY    \
+     : (INDEX) == __HM_MIGRATED_INDEX ? __HM_MIGRATED \
+                                      : __HM_SKIPLIST)
+#define __hm_list_index(ENTRY) ((ENTRY) + 1)
+#define __hm_head(INDEX) ((INDEX) > 0 ? (INDEX) - 1 : -1)
+#define __hm_skiplist_index(ENTRY) (-(ENTRY) - 1)
+#define __hm_skiplist_entry(INDEX) (-(INDEX) - 1)
+#define __hm_skiplist(VS, INDEX) ((skiplist_t *) (VS)[__hm_skiplist_entry(INDEX)])
+
+// Percent of the capacity a map fills before it grows, unless set otherwise.
+#define __HM_LOAD 75
+
+// Engines that keep the map in a table of their own, with only string or callback keys.
+#define __HM_ENGINES (HASHMAP_ENGINE_SWISS | HASHMAP_ENGINE_ROBINHOOD)
+
+// Old buckets moved per operation while an incremental resize is in progress, besides the one being accessed. Inserts
+// fill the new table by half as the old one is moved, so two are enough to finish well before the next resize.
+#define __HM_MIGRATE_STEP 2
+// Keys hashed and prefetched together by the batched operations.
+#define __HM_BATCH 16
+// Work is only spread over threads that get at least this many pairs or buckets each.
+#define __HM_PARALLEL_GRAIN 8192
+#define __HM_THREADS_MAX 256
+// hashmap_build links each partition of about this many buckets in one go, so its buckets stay in cache.
+#define __HM_BUILD_PARTITION 8192
+#define __HM_BUILD_PARTITIONS_MAX 65536
+
+struct __hm_task {
+    void (*run)(void *, uint32_t);
+    void    *args;
+    uint32_t thread;
+};
+
+#define __hm_range(N, THREAD, NTHREADS, LO, HI)                \
+    do {                                                       \
+        (LO) = (size_t) (N) * (THREAD) / (NTHREADS);           \
+        (HI) = (size_t) (N) * ((THREAD) + 1) / (NTHREADS);     \
+    } while (0)
+#define __hm_resize_threads(MAP, CAPACITY) \
+    ((MAP)->__flags & HASHMAP_PARALLEL_RESIZE ? __hm_threads(0, (CAPACITY)) : 1)
+
+// Shared by the threads of one hashmap_build. Entries are hashed and counted per thread and partition, scattered into
+// order grouped by partition, then each partition is linked into its own range of buckets and of entries.
+struct __hm_build {
+    hashmap_t *map;
+    void     **keys, **values;
+    size_t     n;
+    uint32_t  *hashes;
+    uint32_t  *order;
+    uint32_t  *offsets;  // Per thread and partition, then where each partition starts in order and in the entries.
+    uint32_t  *used;     // Entries each partition filled.
+    uint32_t  *spilled;  // Entries each partition left for a skiplist, at the start of its range in order.
+    uint32_t   nthreads, partitions, shift, next;
+};
+
+// Shared by the threads of one resize. Each relinks a range of the old buckets, and the entries of an old bucket only
+// land in the new buckets congruent to it, so no two threads write the same bucket.
+struct __hm_relink {
+    hashmap_t *map, *newmap;
+    uint32_t   capacity;  // Of the old table.
+    uint32_t   nthreads;
+    uint32_t   offsets[__HM_THREADS_MAX + 1];  // Where the entries relinked by each thread start in the new map.
+};
 
-enum { __HM_EMPTY = 0, __HM_LIST = 1, __HM_SKIPLIST = 2 };
+#define __hm_build_partition(BUILD, HASH) (((HASH) & ((BUILD)->map->__capacity - 1)) >> (BUILD)->shift)
 
 int hashmap_init(hashmap_t *map, uint32_t capacity, uint32_t (*hash)(void *), int (*equal)(void *, void *),
                  memory_pool_t *pool) {
-    // Check capacity
-    return_if(-1, capacity > HASHMAP_MAX_SIZE);
-    capacity = capacity < HASHMAP_MIN_SIZE ? HASHMAP_MIN_SIZE : __hm_capacity_for(capacity);
-    // Allocate memory
-    struct __hashmap_bucket *buckets = __hm_alloc_buckets(pool, capacity);
-    return_if_null(-1, buckets);
-    struct __hashmap_entry *entries = __hm_alloc_entries(pool, capacity);
-    return_if_null((mpfree(pool, buckets), -1), entries);
-    memset(buckets, 0, capacity * sizeof(struct __hashmap_bucket));
-    // Set map members
-    map->__size     = 0;
-    map->__capacity = capacity;
-    map->__buckets  = buckets;
-    map->__entries  = entries;
-    map->__current  = 0;
-    map->__freelist = -1;
-    map->__pool     = pool;
-    map->__ownpool  = NULL;
-    map->__hash     = hash ? hash : cast_as(bkdr_hash, map->__hash);
-    map->__equal    = equal ? equal : cast_as(strcmp, map->__equal);
-    return 0;
+    return hashmap_init_with(map, capacity, hash, equal, pool, 0);
+}
+
+int hashmap_init_with(hashmap_t *map, uint32_t capacity, uint32_t (*hash)(void *), int (*equal)(void *, void *),
+                      memory_pool_t *pool, uint32_t flags) {
+    return __hm_init(map, capacity, hash, equal, pool, flags, __HM_LOAD);
 }
 
 int hashmap_free(hashmap_t *map) {
+    __hm_free_views(map);
+    return_if(__hm_close_snapshot(map), map->__flags & HASHMAP_SNAPSHOT);
+    __hm_free_swisstable(map);
+    __hm_free_robinhood(map);
+    __hm_free_old(map);
     __hm_free_buckets(map);
     __hm_free_entries(map);
     __hm_free_ownpool(map);
@@ -103,96 +334,1362 @@ int hashmap_destroy(hashmap_t *map) {
     map->__pool     = NULL;
     map->__hash     = NULL;
     map->__equal    = NULL;
+    map->__flags    = 0;
     return 0;
 }
 
 uint32_t hashmap_size(hashmap_t *map) {
+    return_if(swisstable_size(map->__swisstable), map->__swisstable);
+    return_if(robinhood_size(map->__robinhood), map->__robinhood);
     return map->__size;
 }
 
 uint32_t hashmap_capacity(hashmap_t *map) {
+    return_if(swisstable_capacity(map->__swisstable), map->__swisstable);
+    return_if(robinhood_capacity(map->__robinhood), map->__robinhood);
     return map->__capacity;
 }
 
 bool hashmap_exists(hashmap_t *map, void *key) {
-    return __hm_exists(map, key);
+    return_if(swisstable_exists(map->__swisstable, key), map->__swisstable);
+    return_if(robinhood_exists(map->__robinhood, key), map->__robinhood);
+    return_if(hashmap_exists_bytes(map, key, strlen((char *) key)), map->__keys);
+    uint32_t hash = __hm_hash(map, key);
+    __hm_migrate_for(map, hash);
+    return __hm_exists(map, key, hash);
 }
 
 int hashmap_insert(hashmap_t *map, void *key, void *value, bool update) {
+    return_if(-1, __hm_read_only(map));
+    return_if(swisstable_insert(map->__swisstable, key, value, update), map->__swisstable);
+    return_if(robinhood_insert(map->__robinhood, key, value, update), map->__robinhood);
+    return_if(hashmap_insert_bytes(map, key, strlen((char *) key), value, update), map->__keys);
     return_if(-1, __hm_ensure_capacity(map) != 0);
-    return __hm_insert(map, key, value, hashmap_hash(map, key), update);
+    uint32_t hash = __hm_hash(map, key);
+    return_if(-1, __hm_migrate_for(map, hash) != 0);
+    return __hm_insert(map, key, value, hash, update);
 }
 
 int hashmap_remove(hashmap_t *map, void *key) {
-    return __hm_remove(map, key);
+    return_if(-1, __hm_read_only(map));
+    return_if(__hm_maybe_shrink(map, swisstable_remove(map->__swisstable, key)), map->__swisstable);
+    return_if(__hm_maybe_shrink(map, robinhood_remove(map->__robinhood, key)), map->__robinhood);
+    return_if(hashmap_remove_bytes(map, key, strlen((char *) key)), map->__keys);
+    uint32_t hash = __hm_hash(map, key);
+    return_if(-1, __hm_migrate_for(map, hash) != 0);
+    return __hm_maybe_shrink(map, __hm_remove(map, key, hash));
 }
 
 int hashmap_set(hashmap_t *map, void *key, void *value) {
-    return __hm_set(map, key, value);
+    return_if(-1, __hm_read_only(map));
+    return_if(swisstable_set(map->__swisstable, key, value), map->__swisstable);
+    return_if(robinhood_set(map->__robinhood, key, value), map->__robinhood);
+    return_if(hashmap_set_bytes(map, key, strlen((char *) key), value), map->__keys);
+    uint32_t hash = __hm_hash(map, key);
+    return_if(-1, __hm_migrate_for(map, hash) != 0);
+    return __hm_set(map, key, value, hash);
 }
 
 void *hashmap_get(hashmap_t *map, void *key, void *default_value) {
-    return __hm_get(map, key, default_value);
+    return_if(swisstable_get(map->__swisstable, key, default_value), map->__swisstable);
+    return_if(robinhood_get(map->__robinhood, key, default_value), map->__robinhood);
+    return_if(hashmap_get_bytes(map, key, strlen((char *) key), default_value), map->__keys);
+    uint32_t hash = __hm_hash(map, key);
+    __hm_migrate_for(map, hash);
+    return __hm_get(map, key, default_value, hash);
+}
+
+bool hashmap_exists_bytes(hashmap_t *map, const void *key, uint32_t len) {
+    return_if(false, map->__keys == NULL);
+    struct __hashmap_key view;
+    __hm_key_view(&view, key, len);
+    uint32_t hash = __hm_bytes_hash(map, key, len);
+    __hm_migrate_for(map, hash);
+    return __hm_exists(map, &view, hash);
+}
+
+int hashmap_insert_bytes(hashmap_t *map, const void *key, uint32_t len, void *value, bool update) {
+    return_if(-1, map->__keys == NULL || __hm_read_only(map));
+    return_if(-1, __hm_ensure_capacity(map) != 0);
+    struct __hashmap_key view;
+    __hm_key_view(&view, key, len);
+    uint32_t hash = __hm_bytes_hash(map, key, len);
+    return_if(-1, __hm_migrate_for(map, hash) != 0);
+    return __hm_insert(map, &view, value, hash, update);
+}
+
+int hashmap_remove_bytes(hashmap_t *map, const void *key, uint32_t len) {
+    return_if(-1, map->__keys == NULL || __hm_read_only(map));
+    struct __hashmap_key view;
+    __hm_key_view(&view, key, len);
+    uint32_t hash = __hm_bytes_hash(map, key, len);
+    return_if(-1, __hm_migrate_for(map, hash) != 0);
+    return __hm_maybe_shrink(map, __hm_remove(map, &view, hash));
+}
+
+int hashmap_set_bytes(hashmap_t *map, const void *key, uint32_t len, void *value) {
+    return_if(-1, map->__keys == NULL || __hm_read_only(map));
+    struct __hashmap_key view;
+    __hm_key_view(&view, key, len);
+    uint32_t hash = __hm_bytes_hash(map, key, len);
+    return_if(-1, __hm_migrate_for(map, hash) != 0);
+    return __hm_set(map, &view, value, hash);
+}
+
+void *hashmap_get_bytes(hashmap_t *map, const void *key, uint32_t len, void *default_value) {
+    return_if(default_value, map->__keys == NULL);
+    struct __hashmap_key view;
+    __hm_key_view(&view, key, len);
+    uint32_t hash = __hm_bytes_hash(map, key, len);
+    __hm_migrate_for(map, hash);
+    return __hm_get(map, &view, default_value, hash);
+}
+
+bool hashmap_exists_u64(hashmap_t *map, uint64_t key) {
+    return_if(false, !(map->__flags & HASHMAP_U64_KEYS));
+    uint32_t hash = __hm_u64_hash(map, key);
+    __hm_migrate_for(map, hash);
+    return __hm_exists(map, __hm_u64_key(key), hash);
+}
+
+int hashmap_insert_u64(hashmap_t *map, uint64_t key, void *value, bool update) {
+    return_if(-1, !(map->__flags & HASHMAP_U64_KEYS) || __hm_read_only(map));
+    return_if(-1, __hm_ensure_capacity(map) != 0);
+    uint32_t hash = __hm_u64_hash(map, key);
+    return_if(-1, __hm_migrate_for(map, hash) != 0);
+    return __hm_insert(map, __hm_u64_key(key), value, hash, update);
+}
+
+int hashmap_remove_u64(hashmap_t *map, uint64_t key) {
+    return_if(-1, !(map->__flags & HASHMAP_U64_KEYS) || __hm_read_only(map));
+    uint32_t hash = __hm_u64_hash(map, key);
+    return_if(-1, __hm_migrate_for(map, hash) != 0);
+    return __hm_maybe_shrink(map, __hm_remove(map, __hm_u64_key(key), hash));
+}
+
+int hashmap_set_u64(hashmap_t *map, uint64_t key, void *value) {
+    return_if(-1, !(map->__flags & HASHMAP_U64_KEYS) || __hm_read_only(map));
+    uint32_t hash = __hm_u64_hash(map, key);
+    return_if(-1, __hm_migrate_for(map, hash) != 0);
+    return __hm_set(map, __hm_u64_key(key), value, hash);
+}
+
+void *hashmap_get_u64(hashmap_t *map, uint64_t key, void *default_value) {
+    return_if(default_value, !(map->__flags & HASHMAP_U64_KEYS));
+    uint32_t hash = __hm_u64_hash(map, key);
+    __hm_migrate_for(map, hash);
+    return __hm_get(map, __hm_u64_key(key), default_value, hash);
+}
+
+const void *hashmap_key_data(void *key) {
+    return __hm_key_data((struct __hashmap_key *) key);
+}
+
+uint32_t hashmap_key_length(void *key) {
+    return ((struct __hashmap_key *) key)->len;
+}
+
+void hashmap_get_batch(hashmap_t *map, void **keys, void **values, size_t n, void *default_value) {
+    if (map->__swisstable || map->__robinhood || map->__keys) {
+        for (size_t i = 0; i < n; i++) values[i] = hashmap_get(map, keys[i], default_value);
+        return;
+    }
+    uint32_t hashes[__HM_BATCH];
+    for (size_t at = 0; at < n; at += __HM_BATCH) {
+        size_t count = n - at < __HM_BATCH ? n - at : __HM_BATCH;
+        __hm_prefetch_batch(map, &keys[at], hashes, count);
+        for (size_t i = 0; i < count; i++) {
+            values[at + i] = __hm_get(map, keys[at + i], default_value, hashes[i]);
+        }
+    }
+}
+
+size_t hashmap_exists_batch(hashmap_t *map, void **keys, bool *exists, size_t n) {
+    size_t found = 0;
+    if (map->__swisstable || map->__robinhood || map->__keys) {
+        for (size_t i = 0; i < n; i++) found += exists[i] = hashmap_exists(map, keys[i]);
+        return found;
+    }
+    uint32_t hashes[__HM_BATCH];
+    for (size_t at = 0; at < n; at += __HM_BATCH) {
+        size_t count = n - at < __HM_BATCH ? n - at : __HM_BATCH;
+        __hm_prefetch_batch(map, &keys[at], hashes, count);
+        for (size_t i = 0; i < count; i++) {
+            found += exists[at + i] = __hm_exists(map, keys[at + i], hashes[i]);
+        }
+    }
+    return found;
+}
+
+size_t hashmap_insert_batch(hashmap_t *map, void **keys, void **values, size_t n, bool update) {
+    size_t inserted = 0;
+    return_if(inserted, __hm_read_only(map));
+    if (map->__swisstable || map->__robinhood || map->__keys) {
+        for (size_t i = 0; i < n; i++) inserted += hashmap_insert(map, keys[i], values[i], update) == 0;
+        return inserted;
+    }
+    uint32_t hashes[__HM_BATCH];
+    for (size_t at = 0; at < n; at += __HM_BATCH) {
+        size_t count = n - at < __HM_BATCH ? n - at : __HM_BATCH;
+        __hm_prefetch_batch(map, &keys[at], hashes, count);
+        for (size_t i = 0; i < count; i++) {
+            // A resize in the middle of the batch only costs the prefetches, the hashes stay valid.
+            return_if(inserted, __hm_ensure_capacity(map) != 0);
+            inserted += __hm_migrate_for(map, hashes[i]) == 0 &&
+                        __hm_insert(map, keys[at + i], values[at + i], hashes[i], update) == 0;
+        }
+    }
+    return inserted;
+}
+
+// Loads an empty map from n pairs with up to nthreads threads (0 for one per CPU). A key given more than once keeps
+// the first copy of the key and the last value, as inserting them in order with update would. Anything but an empty
+// map of the default engine with pointer or integer keys, and not a cache, is loaded with hashmap_insert_batch instead.
+int hashmap_build(hashmap_t *map, void **keys, void **values, size_t n, uint32_t nthreads) {
+    return_if(-1, __hm_read_only(map) || n > __hm_load_limit(map->__load, HASHMAP_MAX_SIZE));
+    if (map->__swisstable || map->__robinhood || map->__keys || map->__epoch || map->__lru || hashmap_size(map) != 0) {
+        return hashmap_insert_batch(map, keys, values, n, true) == n ? 0 : -1;
+    }
+    return_if(-1, hashmap_clear(map) != 0);
+    return_if(0, n == 0);
+    uint32_t capacity = HASHMAP_MIN_SIZE;
+    while (__hm_load_limit(map->__load, capacity) < n) capacity <<= 1;
+    if (capacity > map->__capacity) return_if(-1, __hm_resize(map, capacity) != 0);
+    uint32_t partitions = map->__capacity / __HM_BUILD_PARTITION;
+    if (partitions < 1) partitions = 1;
+    if (partitions > __HM_BUILD_PARTITIONS_MAX) partitions = __HM_BUILD_PARTITIONS_MAX;
+    struct __hm_build build;
+    memset(&build, 0, sizeof(build));
+    build.map        = map;
+    build.keys       = keys;
+    build.values     = values;
+    build.n          = n;
+    build.nthreads   = __hm_threads(nthreads, n);
+    build.partitions = partitions;
+    build.shift      = __builtin_ctz(map->__capacity) - __builtin_ctz(partitions);
+    size_t counters  = (size_t) (build.nthreads + 3) * partitions + 1;
+    build.hashes     = (uint32_t *) mpmap(map->__pool, n * sizeof(uint32_t));
+    build.order      = build.hashes ? (uint32_t *) mpmap(map->__pool, n * sizeof(uint32_t)) : NULL;
+    build.offsets    = build.order ? (uint32_t *) mpmap(map->__pool, counters * sizeof(uint32_t)) : NULL;
+    int ret          = -1;
+    if (build.offsets) {
+        memset(build.offsets, 0, counters * sizeof(uint32_t));
+        build.used    = &build.offsets[(size_t) (build.nthreads + 1) * build.partitions + 1];
+        build.spilled = &build.used[build.partitions];
+        __hm_parallel(build.nthreads, __hm_build_hash, &build);
+        // Each thread scatters its part of a partition after the parts of the threads before it, so a partition keeps
+        // its pairs in input order, which the duplicate policy needs.
+        uint32_t *starts = &build.offsets[(size_t) build.nthreads * build.partitions];
+        for (uint32_t p = 0, at = 0; p < build.partitions; p++) {
+            starts[p] = at;
+            for (uint32_t t = 0; t < build.nthreads; t++) {
+                uint32_t *offset = &build.offsets[(size_t) t * build.partitions + p];
+                uint32_t  count  = *offset;
+                *offset          = at;
+                at += count;
+            }
+        }
+        starts[build.partitions] = (uint32_t) n;
+        __hm_parallel(build.nthreads, __hm_build_scatter, &build);
+        __hm_parallel(build.nthreads, __hm_build_link, &build);
+        ret = __hm_build_finish(&build);
+    }
+    if (build.offsets) mpunmap(map->__pool, build.offsets, counters * sizeof(uint32_t));
+    if (build.order) mpunmap(map->__pool, build.order, n * sizeof(uint32_t));
+    if (build.hashes) mpunmap(map->__pool, build.hashes, n * sizeof(uint32_t));
+    return ret;
 }
 
 int hashmap_clear(hashmap_t *map) {
+    return_if(-1, __hm_read_only(map));
+    return_if(__hm_maybe_shrink(map, swisstable_clear(map->__swisstable)), map->__swisstable);
+    return_if(__hm_maybe_shrink(map, robinhood_clear(map->__robinhood)), map->__robinhood);
+    __hm_free_old(map);
+    if (map->__cow) {
+        // Views still read the table and its keys, so the map starts over in a new one.
+        hashmap_t newmap;
+        return_if(-1, __hm_init_like(map, &newmap, map->__capacity, map->__load) != 0);
+        return_if(-1, __hm_replace(map, &newmap) != 0);
+        map->__generation++;
+        return __hm_maybe_shrink(map, 0);
+    }
     map->__size     = 0;
     map->__current  = 0;
     map->__freelist = -1;
+    map->__lru_head = -1;
+    map->__lru_tail = -1;
+    map->__bytes    = 0;
     __hm_free_ownpool(map);
     memset(map->__buckets, 0, map->__capacity * sizeof(struct __hashmap_bucket));
-    return 0;
+    memset(map->__live, 0, __hm_live_size(__hm_entry_slots(map, map->__capacity)));
+    map->__generation++;
+    // Under a low watermark an emptied map gives its table back too.
+    return __hm_maybe_shrink(map, 0);
 }
 
 int hashmap_resize(hashmap_t *map, uint32_t capacity) {
-    return_if(-1, capacity < map->__size || capacity > HASHMAP_MAX_SIZE);  // Check capacity
-    return __hm_resize(map, __hm_capacity_for(capacity));
+    return_if(-1, __hm_read_only(map));
+    return_if(-1, capacity < hashmap_size(map) || capacity > HASHMAP_MAX_SIZE);  // Check capacity
+    return_if(swisstable_resize(map->__swisstable, __hm_capacity_for(capacity)), map->__swisstable);
+    return_if(robinhood_resize(map->__robinhood, __hm_capacity_for(capacity)), map->__robinhood);
+    return_if(-1, __hm_finish_migration(map) != 0);
+    capacity = __hm_capacity_for(capacity);
+    // A compact map has no entries past its load limit, so the table cannot be any fuller.
+    while ((map->__flags & HASHMAP_COMPACT) && __hm_load_limit(map->__load, capacity) < map->__size) capacity <<= 1;
+    return __hm_resize(map, capacity);
+}
+
+// Rebuilds the table at no more than half load, with the entries moved to the front of the entry arrays in bucket
+// order. The old arrays go back to the pool, or to the system when they were mapped.
+int hashmap_compact(hashmap_t *map) {
+    return_if(-1, __hm_read_only(map) || map->__epoch);
+    uint32_t capacity = __hm_compact_capacity(hashmap_size(map));
+    if (capacity > hashmap_capacity(map)) capacity = hashmap_capacity(map);
+    return_if(swisstable_resize(map->__swisstable, capacity), map->__swisstable);
+    return_if(robinhood_resize(map->__robinhood, capacity), map->__robinhood);
+    return_if(-1, __hm_finish_migration(map) != 0);
+    return __hm_resize(map, capacity);
+}
+
+// Removals that leave the map below percent of its capacity compact it. At most 25, as a compacted map is more than a
+// quarter full and must not shrink again right away. 0 turns it off.
+int hashmap_set_low_watermark(hashmap_t *map, uint32_t percent) {
+    return_if(-1, percent > 25 || map->__epoch);
+    map->__shrink = percent;
+    return 0;
+}
+
+// Lets the map fill percent of its capacity, from 50 to 100, before it grows (75 unless set). A fuller table spends
+// fewer bytes per key on buckets, and in a compact map on entries too, for longer chains. A map that is over the new
+// limit is rebuilt in a table big enough, and so is a compact map, whose entry arrays end at the limit.
+int hashmap_set_load_factor(hashmap_t *map, uint32_t percent) {
+    return_if(-1, percent < 50 || percent > 100 || __hm_read_only(map) || map->__epoch);
+    return_if(-1, map->__swisstable || map->__robinhood || __hm_finish_migration(map) != 0);
+    uint32_t capacity = map->__capacity;
+    while (__hm_load_limit(percent, capacity) < map->__size && capacity < HASHMAP_MAX_SIZE) capacity <<= 1;
+    return_if(-1, __hm_load_limit(percent, capacity) < map->__size);
+    if (!(map->__flags & HASHMAP_COMPACT)) {
+        // The load only changes once the table has room for it, so a failed resize leaves the map as it was.
+        return_if(-1, capacity > map->__capacity && __hm_resize(map, capacity) != 0);
+        map->__load = percent;
+        return 0;
+    }
+    hashmap_t newmap;
+    return_if(-1, __hm_rehash(map, &newmap, capacity, percent) != 0);
+    return_if(-1, __hm_replace(map, &newmap) != 0);
+    map->__generation++;
+    return 0;
+}
+
+// Limits a map made with HASHMAP_LRU to cache->max_entries entries and cache->max_bytes bytes, 0 for no limit. An
+// insert past a limit evicts the least recently used entries, each handed to cache->evict, if set, with the key as
+// hashmap_foreach passes it. An entry costs cache->weigh(key, value) bytes, or without a weigh what the map spends on
+// it. Entries inserted or updated from now on expire cache->ttl_ms later (0 for never), and go the same way as
+// evicted ones the next time they are looked up.
+int hashmap_set_cache(hashmap_t *map, const hashmap_cache_t *cache) {
+    return_if(-1, map->__lru == NULL || cache->max_entries >= __hm_load_limit(map->__load, HASHMAP_MAX_SIZE));
+    // A table with room for one entry past max_entries, inserted before the eviction, never grows, so a full cache
+    // never stops to rehash. The settings only change once it has that room, so a failed resize leaves them as they
+    // were.
+    uint32_t capacity = map->__capacity;
+    while (__hm_load_limit(map->__load, capacity) <= cache->max_entries) capacity <<= 1;
+    if (capacity > map->__capacity) return_if(-1, __hm_resize(map, capacity) != 0);
+    map->__cache = *cache;
+    __hm_lru_trim(map);
+    return 0;
+}
+
+// Inserts into a cache like hashmap_insert, with an entry that expires ttl_ms from now (0 for never) rather than after
+// the cache's TTL.
+int hashmap_insert_ttl(hashmap_t *map, void *key, void *value, uint64_t ttl_ms, bool update) {
+    return_if(-1, map->__lru == NULL || hashmap_insert(map, key, value, update) != 0);
+    // Added or updated, the entry is now the most recently used one.
+    map->__lru[map->__lru_head].expires = __hm_lru_expiry(ttl_ms);
+    return 0;
 }
 
 void hashmap_foreach(hashmap_t *map, void (*predicate)(void *, void *, void *), void *args) {
-    for (uint32_t i = 0; i < map->__capacity; i++) {
-        if (map->__buckets[i].type == __HM_LIST) {
-            for (int32_t j = map->__buckets[i].entry; j != -1; j = map->__entries[j].next) {
-                predicate(map->__entries[j].k, map->__entries[j].v, args);
-            }
-        } else {
-            skiplist_foreach(map->__buckets[i].skiplist, predicate, args);
+    if (map->__swisstable) {
+        swisstable_foreach(map->__swisstable, predicate, args);
+        return;
+    }
+    if (map->__robinhood) {
+        robinhood_foreach(map->__robinhood, predicate, args);
+        return;
+    }
+    if (map->__old_buckets == NULL) {
+        __hm_foreach_dense(map, predicate, args);
+        return;
+    }
+    // Each old bucket is still in the old table or already spread over its new buckets.
+    for (uint32_t i = 0; i < map->__old_capacity; i++) {
+        if (!__hm_old_moved(map, i)) {
+            __hm_foreach_buckets(map, &map->__old_buckets[i], 1, predicate, args);
+            continue;
+        }
+        for (uint32_t j = i; j < map->__capacity; j += map->__old_capacity) {
+            __hm_foreach_buckets(map, &map->__buckets[j], 1, predicate, args);
         }
     }
 }
 
-int __hm_resize(hashmap_t *map, uint32_t capacity) {
-    hashmap_t newmap;
-    int       ret = hashmap_init(&newmap, capacity, map->__hash, map->__equal, map->__pool);
+int hashmap_cursor_init(hashmap_t *map, hashmap_cursor_t *cursor) {
+    memset(cursor, 0, sizeof(hashmap_cursor_t));
+    if (map->__swisstable) {
+        cursor->__generation = swisstable_generation(map->__swisstable);
+        return 0;
+    }
+    if (map->__robinhood) {
+        cursor->__generation = robinhood_generation(map->__robinhood);
+        return 0;
+    }
+    // The scan starts from a settled table, never from one an incremental resize is halfway through.
+    return_if(-1, __hm_finish_migration(map) != 0);
+    cursor->__generation = map->__generation;
+    return 0;
+}
+
+int hashmap_cursor_next(hashmap_t *map, hashmap_cursor_t *cursor, void **key, void **value) {
+    return hashmap_cursor_fetch(map, cursor, key, value, 1);
+}
+
+// Entries in chains are read straight down the dense arrays, skipping free slots by the live bits, then skiplist
+// buckets node by node. Inserts and removes in between are fine: an entry present all along is returned exactly once,
+// one added or removed meanwhile may or may not be. Anything that moves entries (a resize, a chain turning into a
+// skiplist or back, or a change to a skiplist) fails the next call with -1, and the scan has to start over.
+int hashmap_cursor_fetch(hashmap_t *map, hashmap_cursor_t *cursor, void **keys, void **values, uint32_t n) {
+    uint32_t count = 0;
+    if (map->__swisstable) {
+        return_if(-1, cursor->__generation != swisstable_generation(map->__swisstable));
+        for (uint32_t i; count < n; count++) {
+            i = swisstable_next(map->__swisstable, cursor->__index, &keys[count], &values[count]);
+            if (i >= swisstable_capacity(map->__swisstable)) break;
+            cursor->__index = i + 1;
+        }
+        return count;
+    }
+    if (map->__robinhood) {
+        return_if(-1, cursor->__generation != robinhood_generation(map->__robinhood));
+        for (uint32_t i; count < n; count++) {
+            i = robinhood_next(map->__robinhood, cursor->__index, &keys[count], &values[count]);
+            if (i >= robinhood_capacity(map->__robinhood)) break;
+            cursor->__index = i + 1;
+        }
+        return count;
+    }
+    return_if(-1, cursor->__generation != map->__generation || map->__old_buckets);
+    for (uint32_t i; count < n && (i = __hm_next_live(map, cursor->__index)) < map->__current; count++) {
+        keys[count]     = __hm_entry_key(map, i);
+        values[count]   = map->__vs[i];
+        cursor->__index = i + 1;
+    }
+    // Skiplist buckets are looked for only if the chains do not hold every entry.
+    if (count < n && cursor->__bucket == 0 && cursor->__node == 0 && __hm_live_count(map) == map->__size) {
+        cursor->__bucket = map->__capacity;
+    }
+    for (; count < n && cursor->__bucket < map->__capacity; cursor->__bucket++, cursor->__node = 0) {
+        int32_t index = map->__buckets[cursor->__bucket].index;
+        if (__hm_type(index) != __HM_SKIPLIST) continue;
+        struct __skiplist_node *node = __hm_skiplist(map->__vs, index)->__head->forward[0];
+        for (uint32_t j = 0; node && j < cursor->__node; j++) node = node->forward[0];
+        for (; node && count < n; node = node->forward[0], cursor->__node++, count++) {
+            keys[count]   = node->k;
+            values[count] = node->v;
+        }
+        if (node) break;  // Full in the middle of this skiplist.
+    }
+    return count;
+}
+
+int hashmap_stats(hashmap_t *map, hashmap_stats_t *stats) {
+    memset(stats, 0, sizeof(hashmap_stats_t));
+    stats->size          = hashmap_size(map);
+    stats->capacity      = hashmap_capacity(map);
+    stats->load_factor   = (double) stats->size / stats->capacity;
+    stats->pool_bytes    = memory_pool_size(map->__pool);
+    stats->ownpool_bytes = memory_pool_size(map->__ownpool);
+#ifdef HASHMAP_STATS
+    stats->to_skiplist = map->__counters.to_skiplist;
+    stats->to_list     = map->__counters.to_list;
+    stats->resizes     = map->__counters.resizes;
+    stats->resize_ns   = map->__counters.resize_ns;
+#endif
+    return_if(0, map->__swisstable);
+    if (map->__robinhood) {
+        // A probe is the open-addressing chain: the slots a lookup of a present key walks.
+        stats->longest_chain = robinhood_longest_probe(map->__robinhood);
+        stats->table_bytes   = (size_t) stats->capacity * sizeof(struct __robinhood_meta) +
+                               (size_t) stats->capacity * sizeof(struct __robinhood_slot);
+        return 0;
+    }
+    uint32_t slots     = __hm_entry_slots(map, map->__capacity);
+    stats->table_bytes = __hm_table_size(map, map->__capacity) + __hm_live_size(slots);
+    stats->freelist    = __hm_chain_length(map->__entries, map->__freelist);
+    if (map->__lru) stats->table_bytes += __hm_lru_size(slots);
+    __hm_stats_buckets(map->__buckets, map->__entries, map->__vs, map->__capacity, stats);
+    if (map->__old_buckets) {
+        // Entries are shared with the new table, and the moved buckets at the end of the old one are given back.
+        uint32_t left = map->__old_capacity - map->__migrated;
+        stats->table_bytes += (size_t) left * sizeof(struct __hashmap_bucket);
+        __hm_stats_buckets(map->__old_buckets, map->__entries, map->__vs, left, stats);
+    }
+    return 0;
+}
+
+// The body of hashmap_init_with, for a map that fills load percent of its capacity before it grows.
+int __hm_init(hashmap_t *map, uint32_t capacity, uint32_t (*hash)(void *), int (*equal)(void *, void *),
+              memory_pool_t *pool, uint32_t flags, uint32_t load) {
+    // Check capacity
+    return_if(-1, capacity > HASHMAP_MAX_SIZE);
+    return_if(-1, (flags & __HM_ENGINES) == __HM_ENGINES);
+    return_if(-1, (flags & __HM_ENGINES) && (flags & HASHMAP_BINARY_KEYS));
+    return_if(-1, (flags & HASHMAP_U64_KEYS) && (flags & (__HM_ENGINES | HASHMAP_BINARY_KEYS)));
+    return_if(-1, (flags & HASHMAP_LRU) && (flags & (__HM_ENGINES | HASHMAP_INCREMENTAL_RESIZE)));
+    return_if(-1, (flags & HASHMAP_COMPACT) && (flags & __HM_ENGINES));
+    capacity = capacity < HASHMAP_MIN_SIZE ? HASHMAP_MIN_SIZE : __hm_capacity_for(capacity);
+    // Set map members
+    map->__size         = 0;
+    map->__capacity     = capacity;
+    map->__buckets      = NULL;
+    map->__entries      = NULL;
+    map->__ks           = NULL;
+    map->__vs           = NULL;
+    map->__current      = 0;
+    map->__freelist     = -1;
+    map->__pool         = pool;
+    map->__ownpool      = NULL;
+    map->__hash         = hash;
+    map->__seed         = hash_seed();
+    map->__equal        = equal ? equal : cast_as(strcmp, map->__equal);
+    map->__keys         = NULL;
+    map->__flags        = flags;
+    map->__swisstable   = NULL;
+    map->__robinhood    = NULL;
+    map->__old_buckets  = NULL;
+    map->__old_capacity = 0;
+    map->__migrated     = 0;
+    map->__epoch        = NULL;
+    map->__live         = NULL;
+    map->__generation   = 0;
+    map->__shrink       = 0;
+    map->__load         = load;
+    map->__cow          = NULL;
+    map->__lru          = NULL;
+    map->__lru_head     = -1;
+    map->__lru_tail     = -1;
+    map->__bytes        = 0;
+    memset(&map->__cache, 0, sizeof(map->__cache));
+#ifdef HASHMAP_STATS
+    memset(&map->__counters, 0, sizeof(map->__counters));
+#endif
+    // Allocate memory
+    if (flags & HASHMAP_ENGINE_SWISS) return __hm_init_swisstable(map);
+    if (flags & HASHMAP_ENGINE_ROBINHOOD) return __hm_init_robinhood(map);
+    struct __hashmap_bucket *buckets = __hm_alloc_buckets(pool, capacity);
+    return_if_null(-1, buckets);
+    return_if((__hm_unmap_buckets(pool, buckets, capacity), -1), __hm_alloc_entries(map, capacity) != 0);
+    memset(buckets, 0, capacity * sizeof(struct __hashmap_bucket));
+    map->__buckets = buckets;
+    // Skiplist buckets order binary keys with it.
+    if (flags & HASHMAP_BINARY_KEYS) map->__equal = __hm_compare_keys;
+    if (flags & HASHMAP_U64_KEYS) map->__equal = __hm_compare_u64;
+    return 0;
+}
+
+// An empty map that hashes and behaves like map, in a table of its own.
+int __hm_init_like(hashmap_t *map, hashmap_t *newmap, uint32_t capacity, uint32_t load) {
+    int ret = __hm_init(newmap, capacity, map->__hash, map->__equal, map->__pool, map->__flags, load);
     return_if(-1, ret != 0);
+    newmap->__epoch      = map->__epoch;
+    newmap->__seed       = map->__seed;  // Stored hashes are reused, so the new map must keep hashing the same way.
+    newmap->__generation = map->__generation;
+    newmap->__shrink     = map->__shrink;
+    newmap->__cache      = map->__cache;
+#ifdef HASHMAP_STATS
+    newmap->__counters = map->__counters;
+#endif
+    return 0;
+}
+
+int __hm_rehash(hashmap_t *map, hashmap_t *newmap, uint32_t capacity, uint32_t load) {
+    int ret = __hm_init_like(map, newmap, capacity, load);
+    return_if(-1, ret != 0);
+    // With no key copies to make, a table that does not shrink has its chains relinked directly. Otherwise the entries
+    // are laid out again by their new bucket. Either way they end up packed at the front of the new arrays.
+    if (map->__keys == NULL && newmap->__capacity >= map->__capacity)
+        ret = __hm_rehash_lists(map, newmap);
+    else
+        ret = __hm_rehash_sorted(map, newmap);
+    if (ret == 0) ret = __hm_rehash_skiplists(map, newmap);
+    if (ret == 0 && map->__lru) ret = __hm_rehash_lru(map, newmap);
+    return_if((hashmap_free(newmap), -1), ret != 0);
+    return 0;
+}
+
+// Moves the map into the table newmap was rehashed into. Under views the old table is theirs until they are gone, and
+// if it cannot be handed over, newmap is freed and the map left as it was.
+int __hm_replace(hashmap_t *map, hashmap_t *newmap) {
+    return_if(__hm_cow_replace(map, newmap), map->__cow);
+    hashmap_free(map);
+    memcpy(map, newmap, sizeof(*newmap));
+    return 0;
+}
+
+int __hm_resize(hashmap_t *map, uint32_t capacity) {
+    uint64_t start = __hm_now();
+    int      ret   = 0;
+    if (__hm_growable(map, capacity)) {
+        ret = __hm_grow(map, capacity);
+    } else {
+        hashmap_t newmap;
+        ret = __hm_rehash(map, &newmap, capacity, map->__load);
+        if (ret == 0) ret = __hm_replace(map, &newmap);
+    }
+    map->__generation++;
+    __hm_count(map, resizes, ret == 0);
+    __hm_count(map, resize_ns, __hm_now() - start);
+    return ret;
+}
+
+// Each thread counts the entries in its range of chains first, so that it knows where to put them in the new map.
+int __hm_rehash_lists(hashmap_t *map, hashmap_t *newmap) {
+    struct __hm_relink relink;
+    relink.map      = map;
+    relink.newmap   = newmap;
+    relink.capacity = map->__capacity;
+    relink.nthreads = __hm_resize_threads(map, map->__capacity);
+    __hm_parallel(relink.nthreads, __hm_rehash_count, &relink);
+    relink.offsets[relink.nthreads] = 0;
+    for (uint32_t t = 0, at = 0; t <= relink.nthreads; t++) {
+        uint32_t count    = relink.offsets[t];
+        relink.offsets[t] = at;
+        at += count;
+    }
+    __hm_parallel(relink.nthreads, __hm_rehash_relink, &relink);
+    newmap->__size    = relink.offsets[relink.nthreads];
+    newmap->__current = newmap->__size;
+    __hm_live_fill(newmap, newmap->__size);
+    return 0;
+}
+
+// Entries are counted per new bucket, then each chain is given a run of consecutive entries, the runs in bucket order.
+int __hm_rehash_sorted(hashmap_t *map, hashmap_t *newmap) {
+    uint32_t at = 0;
+    bool     overfull = false;
     for (uint32_t i = 0; i < map->__capacity; i++) {
-        switch (map->__buckets[i].type) {
-            case __HM_LIST: {
-                for (int32_t j = map->__buckets[i].entry; j != -1; j = map->__entries[j].next) {
-                    ret = __hm_insert(&newmap, map->__entries[j].k, map->__entries[j].v, map->__entries[j].hash, false);
-                    return_if((hashmap_free(&newmap), -1), ret != 0);
-                }
-                break;
+        if (map->__buckets[i].index <= 0) continue;
+        for (int32_t j = map->__buckets[i].index - 1; j >= 0; j = map->__entries[j].next) {
+            __hm_bucket_for(newmap, map->__entries[j].hash)->index++;
+        }
+    }
+    // Each bucket starts out as minus the end of its run, which is then filled backwards.
+    for (uint32_t i = 0; i < newmap->__capacity; i++) {
+        struct __hashmap_bucket *bucket = &newmap->__buckets[i];
+        if (bucket->index == 0) continue;
+        overfull |= bucket->index > HASHMAP_THRESHOLD && newmap->__lru == NULL;
+        at += bucket->index;
+        bucket->index = -(int32_t) at;
+    }
+    for (uint32_t i = 0; i < map->__capacity; i++) {
+        if (map->__buckets[i].index <= 0) continue;
+        for (int32_t j = map->__buckets[i].index - 1; j >= 0; j = map->__entries[j].next) {
+            uint32_t                 hash   = map->__entries[j].hash;
+            struct __hashmap_bucket *bucket = __hm_bucket_for(newmap, hash);
+            int32_t                  next   = bucket->index < 0 ? -1 : __hm_head(bucket->index);
+            int32_t                  entry  = bucket->index < 0 ? -bucket->index - 1 : next - 1;
+            if (map->__keys) return_if(-1, __hm_copy_key(newmap, &newmap->__keys[entry], &map->__keys[j]) != 0);
+            __hm_set_entry(newmap, entry, map->__ks[j], map->__vs[j], hash, next);
+            bucket->index = __hm_list_index(entry);
+        }
+    }
+    newmap->__size    = at;
+    newmap->__current = at;
+    __hm_live_fill(newmap, at);
+    // A shrink can fold several old chains into one that is longer than a list may be, except in a cache.
+    for (uint32_t i = 0; overfull && i < newmap->__capacity; i++) {
+        struct __hashmap_bucket *bucket = &newmap->__buckets[i];
+        if (bucket->index <= 0 || __hm_chain_length(newmap->__entries, __hm_head(bucket->index)) <= HASHMAP_THRESHOLD) {
+            continue;
+        }
+        return_if(-1, __hm_convert_to_skiplist(newmap, bucket) != 0);
+    }
+    return 0;
+}
+
+// Skiplist buckets are rare, and are moved on this thread through the usual insert.
+int __hm_rehash_skiplists(hashmap_t *map, hashmap_t *newmap) {
+    for (uint32_t i = 0; i < map->__capacity; i++) {
+        int32_t index = map->__buckets[i].index;
+        if (__hm_type(index) != __HM_SKIPLIST) continue;
+        for (struct __skiplist_node *j = __hm_skiplist(map->__vs, index)->__head->forward[0]; j; j = j->forward[0]) {
+            return_if(-1, __hm_insert(newmap, j->k, j->v, j->hash, false) != 0);
+        }
+    }
+    return 0;
+}
+
+// The smallest table that holds size entries at no more than half load.
+uint32_t __hm_compact_capacity(uint32_t size) {
+    uint32_t capacity = HASHMAP_MIN_SIZE;
+    while (capacity >> 1 < size && capacity < HASHMAP_MAX_SIZE) capacity <<= 1;
+    return capacity;
+}
+
+// Passes the result of a removal through, compacting the map first if it left it under the low watermark. A failed
+// compaction leaves the map as it was, and the removal stands.
+int __hm_maybe_shrink(hashmap_t *map, int removed) {
+    if (removed == 0 && __hm_underloaded(map)) hashmap_compact(map);
+    return removed;
+}
+
+// Entries move in a rehash, so the recency order is rebuilt from the old one, least recently used entry first.
+int __hm_rehash_lru(hashmap_t *map, hashmap_t *newmap) {
+    newmap->__bytes = map->__bytes;
+    for (int32_t i = map->__lru_tail; i >= 0; i = map->__lru[i].prev) {
+        uint32_t                 hash   = map->__entries[i].hash;
+        struct __hashmap_bucket *bucket = __hm_bucket_for(newmap, hash);
+        int32_t                  entry  = __hm_head(bucket->index);
+        void                    *key    = __hm_entry_key(map, i);
+        for (; entry >= 0 && !__hm_entry_equal(newmap, entry, key, hash); entry = newmap->__entries[entry].next) {
+        }
+        return_if(-1, entry < 0);
+        newmap->__lru[entry] = map->__lru[i];
+        __hm_lru_link(newmap, entry);
+    }
+    return 0;
+}
+
+void __hm_lru_link(hashmap_t *map, int32_t entry) {
+    map->__lru[entry].prev = -1;
+    map->__lru[entry].next = map->__lru_head;
+    if (map->__lru_head >= 0)
+        map->__lru[map->__lru_head].prev = entry;
+    else
+        map->__lru_tail = entry;
+    map->__lru_head = entry;
+}
+
+void __hm_lru_unlink(hashmap_t *map, int32_t entry) {
+    struct __hashmap_lru *lru = &map->__lru[entry];
+    if (lru->prev >= 0)
+        map->__lru[lru->prev].next = lru->next;
+    else
+        map->__lru_head = lru->next;
+    if (lru->next >= 0)
+        map->__lru[lru->next].prev = lru->prev;
+    else
+        map->__lru_tail = lru->prev;
+}
+
+// A new entry is the most recently used one.
+void __hm_lru_add(hashmap_t *map, int32_t entry) {
+    map->__lru[entry].bytes   = __hm_lru_charge(map, entry);
+    map->__lru[entry].expires = __hm_lru_expiry(map->__cache.ttl_ms);
+    map->__bytes += map->__lru[entry].bytes;
+    __hm_lru_link(map, entry);
+}
+
+// An updated entry is charged again for its new value, and starts over as the most recently used one.
+void __hm_lru_touch(hashmap_t *map, int32_t entry) {
+    map->__bytes -= map->__lru[entry].bytes;
+    __hm_lru_unlink(map, entry);
+    __hm_lru_add(map, entry);
+    __hm_lru_trim(map);
+}
+
+// Tells whether a cache entry that was looked up is still there, dropping it if it expired. A get also promotes it.
+// An expired entry that cannot be dropped while views are live is still there, until a later lookup drops it.
+bool __hm_lru_check(hashmap_t *map, int32_t entry, bool promote) {
+    uint64_t expires = map->__lru[entry].expires;
+    if (expires && expires <= __hm_nanotime() && __hm_lru_evict(map, entry) == 0) return false;
+    if (promote && map->__lru_head != entry) {
+        __hm_lru_unlink(map, entry);
+        __hm_lru_link(map, entry);
+    }
+    return true;
+}
+
+// The callback sees the entry unlinked but not yet freed, so that a binary key is still there to read.
+int __hm_lru_evict(hashmap_t *map, int32_t entry) {
+    struct __hashmap_bucket *bucket = __hm_bucket_for(map, map->__entries[entry].hash);
+    int32_t                  prev   = -1;
+    for (int32_t i = __hm_head(bucket->index); i != entry; i = map->__entries[i].next) prev = i;
+    return_if(-1, __hm_list_unlink(map, bucket, prev, entry) != 0);
+    if (map->__cache.evict) map->__cache.evict(__hm_entry_key(map, entry), map->__vs[entry], map->__cache.args);
+    __hm_list_free(map, entry);
+    return 0;
+}
+
+// The entry inserted or updated last is never evicted, even if it is over a limit on its own. A cache that cannot
+// evict for want of memory to keep views as they were stays over its limit until the next trim.
+void __hm_lru_trim(hashmap_t *map) {
+    while (__hm_over_budget(map) && map->__lru_tail != map->__lru_head) {
+        if (__hm_lru_evict(map, map->__lru_tail) != 0) break;
+    }
+}
+
+uint32_t __hm_lru_charge(hashmap_t *map, int32_t entry) {
+    size_t bytes = sizeof(struct __hashmap_lru) + __hm_slot_size(map);
+    if (map->__cache.weigh)
+        bytes = map->__cache.weigh(__hm_entry_key(map, entry), map->__vs[entry]);
+    else if (map->__keys && map->__keys[entry].len > HASHMAP_INLINE_KEY)
+        bytes += map->__keys[entry].len;
+    return bytes > UINT32_MAX ? UINT32_MAX : (uint32_t) bytes;
+}
+
+void __hm_rehash_count(void *args, uint32_t thread) {
+    struct __hm_relink *relink = (struct __hm_relink *) args;
+    hashmap_t          *map    = relink->map;
+    uint32_t            count  = 0;
+    size_t              lo, hi;
+    __hm_range(relink->capacity, thread, relink->nthreads, lo, hi);
+    for (size_t i = lo; i < hi; i++) {
+        if (map->__buckets[i].index <= 0) continue;
+        for (int32_t j = map->__buckets[i].index - 1; j >= 0; j = map->__entries[j].next) count++;
+    }
+    relink->offsets[thread] = count;
+}
+
+void __hm_rehash_relink(void *args, uint32_t thread) {
+    struct __hm_relink *relink = (struct __hm_relink *) args;
+    hashmap_t          *map    = relink->map, *newmap = relink->newmap;
+    uint32_t            entry  = relink->offsets[thread];
+    size_t              lo, hi;
+    __hm_range(relink->capacity, thread, relink->nthreads, lo, hi);
+    for (size_t i = lo; i < hi; i++) {
+        if (map->__buckets[i].index <= 0) continue;
+        for (int32_t j = map->__buckets[i].index - 1; j >= 0; j = map->__entries[j].next) {
+            uint32_t                 hash   = map->__entries[j].hash;
+            struct __hashmap_bucket *target = __hm_bucket_for(newmap, hash);
+            __hm_set_entry(newmap, entry, map->__ks[j], map->__vs[j], hash, __hm_head(target->index));
+            target->index = __hm_list_index(entry++);
+        }
+    }
+}
+
+bool __hm_growable(hashmap_t *map, uint32_t capacity) {
+    // Tables big enough to be mapped grow where they are. Readers under epoch reclamation, and views, need a new map
+    // instead.
+    return capacity > map->__capacity && map->__epoch == NULL && map->__cow == NULL && map->__old_buckets == NULL &&
+           (size_t) map->__capacity * sizeof(struct __hashmap_entry) >= MP_MAP_THRESHOLD;
+}
+
+int __hm_grow(hashmap_t *map, uint32_t capacity) {
+    uint32_t old = map->__capacity;
+    // Skiplist buckets split by moving their nodes, which cannot fail, so the skiplists they need are made up front.
+    skiplist_t **spares  = NULL;
+    uint32_t     nspares = 0;
+    return_if(-1, __hm_grow_spares(map, old, &spares, &nspares) != 0);
+    return_if((__hm_free_spares(map, spares, nspares), -1), __hm_grow_arrays(map, capacity, true) != 0);
+    map->__capacity = capacity;
+    map->__generation++;
+    memset(&map->__buckets[old], 0, (size_t) (capacity - old) * sizeof(struct __hashmap_bucket));
+    // Entries keep their indices: each old bucket only splits over the new buckets congruent to it.
+    struct __hm_relink relink;
+    relink.map      = map;
+    relink.newmap   = map;
+    relink.capacity = old;
+    relink.nthreads = __hm_resize_threads(map, old);
+    __hm_parallel(relink.nthreads, __hm_grow_relink, &relink);
+    // Skiplist buckets are split on this thread. The nodes for the new bucket move into a spare skiplist, or the whole
+    // skiplist does when they all go there.
+    for (uint32_t i = 0; i < old; i++) {
+        struct __hashmap_bucket *bucket = &map->__buckets[i];
+        if (__hm_type(bucket->index) != __HM_SKIPLIST) continue;
+        skiplist_t *skiplist = __hm_skiplist(map->__vs, bucket->index);
+        uint32_t    moving   = __hm_skiplist_moving(skiplist, old);
+        if (moving == skiplist->__size) {
+            map->__buckets[i + old].index = bucket->index;
+            bucket->index                 = 0;
+        } else if (moving) {
+            // The table has just doubled, so there are free entries to hold the new skiplists.
+            int32_t holder = __hm_pop_entry(map);
+            assert(holder >= 0 && nspares > 0);
+            skiplist_split(skiplist, spares[--nspares], old);
+            map->__vs[holder]             = spares[nspares];
+            map->__buckets[i + old].index = __hm_skiplist_index(holder);
+        }
+    }
+    __hm_free_spares(map, spares, nspares);
+    return 0;
+}
+
+// Grows the arrays of the table where they are, to the size of a table of the given capacity: the entry arrays, and the
+// buckets unless the new table gets buckets of its own. On failure the arrays grown so far shrink back, and the map is
+// left as it was. The capacity is the caller's to change.
+int __hm_grow_arrays(hashmap_t *map, uint32_t capacity, bool buckets) {
+    bool     binary   = map->__flags & HASHMAP_BINARY_KEYS;
+    uint32_t old      = map->__capacity;
+    uint32_t slots    = __hm_entry_slots(map, old), new_slots = __hm_entry_slots(map, capacity);
+    void    *arrays[] = {map->__entries, map->__vs, binary ? (void *) map->__keys : map->__ks, map->__lru,
+                         map->__buckets};
+    size_t   sizes[]  = {sizeof(struct __hashmap_entry), sizeof(void *), __hm_key_size(map),
+                         sizeof(struct __hashmap_lru), sizeof(struct __hashmap_bucket)};
+    // Buckets come one per slot of the table, the other arrays one per entry.
+    size_t    from[]  = {slots, slots, slots, slots, old};
+    size_t    to[]    = {new_slots, new_slots, new_slots, new_slots, capacity};
+    bool      grow[]  = {true, true, true, map->__lru != NULL, buckets};
+    size_t    n       = 5, i;
+    uint64_t *live    = (uint64_t *) mpmap(map->__pool, __hm_live_size(new_slots));
+    return_if_null(-1, live);
+    memcpy(live, map->__live, __hm_live_size(slots));
+    memset((char *) live + __hm_live_size(slots), 0, __hm_live_size(new_slots) - __hm_live_size(slots));
+    for (i = 0; i < n; i++) {
+        if (!grow[i]) continue;
+        void *grown = mpremap(map->__pool, arrays[i], from[i] * sizes[i], to[i] * sizes[i]);
+        if (grown == NULL) break;
+        arrays[i] = grown;
+    }
+    bool failed = i < n;
+    while (failed && i--) {
+        if (!grow[i]) continue;
+        void *shrunk = mpremap(map->__pool, arrays[i], to[i] * sizes[i], from[i] * sizes[i]);
+        if (shrunk) arrays[i] = shrunk;
+    }
+    map->__entries = (struct __hashmap_entry *) arrays[0];
+    map->__vs      = (void **) arrays[1];
+    map->__keys    = binary ? (struct __hashmap_key *) arrays[2] : NULL;
+    map->__ks      = binary ? NULL : (void **) arrays[2];
+    map->__lru     = (struct __hashmap_lru *) arrays[3];
+    map->__buckets = (struct __hashmap_bucket *) arrays[4];
+    return_if((mpunmap(map->__pool, live, __hm_live_size(new_slots)), -1), failed);
+    mpunmap(map->__pool, map->__live, __hm_live_size(slots));
+    map->__live = live;
+    return 0;
+}
+
+// Makes an empty skiplist for each skiplist bucket of the first old buckets that has nodes for both of the buckets it
+// splits into.
+int __hm_grow_spares(hashmap_t *map, uint32_t old, skiplist_t ***spares, uint32_t *nspares) {
+    uint32_t needed = 0;
+    for (uint32_t i = 0; i < old; i++) {
+        int32_t index = map->__buckets[i].index;
+        if (__hm_type(index) != __HM_SKIPLIST) continue;
+        uint32_t moving = __hm_skiplist_moving(__hm_skiplist(map->__vs, index), old);
+        needed += moving && moving < skiplist_size(__hm_skiplist(map->__vs, index));
+    }
+    return_if(0, needed == 0);
+    *spares = (skiplist_t **) mpalloc(map->__ownpool, needed * sizeof(skiplist_t *));
+    return_if_null(-1, *spares);
+    for (*nspares = 0; *nspares < needed; (*nspares)++) {
+        skiplist_t *spare = __hm_alloc_skiplist(map->__ownpool);
+        if (spare && skiplist_init(spare, map->__equal, map->__ownpool) != 0) {
+            mpfree(map->__ownpool, spare);
+            spare = NULL;
+        }
+        return_if((__hm_free_spares(map, *spares, *nspares), -1), spare == NULL);
+        (*spares)[*nspares] = spare;
+    }
+    return 0;
+}
+
+void __hm_free_spares(hashmap_t *map, skiplist_t **spares, uint32_t nspares) {
+    if (spares == NULL) return;
+    for (uint32_t i = 0; i < nspares; i++) __hm_reclaim_skiplist(map, spares[i]);
+    mpfree(map->__ownpool, spares);
+}
+
+// Nodes of the skiplist whose hash has the bit of mask, that is that go to the upper of the buckets it splits into.
+uint32_t __hm_skiplist_moving(skiplist_t *skiplist, uint32_t mask) {
+    uint32_t moving = 0;
+    for (struct __skiplist_node *i = skiplist->__head->forward[0]; i; i = i->forward[0]) {
+        moving += (i->hash & mask) != 0;
+    }
+    return moving;
+}
+
+void __hm_grow_relink(void *args, uint32_t thread) {
+    struct __hm_relink *relink = (struct __hm_relink *) args;
+    hashmap_t          *map    = relink->map;
+    size_t              lo, hi;
+    __hm_range(relink->capacity, thread, relink->nthreads, lo, hi);
+    for (size_t i = lo; i < hi; i++) {
+        struct __hashmap_bucket *bucket = &map->__buckets[i];
+        int32_t                  head   = bucket->index - 1;
+        if (bucket->index <= 0) continue;
+        bucket->index = 0;
+        for (int32_t j = head, next; j >= 0; j = next) {
+            struct __hashmap_bucket *target = __hm_bucket_for(map, map->__entries[j].hash);
+            next                            = map->__entries[j].next;
+            map->__entries[j].next          = __hm_head(target->index);
+            target->index                   = __hm_list_index(j);
+        }
+    }
+}
+
+bool __hm_overloaded(hashmap_t *map) {
+    return map->__size >= __hm_load_limit(map->__load, map->__capacity);
+}
+
+int __hm_ensure_capacity(hashmap_t *map) {
+    if (__hm_overloaded(map)) {
+        // Views see the table whole, so it is never left halfway through a resize while they are live.
+        return_if(__hm_resize(map, map->__capacity << 1), !(map->__flags & HASHMAP_INCREMENTAL_RESIZE) || map->__cow);
+        return_if(-1, __hm_finish_migration(map) != 0);
+        return __hm_start_migration(map, map->__capacity << 1);
+    }
+    return 0;
+}
+
+int __hm_start_migration(hashmap_t *map, uint32_t capacity) {
+    struct __hashmap_bucket *buckets = __hm_alloc_buckets(map->__pool, capacity);
+    return_if_null(-1, buckets);
+    // Entries keep their indices, so their arrays grow where they are and only the chains move, bucket by bucket. New
+    // buckets are cleared when their old bucket moves, so nothing here is proportional to the map size.
+    return_if((__hm_unmap_buckets(map->__pool, buckets, capacity), -1), __hm_grow_arrays(map, capacity, false) != 0);
+    map->__old_buckets  = map->__buckets;
+    map->__old_capacity = map->__capacity;
+    map->__migrated     = 0;
+    map->__buckets      = buckets;
+    map->__capacity     = capacity;
+    map->__generation++;
+    __hm_count(map, resizes, 1);
+    return 0;
+}
+
+int __hm_finish_migration(hashmap_t *map) {
+    while (map->__old_buckets) {
+        return_if(-1, __hm_migrate(map, map->__old_capacity - 1 - map->__migrated) != 0);
+    }
+    return 0;
+}
+
+int __hm_migrate(hashmap_t *map, uint32_t hash) {
+    // Time spent moving buckets counts as resize time, however the moves are spread over operations.
+    uint64_t start = __hm_now();
+    // The bucket being accessed moves first so that every probe only walks the new table. Only its result is passed
+    // on: a bucket of the step that cannot move yet stays where the step will start next time.
+    int ret = __hm_migrate_bucket(map, hash & (map->__old_capacity - 1));
+    for (uint32_t n = 0; n < __HM_MIGRATE_STEP && map->__migrated < map->__old_capacity; n++) {
+        if (__hm_migrate_bucket(map, map->__old_capacity - 1 - map->__migrated) != 0) break;
+        map->__migrated++;
+    }
+    // Steps move the old buckets from the last one down, and the ones behind them go back a slice at a time rather
+    // than all at once at the end.
+    if (map->__migrated == map->__old_capacity)
+        __hm_free_old(map);
+    else
+        mpshrink(map->__pool, map->__old_buckets, (size_t) map->__old_capacity * sizeof(struct __hashmap_bucket),
+                 (size_t) (map->__old_capacity - map->__migrated) * sizeof(struct __hashmap_bucket));
+    __hm_count(map, resize_ns, __hm_now() - start);
+    return ret;
+}
+
+int __hm_migrate_bucket(hashmap_t *map, uint32_t at) {
+    return_if(0, __hm_old_moved(map, at));
+    struct __hashmap_bucket *old = &map->__old_buckets[at];
+    for (uint32_t j = at; j < map->__capacity; j += map->__old_capacity) map->__buckets[j].index = 0;
+    switch (__hm_type(old->index)) {
+        case __HM_LIST: {
+            // An old bucket splits into new buckets that nothing else has touched yet.
+            for (int32_t i = old->index - 1, next; i >= 0; i = next) {
+                struct __hashmap_bucket *bucket = __hm_bucket_for(map, map->__entries[i].hash);
+                next                            = map->__entries[i].next;
+                map->__entries[i].next          = __hm_head(bucket->index);
+                bucket->index                   = __hm_list_index(i);
             }
-            case __HM_SKIPLIST: {
-                for (struct __skiplist_node *j = map->__buckets[i].skiplist->__head->forward[0]; j; j = j->forward[0]) {
-                    ret = __hm_insert(&newmap, j->k, j->v, hashmap_hash(&newmap, j->k), false);
-                    return_if((hashmap_free(&newmap), -1), ret != 0);
-                }
+            break;
+        }
+        case __HM_SKIPLIST: {
+            // The table doubles, so the skiplist splits over two buckets. It keeps its holder, and the nodes for the
+            // upper bucket move into a skiplist of their own, which is all that can fail, before anything changes.
+            skiplist_t *skiplist = __hm_skiplist(map->__vs, old->index);
+            uint32_t    moving   = __hm_skiplist_moving(skiplist, map->__old_capacity);
+            int32_t     upper;
+            if (moving == 0 || moving == skiplist->__size) {
+                map->__buckets[moving ? at + map->__old_capacity : at].index = old->index;
                 break;
             }
-            default: break;
+            skiplist_t *spare = __hm_alloc_skiplist(map->__ownpool);
+            return_if_null(-1, spare);
+            return_if((mpfree(map->__ownpool, spare), -1), skiplist_init(spare, map->__equal, map->__ownpool) != 0);
+            return_if((__hm_reclaim_skiplist(map, spare), -1), (upper = __hm_pop_entry(map)) < 0);
+            skiplist_split(skiplist, spare, map->__old_capacity);
+            spare->__epoch                                 = skiplist->__epoch;
+            map->__vs[upper]                               = spare;
+            map->__buckets[at].index                       = old->index;
+            map->__buckets[at + map->__old_capacity].index = __hm_skiplist_index(upper);
+            break;
         }
+        default: break;
     }
-    hashmap_free(map);
-    memcpy(map, &newmap, sizeof(newmap));
+    old->index = __HM_MIGRATED_INDEX;
     return 0;
 }
 
-int __hm_ensure_capacity(hashmap_t *map) {
-    if (map->__size > __hm_load_max(map->__capacity)) {
-        return __hm_resize(map, map->__capacity << 1);
+skiplist_t *__hm_unmoved_skiplist(hashmap_t *map, uint32_t hash) {
+    uint32_t at = hash & (map->__old_capacity - 1);
+    return_if_null(NULL, __hm_old_moved(map, at) ? NULL : map->__old_buckets);
+    int32_t index = map->__old_buckets[at].index;
+    return __hm_type(index) == __HM_SKIPLIST ? __hm_skiplist(map->__vs, index) : NULL;
+}
+
+int __hm_free_old(hashmap_t *map) {
+    return_if_null(0, map->__old_buckets);
+    __hm_unmap_buckets(map->__pool, map->__old_buckets, map->__old_capacity);
+    map->__old_buckets  = NULL;
+    map->__old_capacity = 0;
+    map->__migrated     = 0;
+    return 0;
+}
+
+void __hm_foreach_buckets(hashmap_t *map, struct __hashmap_bucket *buckets, uint32_t capacity,
+                          void (*predicate)(void *, void *, void *), void *args) {
+    struct __hashmap_entry *entries = map->__entries;
+    struct __hashmap_key   *keys    = map->__keys;
+    void                  **ks      = map->__ks, **vs = map->__vs;
+    for (uint32_t i = 0; i < capacity; i++) {
+        int32_t index = buckets[i].index;
+        if (__hm_type(index) == __HM_LIST) {
+            for (int32_t j = index - 1; j != -1; j = entries[j].next) {
+                predicate(keys ? (void *) &keys[j] : ks[j], vs[j], args);
+            }
+        } else if (__hm_type(index) == __HM_SKIPLIST) {
+            skiplist_foreach(__hm_skiplist(vs, index), predicate, args);
+        }
+    }
+}
+
+// Chains are read down the dense entry arrays. Skiplist buckets are only looked for if some entries are missing.
+void __hm_foreach_dense(hashmap_t *map, void (*predicate)(void *, void *, void *), void *args) {
+    uint32_t seen = 0;
+    for (uint32_t i = __hm_next_live(map, 0); i < map->__current; i = __hm_next_live(map, i + 1), seen++) {
+        predicate(__hm_entry_key(map, i), map->__vs[i], args);
+    }
+    for (uint32_t i = 0; seen < map->__size && i < map->__capacity; i++) {
+        int32_t index = map->__buckets[i].index;
+        if (__hm_type(index) != __HM_SKIPLIST) continue;
+        skiplist_foreach(__hm_skiplist(map->__vs, index), predicate, args);
+        seen += skiplist_size(__hm_skiplist(map->__vs, index));
+    }
+}
+
+// The first entry in a chain at or after i, or __current when there is none. A snapshot keeps no live bits: its
+// entries are packed.
+uint32_t __hm_next_live(hashmap_t *map, uint32_t i) {
+    return_if(i < map->__current ? i : map->__current, map->__live == NULL || i >= map->__current);
+    uint32_t word = i >> 6;
+    uint64_t bits = map->__live[word] & (~0ull << (i & 63));
+    while (bits == 0) {
+        return_if(map->__current, ++word > (map->__current - 1) >> 6);
+        bits = map->__live[word];
+    }
+    uint32_t next = (word << 6) + __builtin_ctzll(bits);
+    return next < map->__current ? next : map->__current;
+}
+
+// Entries held in chains, which is all of them unless some buckets are skiplists.
+uint32_t __hm_live_count(hashmap_t *map) {
+    return_if(map->__current, map->__live == NULL);
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < (map->__current + 63) >> 6; i++) {
+        count += __builtin_popcountll(map->__live[i]);
+    }
+    return count;
+}
+
+// Runs run(args, t) for every t below nthreads, the first on the calling thread. Threads that cannot be started leave
+// their share to the calling thread as well.
+void __hm_parallel(uint32_t nthreads, void (*run)(void *, uint32_t), void *args) {
+    pthread_t        threads[__HM_THREADS_MAX];
+    struct __hm_task tasks[__HM_THREADS_MAX];
+    bool             started[__HM_THREADS_MAX];
+    for (uint32_t t = 1; t < nthreads; t++) {
+        tasks[t]   = (struct __hm_task){run, args, t};
+        started[t] = pthread_create(&threads[t], NULL, __hm_parallel_thread, &tasks[t]) == 0;
+    }
+    run(args, 0);
+    for (uint32_t t = 1; t < nthreads; t++) {
+        if (started[t])
+            pthread_join(threads[t], NULL);
+        else
+            run(args, t);
+    }
+}
+
+void *__hm_parallel_thread(void *task) {
+    struct __hm_task *t = (struct __hm_task *) task;
+    t->run(t->args, t->thread);
+    return NULL;
+}
+
+// The threads worth starting for this much work, one per CPU when nthreads is 0. Too many only cost their startup.
+uint32_t __hm_threads(uint32_t nthreads, size_t work) {
+    if (nthreads == 0) nthreads = (uint32_t) sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > work / __HM_PARALLEL_GRAIN + 1) nthreads = work / __HM_PARALLEL_GRAIN + 1;
+    if (nthreads > __HM_THREADS_MAX) nthreads = __HM_THREADS_MAX;
+    return nthreads ? nthreads : 1;
+}
+
+// Marks entries [0, n) live in a table filled in bulk.
+void __hm_live_fill(hashmap_t *map, uint32_t n) {
+    memset(map->__live, 0xFF, (n >> 6) * sizeof(uint64_t));
+    if (n & 63) map->__live[n >> 6] = (1ull << (n & 63)) - 1;
+}
+
+void __hm_build_hash(void *args, uint32_t thread) {
+    struct __hm_build *build  = (struct __hm_build *) args;
+    uint32_t          *counts = &build->offsets[(size_t) thread * build->partitions];
+    size_t             lo, hi;
+    __hm_range(build->n, thread, build->nthreads, lo, hi);
+    for (size_t i = lo; i < hi; i++) {
+        build->hashes[i] = __hm_hash(build->map, build->keys[i]);
+        counts[__hm_build_partition(build, build->hashes[i])]++;
+    }
+}
+
+void __hm_build_scatter(void *args, uint32_t thread) {
+    struct __hm_build *build   = (struct __hm_build *) args;
+    uint32_t          *offsets = &build->offsets[(size_t) thread * build->partitions];
+    size_t             lo, hi;
+    __hm_range(build->n, thread, build->nthreads, lo, hi);
+    for (size_t i = lo; i < hi; i++) {
+        build->order[offsets[__hm_build_partition(build, build->hashes[i])]++] = (uint32_t) i;
+    }
+}
+
+// Partitions own disjoint buckets, and each fills the entries from where its pairs start in order, so no two threads
+// ever write the same slot. A chain that reaches the threshold takes no more entries: the rest of its pairs are left
+// for __hm_build_finish, which turns it into a skiplist.
+void __hm_build_link(void *args, uint32_t thread) {
+    struct __hm_build *build  = (struct __hm_build *) args;
+    hashmap_t         *map    = build->map;
+    uint32_t          *starts = &build->offsets[(size_t) build->nthreads * build->partitions];
+    for (uint32_t p; (p = __atomic_fetch_add(&build->next, 1, __ATOMIC_RELAXED)) < build->partitions;) {
+        uint32_t entry = starts[p], spill = starts[p];
+        for (uint32_t j = starts[p]; j < starts[p + 1]; j++) {
+            uint32_t                 i      = build->order[j];
+            uint32_t                 hash   = build->hashes[i];
+            struct __hashmap_bucket *bucket = __hm_bucket_for(map, hash);
+            uint32_t                 count  = 0;
+            int32_t                  curr   = __hm_head(bucket->index);
+            for (; curr >= 0 && !__hm_entry_equal(map, curr, build->keys[i], hash); curr = map->__entries[curr].next) {
+                count++;
+            }
+            if (curr >= 0) {
+                map->__vs[curr] = build->values[i];
+            } else if (count >= HASHMAP_THRESHOLD) {
+                build->order[spill++] = i;
+            } else {
+                __hm_set_entry(map, entry, build->keys[i], build->values[i], hash, __hm_head(bucket->index));
+                bucket->index = __hm_list_index(entry++);
+            }
+        }
+        build->used[p]    = entry - starts[p];
+        build->spilled[p] = spill - starts[p];
+    }
+}
+
+// Entries a partition did not fill, for duplicates or spilled pairs, go on the free list, and spilled pairs are then
+// inserted as usual.
+int __hm_build_finish(struct __hm_build *build) {
+    hashmap_t *map    = build->map;
+    uint32_t  *starts = &build->offsets[(size_t) build->nthreads * build->partitions];
+    __hm_live_fill(map, (uint32_t) build->n);
+    map->__current = (uint32_t) build->n;
+    for (uint32_t p = build->partitions; p-- > 0;) {
+        map->__size += build->used[p];
+        for (uint32_t i = starts[p + 1]; i-- > starts[p] + build->used[p];) {
+            __hm_live_clear(map, i);
+            map->__entries[i].next = map->__freelist;
+            map->__freelist        = (int32_t) i;
+        }
+    }
+    map->__generation++;
+    for (uint32_t p = 0; p < build->partitions; p++) {
+        for (uint32_t j = starts[p]; j < starts[p] + build->spilled[p]; j++) {
+            uint32_t i = build->order[j];
+            return_if(-1, __hm_insert(map, build->keys[i], build->values[i], build->hashes[i], true) != 0);
+        }
+    }
+    return 0;
+}
+
+// Buckets already moved by an incremental resize are counted in the new table only.
+void __hm_stats_buckets(struct __hashmap_bucket *buckets, struct __hashmap_entry *entries, void **vs, uint32_t capacity,
+                        hashmap_stats_t *stats) {
+    for (uint32_t i = 0; i < capacity; i++) {
+        int32_t  index  = buckets[i].index;
+        uint32_t length = 0;
+        if (__hm_type(index) == __HM_SKIPLIST) {
+            skiplist_t *skiplist = __hm_skiplist(vs, index);
+            stats->skiplists++;
+            stats->skiplist_entries += skiplist_size(skiplist);
+            if (skiplist_level(skiplist) > stats->skiplist_level) stats->skiplist_level = skiplist_level(skiplist);
+            continue;
+        }
+        if (index == __HM_MIGRATED_INDEX) continue;
+        length = __hm_chain_length(entries, __hm_head(index));
+        stats->chains[length < HASHMAP_STATS_CHAINS ? length : HASHMAP_STATS_CHAINS - 1]++;
+        if (length > stats->longest_chain) stats->longest_chain = length;
+    }
+}
+
+uint32_t __hm_chain_length(struct __hashmap_entry *entries, int32_t head) {
+    uint32_t length = 0;
+    for (int32_t i = head; i >= 0; i = entries[i].next) {
+        length++;
+    }
+    return length;
+}
+
+uint64_t __hm_nanotime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+void __hm_prefetch_batch(hashmap_t *map, void **keys, uint32_t *hashes, size_t n) {
+    // Every pass only reads lines the previous pass has requested, so the misses of the whole batch overlap.
+    for (size_t i = 0; i < n; i++) {
+        hashes[i] = __hm_hash(map, keys[i]);
+        __hm_migrate_for(map, hashes[i]);
+        __builtin_prefetch(__hm_bucket_for(map, hashes[i]));
     }
+    for (size_t i = 0; i < n; i++) {
+        int32_t head = __hm_head(__hm_bucket_for(map, hashes[i])->index);
+        if (head >= 0) __builtin_prefetch(&map->__entries[head]);
+    }
+    for (size_t i = 0; i < n; i++) {
+        int32_t head = __hm_head(__hm_bucket_for(map, hashes[i])->index);
+        if (head < 0) continue;
+        // Only a head whose hash matches will have its key compared. An integer key is compared in its slot.
+        if (map->__entries[head].hash != hashes[i]) continue;
+        __builtin_prefetch(map->__flags & HASHMAP_U64_KEYS ? (void *) &map->__ks[head] : map->__ks[head]);
+    }
+}
+
+int __hm_init_swisstable(hashmap_t *map) {
+    map->__swisstable = (swisstable_t *) mpalloc(map->__pool, sizeof(swisstable_t));
+    return_if_null(-1, map->__swisstable);
+    int ret = swisstable_init(map->__swisstable, map->__capacity, map->__hash, map->__equal, map->__pool);
+    return_if((mpfree(map->__pool, map->__swisstable), map->__swisstable = NULL, -1), ret != 0);
+    map->__swisstable->__seed = map->__seed;
+    return 0;
+}
+
+int __hm_free_swisstable(hashmap_t *map) {
+    return_if_null(0, map->__swisstable);
+    swisstable_free(map->__swisstable);
+    mpfree(map->__pool, map->__swisstable);
+    map->__swisstable = NULL;
+    return 0;
+}
+
+int __hm_init_robinhood(hashmap_t *map) {
+    map->__robinhood = (robinhood_t *) mpalloc(map->__pool, sizeof(robinhood_t));
+    return_if_null(-1, map->__robinhood);
+    int ret = robinhood_init(map->__robinhood, map->__capacity, map->__hash, map->__equal, map->__pool);
+    return_if((mpfree(map->__pool, map->__robinhood), map->__robinhood = NULL, -1), ret != 0);
+    map->__robinhood->__seed = map->__seed;
+    return 0;
+}
+
+int __hm_free_robinhood(hashmap_t *map) {
+    return_if_null(0, map->__robinhood);
+    robinhood_free(map->__robinhood);
+    mpfree(map->__pool, map->__robinhood);
+    map->__robinhood = NULL;
     return 0;
 }
 
@@ -213,28 +1710,104 @@ int __hm_free_ownpool(hashmap_t *map) {
 
 int __hm_free_buckets(hashmap_t *map) {
     return_if_null(0, map->__buckets);
-    mpfree(map->__pool, map->__buckets);
+    __hm_unmap_buckets(map->__pool, map->__buckets, map->__capacity);
     map->__buckets = NULL;
     return 0;
 }
 
+int __hm_alloc_entries(hashmap_t *map, uint32_t capacity) {
+    // Dense arrays of their own: the hash and next links every chain walk reads, the values, and the keys. A miss never
+    // touches a value, and only touches a key when the hashes agree.
+    uint32_t                slots = __hm_entry_slots(map, capacity);
+    struct __hashmap_entry *entries =
+        (struct __hashmap_entry *) mpmap(map->__pool, (size_t) slots * sizeof(struct __hashmap_entry));
+    return_if_null(-1, entries);
+    void    **vs   = (void **) mpmap(map->__pool, (size_t) slots * sizeof(void *));
+    void     *keys = vs ? mpmap(map->__pool, (size_t) slots * __hm_key_size(map)) : NULL;
+    uint64_t *live = keys ? (uint64_t *) mpmap(map->__pool, __hm_live_size(slots)) : NULL;
+    // Cache maps also link every entry into the recency order.
+    bool                  cache = map->__flags & HASHMAP_LRU;
+    struct __hashmap_lru *lru   = live && cache ? mpmap(map->__pool, __hm_lru_size(slots)) : NULL;
+    if (live == NULL || (cache && lru == NULL)) {
+        if (live) mpunmap(map->__pool, live, __hm_live_size(slots));
+        if (keys) mpunmap(map->__pool, keys, (size_t) slots * __hm_key_size(map));
+        if (vs) mpunmap(map->__pool, vs, (size_t) slots * sizeof(void *));
+        mpunmap(map->__pool, entries, (size_t) slots * sizeof(struct __hashmap_entry));
+        return -1;
+    }
+    memset(live, 0, __hm_live_size(slots));
+    map->__live    = live;
+    map->__lru     = lru;
+    map->__entries = entries;
+    map->__vs      = vs;
+    map->__ks      = map->__flags & HASHMAP_BINARY_KEYS ? NULL : (void **) keys;
+    map->__keys    = map->__flags & HASHMAP_BINARY_KEYS ? (struct __hashmap_key *) keys : NULL;
+    return 0;
+}
+
+void __hm_unmap_entries(hashmap_t *map, struct __hashmap_entry *entries, void **vs, void *keys, uint32_t capacity) {
+    uint32_t slots = __hm_entry_slots(map, capacity);
+    mpunmap(map->__pool, entries, (size_t) slots * sizeof(struct __hashmap_entry));
+    mpunmap(map->__pool, vs, (size_t) slots * sizeof(void *));
+    mpunmap(map->__pool, keys, (size_t) slots * __hm_key_size(map));
+}
+
 int __hm_free_entries(hashmap_t *map) {
     return_if_null(0, map->__entries);
-    mpfree(map->__pool, map->__entries);
+    __hm_unmap_entries(map, map->__entries, map->__vs, map->__keys ? (void *) map->__keys : map->__ks, map->__capacity);
+    uint32_t slots = __hm_entry_slots(map, map->__capacity);
+    mpunmap(map->__pool, map->__live, __hm_live_size(slots));
+    if (map->__lru) mpunmap(map->__pool, map->__lru, __hm_lru_size(slots));
+    map->__live    = NULL;
+    map->__lru     = NULL;
     map->__entries = NULL;
+    map->__ks      = NULL;
+    map->__vs      = NULL;
+    map->__keys    = NULL;
     return 0;
 }
 
 int __hm_convert_to_list(hashmap_t *map, struct __hashmap_bucket *bucket) {
-    skiplist_t *skiplist = bucket->skiplist;
-    bucket->type         = __HM_LIST;
-    bucket->entry        = -1;
-    bucket->skiplist     = NULL;
-    for (struct __skiplist_node *i = skiplist->__head->forward[0]; i; i = i->forward[0]) {
-        __hm_list_insert(map, bucket, i->k, i->v, hashmap_hash(map, i->k), false);
+    skiplist_t *skiplist = __hm_skiplist(map->__vs, bucket->index);
+    int32_t     holder   = __hm_skiplist_entry(bucket->index);
+    assert(skiplist->__size <= HASHMAP_THRESHOLD);
+    return_if(-1, map->__cow && (__hm_cow(map, bucket) != 0 || __hm_cow_list(map, holder, skiplist->__size) != 0));
+    // Copying long binary keys into the map's pool is all that can fail, so every key is copied before the bucket
+    // changes, and it stays a skiplist when one cannot be.
+    struct __hashmap_key keys[HASHMAP_THRESHOLD];
+    uint32_t             n = 0;
+    for (struct __skiplist_node *i = skiplist->__head->forward[0]; map->__keys && i; i = i->forward[0], n++) {
+        if (__hm_copy_key(map, &keys[n], (struct __hashmap_key *) i->k) == 0) continue;
+        while (n > 0) __hm_drop_key(map, &keys[--n]);
+        return -1;
+    }
+    // The entry that held the skiplist is the first the list takes back.
+    __hm_reclaim_entry(map, (void *) (intptr_t) holder);
+    bucket->index = 0;
+    n             = 0;
+    for (struct __skiplist_node *i = skiplist->__head->forward[0]; i; i = i->forward[0], n++) {
+        int32_t entry = __hm_list_slot(map);
+        if (map->__keys) map->__keys[entry] = keys[n];
+        __hm_list_link(map, bucket, entry, i->k, i->v, i->hash);
     }
     map->__size -= skiplist->__size;
-    mpfree(map->__ownpool, skiplist);
+    __hm_free_skiplist(map, skiplist);
+    map->__generation++;
+    __hm_count(map, to_list, 1);
+    return 0;
+}
+
+// Saves for views every entry a list of count entries made from a skiplist takes, so that none of its inserts fails
+// halfway: the holder of the skiplist, then the free list, then unused ones.
+int __hm_cow_list(hashmap_t *map, int32_t holder, uint32_t count) {
+    return_if(-1, __hm_cow_entry(map, holder));
+    int32_t  listed  = map->__freelist;
+    uint32_t current = map->__current;
+    for (uint32_t n = 1; n < count; n++) {
+        int32_t entry = listed >= 0 ? listed : (int32_t) current++;
+        return_if(-1, __hm_cow_entry(map, entry));
+        if (listed >= 0) listed = map->__entries[listed].next;
+    }
     return 0;
 }
 
@@ -243,48 +1816,199 @@ int __hm_convert_to_skiplist(hashmap_t *map, struct __hashmap_bucket *bucket) {
     skiplist_t *skiplist = __hm_alloc_skiplist(map->__ownpool);
     return_if_null(-1, skiplist);
     return_if(-1, skiplist_init(skiplist, map->__equal, map->__ownpool) != 0);
-    int32_t prev = -1;
-    for (int curr = bucket->entry; curr >= 0; prev = curr, curr = map->__entries[curr].next) {
-        int ret = skiplist_insert(skiplist, map->__entries[curr].k, map->__entries[curr].v, false);
-        return_if((skiplist_free(skiplist), -1), ret != 0);
+    int32_t head = __hm_head(bucket->index), holder = head, prev = -1;
+    for (int curr = head; curr >= 0; prev = curr, curr = map->__entries[curr].next) {
+        // Skiplist nodes only hold a key pointer, so binary keys move into boxes of their own. Integer key 0 is NULL.
+        void *key = map->__keys ? __hm_box_key(map, &map->__keys[curr]) : map->__ks[curr];
+        return_if((__hm_free_skiplist(map, skiplist), -1), map->__keys && key == NULL);
+        if (skiplist_insert(skiplist, key, map->__vs[curr], map->__entries[curr].hash, false) != 0) {
+            if (map->__keys) __hm_drop_box(map, (struct __hashmap_key *) key);
+            __hm_free_skiplist(map, skiplist);
+            return -1;
+        }
+    }
+    // Readers may still be walking the chain under epoch reclamation, so the skiplist is held by an entry of its own.
+    if (map->__epoch) holder = __hm_pop_entry(map);
+    return_if((__hm_free_skiplist(map, skiplist), -1), holder < 0);
+    // Views keep the chain: its tail goes on the free list below.
+    bool saved = __hm_cow(map, &map->__vs[holder]) == 0 && __hm_cow(map, bucket) == 0 &&
+                 (map->__entries[head].next < 0 || __hm_cow(map, &map->__entries[prev]) == 0);
+    return_if((__hm_free_skiplist(map, skiplist), -1), !saved);
+    for (int curr = head; curr >= 0; curr = map->__entries[curr].next) {
+        if (map->__keys) __hm_drop_key(map, &map->__keys[curr]);
+        __hm_live_clear(map, curr);
+    }
+    skiplist->__epoch = map->__epoch;
+    map->__vs[holder] = skiplist;
+    __hm_store(&bucket->index, __hm_skiplist_index(holder));
+    map->__generation++;
+    __hm_count(map, to_skiplist, 1);
+    if (map->__epoch) {
+        // The chain stays linked until the readers are gone.
+        epoch_retire(map->__epoch, __hm_reclaim_chain, map, (void *) (intptr_t) head);
+        return 0;
+    }
+    // The head holds the skiplist, and the rest of the chain is free.
+    if (map->__entries[head].next >= 0) {
+        map->__entries[prev].next = map->__freelist;
+        map->__freelist           = map->__entries[head].next;
+    }
+    return 0;
+}
+
+// Takes an unused entry off the free list or from past the last one used, -1 when there is none.
+int32_t __hm_pop_entry(hashmap_t *map) {
+    int32_t entry = map->__freelist;
+    if (entry >= 0) {
+        map->__freelist = map->__entries[entry].next;
+        return entry;
     }
-    map->__entries[prev].next = map->__freelist;
-    map->__freelist           = bucket->entry;
-    bucket->type              = __HM_SKIPLIST;
-    bucket->entry             = -1;
-    bucket->skiplist          = skiplist;
+    return_if(-1, map->__current >= __hm_entry_slots(map, map->__capacity));
+    return (int32_t) map->__current++;
+}
+
+void __hm_reclaim_entry(void *ctx, void *entry) {
+    hashmap_t *map = (hashmap_t *) ctx;
+    int32_t    i   = (int32_t) (intptr_t) entry;
+    __hm_cow(map, &map->__entries[i]);
+    map->__entries[i].next = map->__freelist;
+    map->__freelist        = i;
+}
+
+void __hm_reclaim_chain(void *ctx, void *head) {
+    hashmap_t *map  = (hashmap_t *) ctx;
+    int32_t    tail = (int32_t) (intptr_t) head;
+    while (map->__entries[tail].next >= 0) {
+        tail = map->__entries[tail].next;
+    }
+    map->__entries[tail].next = map->__freelist;
+    map->__freelist           = (int32_t) (intptr_t) head;
+}
+
+int __hm_free_skiplist(hashmap_t *map, skiplist_t *skiplist) {
+    return_if(__hm_cow_retire(map, __hm_reclaim_skiplist, map, skiplist), map->__cow);
+    __hm_reclaim_skiplist(map, skiplist);
     return 0;
 }
 
-bool __hm_exists(hashmap_t *map, void *key) {
-    struct __hashmap_bucket *bucket = __hm_bucket_for(map, hashmap_hash(map, key));
-    switch (bucket->type) {
-        case __HM_LIST: return __hm_list_exists(map, bucket, key);
-        case __HM_SKIPLIST: return __hm_skiplist_exists(map, bucket, key);
+// Frees a skiplist with the boxes of its binary keys, all from the pool it was made in.
+void __hm_reclaim_skiplist(void *ctx, void *ptr) {
+    hashmap_t     *map      = (hashmap_t *) ctx;
+    skiplist_t    *skiplist = (skiplist_t *) ptr;
+    memory_pool_t *pool     = skiplist->__pool;
+    if (map->__flags & HASHMAP_BINARY_KEYS) {
+        for (struct __skiplist_node *i = skiplist->__head->forward[0]; i; i = i->forward[0]) {
+            struct __hashmap_key *box = (struct __hashmap_key *) i->k;
+            if (box->len > HASHMAP_INLINE_KEY) mpfree(pool, box->ptr);
+            mpfree(pool, box);
+        }
+    }
+    skiplist_free(skiplist);
+    mpfree(pool, skiplist);
+}
+
+void __hm_reclaim_bytes(void *ownpool, void *ptr) {
+    mpfree((memory_pool_t *) ownpool, ptr);
+}
+
+// The bucket's skiplist, ready to be changed. One a view may be walking is copied first, and the copy takes its place.
+skiplist_t *__hm_own_skiplist(hashmap_t *map, struct __hashmap_bucket *bucket) {
+    int32_t     holder   = __hm_skiplist_entry(bucket->index);
+    skiplist_t *skiplist = (skiplist_t *) map->__vs[holder];
+    return_if(skiplist, map->__cow == NULL || !__hm_cow_shared(map, &map->__vs[holder]));
+    skiplist_t *copy = __hm_alloc_skiplist(map->__ownpool);
+    return_if_null(NULL, copy);
+    return_if((mpfree(map->__ownpool, copy), NULL), skiplist_init(copy, map->__equal, map->__ownpool) != 0);
+    for (struct __skiplist_node *i = skiplist->__head->forward[0]; i; i = i->forward[0]) {
+        void *key = map->__keys ? __hm_box_key(map, (struct __hashmap_key *) i->k) : i->k;
+        if ((map->__keys && key == NULL) || skiplist_insert(copy, key, i->v, i->hash, false) != 0) {
+            if (key && map->__keys) __hm_drop_box(map, (struct __hashmap_key *) key);
+            __hm_reclaim_skiplist(map, copy);
+            return NULL;
+        }
+    }
+    return_if((__hm_reclaim_skiplist(map, copy), NULL), __hm_cow(map, &map->__vs[holder]) != 0);
+    __hm_store(&map->__vs[holder], (void *) copy);
+    __hm_free_skiplist(map, skiplist);
+    return copy;
+}
+
+int __hm_compare_keys(void *a, void *b) {
+    struct __hashmap_key *x = (struct __hashmap_key *) a, *y = (struct __hashmap_key *) b;
+    return_if(x->len < y->len ? -1 : 1, x->len != y->len);
+    return memcmp(__hm_key_data(x), __hm_key_data(y), x->len);
+}
+
+// Skiplist buckets order integer keys by value.
+int __hm_compare_u64(void *a, void *b) {
+    return ((uintptr_t) a > (uintptr_t) b) - ((uintptr_t) a < (uintptr_t) b);
+}
+
+int __hm_copy_key(hashmap_t *map, struct __hashmap_key *slot, struct __hashmap_key *key) {
+    if (key->len <= HASHMAP_INLINE_KEY) {
+        memcpy(slot, key, sizeof(struct __hashmap_key));
+        return 0;
+    }
+    // Longer keys are copied into the map's own pool and die with it.
+    return_if(-1, __hm_ensure_ownpool(map) != 0);
+    uint8_t *bytes = (uint8_t *) mpalloc(map->__ownpool, key->len);
+    return_if_null(-1, bytes);
+    memcpy(bytes, key->ptr, key->len);
+    slot->len = key->len;
+    slot->ptr = bytes;
+    return 0;
+}
+
+void __hm_drop_key(hashmap_t *map, struct __hashmap_key *slot) {
+    if (slot->len <= HASHMAP_INLINE_KEY) return;
+    if (map->__cow)
+        __hm_cow_retire(map, __hm_reclaim_bytes, map->__ownpool, slot->ptr);
+    else
+        mpfree(map->__ownpool, slot->ptr);
+}
+
+struct __hashmap_key *__hm_box_key(hashmap_t *map, struct __hashmap_key *key) {
+    return_if(NULL, __hm_ensure_ownpool(map) != 0);
+    struct __hashmap_key *box = (struct __hashmap_key *) mpalloc(map->__ownpool, sizeof(struct __hashmap_key));
+    return_if_null(NULL, box);
+    return_if((mpfree(map->__ownpool, box), NULL), __hm_copy_key(map, box, key) != 0);
+    return box;
+}
+
+void __hm_drop_box(hashmap_t *map, struct __hashmap_key *box) {
+    __hm_drop_key(map, box);
+    if (map->__cow)
+        __hm_cow_retire(map, __hm_reclaim_bytes, map->__ownpool, box);
+    else
+        mpfree(map->__ownpool, box);
+}
+
+bool __hm_exists(hashmap_t *map, void *key, uint32_t hash) {
+    skiplist_t *unmoved = __hm_unmoved(map, hash);
+    return_if(__hm_skiplist_exists(map, unmoved, key, hash), unmoved);
+    int32_t index = __hm_load(&__hm_bucket_for(map, hash)->index);
+    switch (__hm_type(index)) {
+        case __HM_LIST: return __hm_list_exists(map, index - 1, key, hash);
+        case __HM_SKIPLIST: return __hm_skiplist_exists(map, __hm_skiplist(map->__vs, index), key, hash);
         default: return false;
     }
 }
 
-bool __hm_list_exists(hashmap_t *map, struct __hashmap_bucket *bucket, void *key) {
-    for (int32_t i = bucket->entry; i >= 0; i = map->__entries[i].next) {
-        return_if(true, hashmap_equal(map, map->__entries[i].k, key) == 0);
+bool __hm_list_exists(hashmap_t *map, int32_t head, void *key, uint32_t hash) {
+    for (int32_t i = head; i >= 0; i = __hm_load(&map->__entries[i].next)) {
+        if (__hm_entry_equal(map, i, key, hash)) return map->__lru == NULL || __hm_lru_check(map, i, false);
     }
     return false;
 }
 
-bool __hm_skiplist_exists(hashmap_t *map, struct __hashmap_bucket *bucket, void *key) {
-    return skiplist_exists(bucket->skiplist, key);
+bool __hm_skiplist_exists(hashmap_t *map, skiplist_t *skiplist, void *key, uint32_t hash) {
+    return skiplist_exists(skiplist, key, hash);
 }
 
 int __hm_insert(hashmap_t *map, void *key, void *value, uint32_t hash, bool update) {
     struct __hashmap_bucket *bucket = __hm_bucket_for(map, hash);
-    switch (bucket->type) {
-        case __HM_EMPTY: {
-            bucket->type     = __HM_LIST;
-            bucket->entry    = -1;
-            bucket->skiplist = NULL;
-            return __hm_list_insert(map, bucket, key, value, hash, update);
-        }
+    switch (__hm_type(bucket->index)) {
+        case __HM_EMPTY: return __hm_list_insert(map, bucket, key, value, hash, update);
         case __HM_LIST: return __hm_try_list_insert(map, bucket, key, value, hash, update);
         case __HM_SKIPLIST: return __hm_skiplist_insert(map, bucket, key, value, hash, update);
         default: return -1;
@@ -293,110 +2017,184 @@ int __hm_insert(hashmap_t *map, void *key, void *value, uint32_t hash, bool upda
 
 int __hm_list_insert(hashmap_t *map, struct __hashmap_bucket *bucket, void *key, void *value, uint32_t hash,
                      bool update) {
-    int32_t entry = map->__freelist;
-    if (entry >= 0) {
+    int32_t entry = __hm_list_slot(map);
+    return_if(-1, __hm_cow_entry(map, entry) || __hm_cow(map, bucket) != 0);
+    if (map->__keys) return_if(-1, __hm_copy_key(map, &map->__keys[entry], key) != 0);
+    __hm_list_link(map, bucket, entry, key, value, hash);
+    if (map->__lru) __hm_lru_trim(map);
+    return 0;
+}
+
+// The entry a new list node takes: the last one freed, or else the next never used one.
+int32_t __hm_list_slot(hashmap_t *map) {
+    return_if(map->__freelist, map->__freelist >= 0);
+    assert(map->__current < __hm_entry_slots(map, map->__capacity));
+    return (int32_t) map->__current;
+}
+
+// Puts a new node at the head of a list bucket in the entry from __hm_list_slot, once everything that can fail is
+// done, its key included.
+void __hm_list_link(hashmap_t *map, struct __hashmap_bucket *bucket, int32_t entry, void *key, void *value,
+                    uint32_t hash) {
+    if (entry == map->__freelist)
         map->__freelist = map->__entries[entry].next;
-    } else {
-        assert(map->__current < map->__capacity);
-        entry = map->__current++;
-    }
-    __hm_set_entry(&map->__entries[entry], key, value, hash, bucket->entry);
-    bucket->entry = entry;
+    else
+        map->__current++;
+    __hm_set_entry(map, entry, key, value, hash, __hm_head(bucket->index));
+    __hm_live_set(map, entry);
+    __hm_store(&bucket->index, __hm_list_index(entry));
     map->__size++;
-    return 0;
+    if (map->__lru) __hm_lru_add(map, entry);
 }
 
 int __hm_skiplist_insert(hashmap_t *map, struct __hashmap_bucket *bucket, void *key, void *value, uint32_t hash,
                          bool update) {
-    return skiplist_insert(bucket->skiplist, key, value, update) == 0 ? (map->__size++, 0) : -1;
+    skiplist_t *skiplist = __hm_own_skiplist(map, bucket);
+    return_if_null(-1, skiplist);
+    if (map->__keys) {
+        // Only a key that is really added gets a box.
+        if (skiplist_exists(skiplist, key, hash)) return update ? skiplist_set(skiplist, key, value, hash) : -1;
+        key = __hm_box_key(map, (struct __hashmap_key *) key);
+        return_if_null(-1, key);
+    }
+    uint32_t size = skiplist_size(skiplist);
+    if (skiplist_insert(skiplist, key, value, hash, update) != 0) {
+        if (map->__keys) __hm_drop_box(map, (struct __hashmap_key *) key);
+        return -1;
+    }
+    map->__size += skiplist_size(skiplist) - size;
+    map->__generation += skiplist_size(skiplist) != size;
+    return 0;
 }
 
 int __hm_try_list_insert(hashmap_t *map, struct __hashmap_bucket *bucket, void *key, void *value, uint32_t hash,
                          bool update) {
     uint32_t count = 0;
-    for (int32_t i = bucket->entry; i >= 0; count++, i = map->__entries[i].next) {
-        if (hashmap_equal(map, map->__entries[i].k, key) != 0) continue;
-        return update ? (map->__entries[i].v = value, 0) : -1;  // Try update.
+    for (int32_t i = __hm_head(bucket->index); i >= 0; count++, i = map->__entries[i].next) {
+        if (!__hm_entry_equal(map, i, key, hash)) continue;
+        // An expired cache entry is dropped, and the key inserted anew.
+        if (map->__lru && !__hm_lru_check(map, i, false)) break;
+        return_if(-1, !update || __hm_cow(map, &map->__vs[i]) != 0);
+        return __hm_store(&map->__vs[i], value), __hm_lru_update(map, i), 0;
     }
-    if (count < HASHMAP_THRESHOLD) {
+    // Cache chains stay lists, which the recency order links by entry index.
+    if (count < HASHMAP_THRESHOLD || map->__lru) {
         return __hm_list_insert(map, bucket, key, value, hash, update);
     }
     return_if(-1, __hm_convert_to_skiplist(map, bucket) != 0);
     return __hm_skiplist_insert(map, bucket, key, value, hash, update);
 }
 
-int __hm_remove(hashmap_t *map, void *key) {
-    struct __hashmap_bucket *bucket = __hm_bucket_for(map, hashmap_hash(map, key));
-    switch (bucket->type) {
-        case __HM_LIST: return __hm_list_remove(map, bucket, key);
-        case __HM_SKIPLIST: return __hm_try_skiplist_remove(map, bucket, key);
-        default: return 0;
+int __hm_remove(hashmap_t *map, void *key, uint32_t hash) {
+    struct __hashmap_bucket *bucket = __hm_bucket_for(map, hash);
+    switch (__hm_type(bucket->index)) {
+        case __HM_LIST: return __hm_list_remove(map, bucket, key, hash);
+        case __HM_SKIPLIST: return __hm_try_skiplist_remove(map, bucket, key, hash);
+        default: return -1;
     }
 }
 
-int __hm_list_remove(hashmap_t *map, struct __hashmap_bucket *bucket, void *key) {
-    for (int32_t prev = -1, curr = bucket->entry; curr >= 0; prev = curr, curr = map->__entries[curr].next) {
-        if (hashmap_equal(map, map->__entries[curr].k, key) != 0) continue;
-        if (prev == -1)
-            bucket->entry = map->__entries[curr].next;
-        else
-            map->__entries[prev].next = map->__entries[curr].next;
-        map->__entries[curr].next = map->__freelist;
-        map->__freelist           = curr;
-        map->__size--;
+int __hm_list_remove(hashmap_t *map, struct __hashmap_bucket *bucket, void *key, uint32_t hash) {
+    for (int32_t prev = -1, curr = __hm_head(bucket->index); curr >= 0; prev = curr, curr = map->__entries[curr].next) {
+        if (!__hm_entry_equal(map, curr, key, hash)) continue;
+        return_if(-1, __hm_list_unlink(map, bucket, prev, curr) != 0);
+        if (map->__epoch) {
+            // The unlinked entry keeps its next link for readers standing on it until they are gone.
+            epoch_retire(map->__epoch, __hm_reclaim_entry, map, (void *) (intptr_t) curr);
+            return 0;
+        }
+        __hm_list_free(map, curr);
         return 0;
     }
     return -1;
 }
 
-int __hm_skiplist_remove(hashmap_t *map, struct __hashmap_bucket *bucket, void *key) {
-    return skiplist_remove(bucket->skiplist, key) == 0 ? (map->__size--, 0) : -1;
+// Also saves the entry for views, as __hm_list_free links it into the free list right after.
+int __hm_list_unlink(hashmap_t *map, struct __hashmap_bucket *bucket, int32_t prev, int32_t entry) {
+    return_if(-1, __hm_cow(map, prev == -1 ? (void *) bucket : (void *) &map->__entries[prev]) != 0 ||
+                      __hm_cow(map, &map->__entries[entry]) != 0);
+    if (prev == -1)
+        __hm_store(&bucket->index, __hm_list_index(map->__entries[entry].next));
+    else
+        __hm_store(&map->__entries[prev].next, map->__entries[entry].next);
+    __hm_live_clear(map, entry);
+    if (map->__lru) {
+        __hm_lru_unlink(map, entry);
+        map->__bytes -= map->__lru[entry].bytes;
+    }
+    map->__size--;
+    return 0;
 }
 
-int __hm_try_skiplist_remove(hashmap_t *map, struct __hashmap_bucket *bucket, void *key) {
-    return_if(-1, __hm_skiplist_remove(map, bucket, key) != 0);
-    if (skiplist_size(bucket->skiplist) <= HASHMAP_THRESHOLD) {
+void __hm_list_free(hashmap_t *map, int32_t entry) {
+    if (map->__keys) __hm_drop_key(map, &map->__keys[entry]);
+    map->__entries[entry].next = map->__freelist;
+    map->__freelist            = entry;
+}
+
+int __hm_skiplist_remove(hashmap_t *map, struct __hashmap_bucket *bucket, void *key, uint32_t hash) {
+    void       *stored   = NULL;
+    skiplist_t *skiplist = __hm_own_skiplist(map, bucket);
+    return_if(-1, skiplist == NULL || skiplist_pop(skiplist, key, hash, &stored) != 0);
+    if (map->__keys) __hm_drop_box(map, (struct __hashmap_key *) stored);
+    map->__size--;
+    map->__generation++;
+    return 0;
+}
+
+int __hm_try_skiplist_remove(hashmap_t *map, struct __hashmap_bucket *bucket, void *key, uint32_t hash) {
+    return_if(-1, __hm_skiplist_remove(map, bucket, key, hash) != 0);
+    // Under epoch reclamation a bucket never turns back into a list, as readers may still be inside the skiplist.
+    // The removal stands either way: a bucket that cannot turn back into a list yet is still a whole skiplist.
+    if (map->__epoch == NULL && skiplist_size(__hm_skiplist(map->__vs, bucket->index)) <= HASHMAP_THRESHOLD) {
         __hm_convert_to_list(map, bucket);
     }
     return 0;
 }
 
-int __hm_set(hashmap_t *map, void *key, void *value) {
-    struct __hashmap_bucket *bucket = __hm_bucket_for(map, hashmap_hash(map, key));
-    switch (bucket->type) {
-        case __HM_LIST: return __hm_list_set(map, bucket, key, value);
-        case __HM_SKIPLIST: return __hm_skiplist_set(map, bucket, key, value);
+int __hm_set(hashmap_t *map, void *key, void *value, uint32_t hash) {
+    struct __hashmap_bucket *bucket = __hm_bucket_for(map, hash);
+    switch (__hm_type(bucket->index)) {
+        case __HM_LIST: return __hm_list_set(map, bucket, key, value, hash);
+        case __HM_SKIPLIST: return __hm_skiplist_set(map, bucket, key, value, hash);
         default: return -1;
     }
 }
 
-int __hm_list_set(hashmap_t *map, struct __hashmap_bucket *bucket, void *key, void *value) {
-    for (int32_t i = bucket->entry; i != -1; i = map->__entries[i].next) {
-        return_if((map->__entries[i].v = value, 0), hashmap_equal(map, map->__entries[i].k, key) == 0);
+int __hm_list_set(hashmap_t *map, struct __hashmap_bucket *bucket, void *key, void *value, uint32_t hash) {
+    for (int32_t i = __hm_head(bucket->index); i != -1; i = map->__entries[i].next) {
+        if (!__hm_entry_equal(map, i, key, hash)) continue;
+        return_if(-1, (map->__lru && !__hm_lru_check(map, i, false)) || __hm_cow(map, &map->__vs[i]) != 0);
+        return __hm_store(&map->__vs[i], value), __hm_lru_update(map, i), 0;
     }
     return -1;
 }
 
-int __hm_skiplist_set(hashmap_t *map, struct __hashmap_bucket *bucket, void *key, void *value) {
-    return skiplist_set(bucket->skiplist, key, value);
+int __hm_skiplist_set(hashmap_t *map, struct __hashmap_bucket *bucket, void *key, void *value, uint32_t hash) {
+    skiplist_t *skiplist = __hm_own_skiplist(map, bucket);
+    return_if(-1, skiplist == NULL);
+    return skiplist_set(skiplist, key, value, hash);
 }
 
-void *__hm_get(hashmap_t *map, void *key, void *default_value) {
-    struct __hashmap_bucket *bucket = __hm_bucket_for(map, hashmap_hash(map, key));
-    switch (bucket->type) {
-        case __HM_LIST: return __hm_list_get(map, bucket, key, default_value);
-        case __HM_SKIPLIST: return __hm_skiplist_get(map, bucket, key, default_value);
+void *__hm_get(hashmap_t *map, void *key, void *default_value, uint32_t hash) {
+    skiplist_t *unmoved = __hm_unmoved(map, hash);
+    return_if(__hm_skiplist_get(map, unmoved, key, default_value, hash), unmoved);
+    int32_t index = __hm_load(&__hm_bucket_for(map, hash)->index);
+    switch (__hm_type(index)) {
+        case __HM_LIST: return __hm_list_get(map, index - 1, key, default_value, hash);
+        case __HM_SKIPLIST: return __hm_skiplist_get(map, __hm_skiplist(map->__vs, index), key, default_value, hash);
         default: return default_value;
     }
 }
 
-void *__hm_list_get(hashmap_t *map, struct __hashmap_bucket *bucket, void *key, void *default_value) {
-    for (int32_t i = bucket->entry; i != -1; i = map->__entries[i].next) {
-        return_if(map->__entries[i].v, hashmap_equal(map, map->__entries[i].k, key) == 0);
+void *__hm_list_get(hashmap_t *map, int32_t head, void *key, void *default_value, uint32_t hash) {
+    for (int32_t i = head; i != -1; i = __hm_load(&map->__entries[i].next)) {
+        if (!__hm_entry_equal(map, i, key, hash)) continue;
+        return map->__lru == NULL || __hm_lru_check(map, i, true) ? __hm_load(&map->__vs[i]) : default_value;
     }
     return default_value;
 }
 
-void *__hm_skiplist_get(hashmap_t *map, struct __hashmap_bucket *bucket, void *key, void *default_value) {
-    return skiplist_get(bucket->skiplist, key, default_value);
+void *__hm_skiplist_get(hashmap_t *map, skiplist_t *skiplist, void *key, void *default_value, uint32_t hash) {
+    return skiplist_get(skiplist, key, hash, default_value);
 }
@@ -0,0 +1,595 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+extern "C" {
+#include "hashmap.h"
+}
+
+// Typed counterpart of hashmap_t: the same buckets of entry chains turning into skiplists past Threshold entries,
+// with hash and equality resolved at compile time so every probe inlines them, and keys and values stored by value
+// in arrays indexed like the entries. LoadFactor is the percentage of the capacity filled before the table doubles.
+template <class K, class V, class Hash = std::hash<K>, class Eq = std::equal_to<K>,
+          class Alloc = std::allocator<std::pair<const K, V>>, uint32_t Threshold = HASHMAP_THRESHOLD,
+          uint32_t LoadFactor = 75>
+class hashmap {
+    static_assert(Threshold > 0, "a bucket must hold at least one entry before turning into a skiplist");
+    static_assert(LoadFactor > 0 && LoadFactor <= 100, "the load factor is a percentage of the capacity");
+
+public:
+    explicit hashmap(uint32_t capacity = HASHMAP_MIN_SIZE, const Hash &hash = Hash(), const Eq &equal = Eq(),
+                     const Alloc &alloc = Alloc())
+        : __hash(hash), __equal(equal), __alloc(alloc) {
+        assert(capacity <= HASHMAP_MAX_SIZE);
+        __init(capacity < HASHMAP_MIN_SIZE ? HASHMAP_MIN_SIZE : __capacity_for(capacity));
+    }
+
+    hashmap(hashmap &&other) noexcept
+        : __hash(std::move(other.__hash)), __equal(std::move(other.__equal)), __alloc(std::move(other.__alloc)) {
+        __take(other);
+    }
+
+    hashmap &operator=(hashmap &&other) noexcept {
+        if (this != &other) {
+            __free();
+            __hash  = std::move(other.__hash);
+            __equal = std::move(other.__equal);
+            __alloc = std::move(other.__alloc);
+            __take(other);
+        }
+        return *this;
+    }
+
+    hashmap(const hashmap &)            = delete;
+    hashmap &operator=(const hashmap &) = delete;
+
+    ~hashmap() { __free(); }
+
+    uint32_t size() const { return __size; }
+    uint32_t capacity() const { return __capacity; }
+
+    bool exists(const K &key) const { return __find(key, __hash_of(key)) != nullptr; }
+
+    V *get(const K &key) { return __find(key, __hash_of(key)); }
+    const V *get(const K &key) const { return __find(key, __hash_of(key)); }
+    const V &get(const K &key, const V &default_value) const {
+        const V *value = get(key);
+        return value ? *value : default_value;
+    }
+
+    int insert(K key, V value, bool update = false) {
+        uint32_t hash = __hash_of(key);
+        if (V *stored = __find(key, hash)) {
+            return_if(-1, !update);
+            *stored = std::move(value);
+            return 0;
+        }
+        if (__capacity == 0) {
+            __init(HASHMAP_MIN_SIZE);
+        } else if (__overloaded()) {
+            return_if(-1, __capacity >= HASHMAP_MAX_SIZE);
+            __grow(__capacity << 1);
+        }
+        __place(std::move(key), std::move(value), hash);
+        return 0;
+    }
+
+    int set(const K &key, V value) {
+        V *stored = get(key);
+        return_if_null(-1, stored);
+        *stored = std::move(value);
+        return 0;
+    }
+
+    int remove(const K &key) {
+        return_if(-1, __capacity == 0);
+        uint32_t  hash   = __hash_of(key);
+        __bucket *bucket = __bucket_for(hash);
+        switch (bucket->type) {
+            case __HM_LIST: return __list_remove(bucket, key, hash);
+            case __HM_SKIPLIST: return __skiplist_remove(bucket, key, hash);
+            default: return -1;
+        }
+    }
+
+    int clear() {
+        __destroy_all();
+        if (__buckets) std::memset(__buckets, 0, __capacity * sizeof(__bucket));
+        __size     = 0;
+        __current  = 0;
+        __freelist = -1;
+        return 0;
+    }
+
+    int resize(uint32_t capacity) {
+        return_if(-1, capacity < __size || capacity > HASHMAP_MAX_SIZE);
+        capacity = capacity < HASHMAP_MIN_SIZE ? HASHMAP_MIN_SIZE : __capacity_for(capacity);
+        return_if(0, capacity == __capacity);
+        if (capacity > __capacity) {
+            if (__capacity == 0)
+                __init(capacity);
+            else
+                __grow(capacity);
+            return 0;
+        }
+        // Shrinking cannot keep entry indices, so everything moves into a fresh table.
+        hashmap shrunk(capacity, __hash, __equal, __alloc);
+        foreach([&](const K &key, V &value) {
+            shrunk.__place(std::move(const_cast<K &>(key)), std::move(value), __hash_of(key));
+        });
+        *this = std::move(shrunk);
+        return 0;
+    }
+
+    // The predicate is called as predicate(const K &key, V &value) for every entry, in no particular order.
+    template <class F>
+    void foreach(F &&predicate) {
+        for (uint32_t i = 0; i < __capacity; i++) {
+            __bucket *bucket = &__buckets[i];
+            if (bucket->type == __HM_LIST) {
+                for (int32_t j = bucket->entry; j >= 0; j = __entries[j].next) {
+                    predicate(static_cast<const K &>(__keys[j]), __values[j]);
+                }
+            } else if (bucket->type == __HM_SKIPLIST) {
+                for (__node *node = bucket->skiplist->head[0]; node; node = node->forward[0]) {
+                    predicate(static_cast<const K &>(node->k), node->v);
+                }
+            }
+        }
+    }
+
+private:
+    enum : uint32_t { __HM_EMPTY = 0, __HM_LIST = 1, __HM_SKIPLIST = 2 };
+
+    struct __node {
+        uint32_t hash, level;
+        K        k;
+        V        v;
+        __node  *forward[1];  // level links; allocated past the end of the node
+    };
+
+    struct __skiplist {
+        uint32_t size, level;
+        __node  *head[SKIPLIST_MAX_LEVEL];
+    };
+
+    struct __bucket {
+        uint32_t    type;
+        int32_t     entry;
+        __skiplist *skiplist;
+    };
+
+    using __traits = std::allocator_traits<Alloc>;
+    template <class T>
+    using __rebind = typename __traits::template rebind_alloc<T>;
+
+    static constexpr bool __relocatable = std::is_trivially_copyable<K>::value && std::is_trivially_copyable<V>::value;
+    static constexpr bool __trivial =
+        std::is_trivially_destructible<K>::value && std::is_trivially_destructible<V>::value;
+
+    Hash                    __hash;
+    Eq                      __equal;
+    Alloc                   __alloc;
+    uint32_t                __size     = 0;
+    uint32_t                __capacity = 0;
+    uint32_t                __current  = 0;
+    int32_t                 __freelist = -1;
+    uint64_t                __rand     = 0x9E3779B97F4A7C15ull;
+    __bucket               *__buckets  = nullptr;
+    struct __hashmap_entry *__entries  = nullptr;
+    K                      *__keys     = nullptr;
+    V                      *__values   = nullptr;
+
+    static uint32_t __capacity_for(uint32_t capacity) {
+        uint32_t c = capacity - 1;
+        c |= c >> 1;
+        c |= c >> 2;
+        c |= c >> 4;
+        c |= c >> 8;
+        c |= c >> 16;
+        return c + 1;
+    }
+
+    // std::hash is the identity for integers, so the bucket index is taken from a multiplicative mix of it.
+    uint32_t __hash_of(const K &key) const {
+        return (uint32_t) (((uint64_t) __hash(key) * 0x9E3779B97F4A7C15ull) >> 32);
+    }
+
+    __bucket *__bucket_for(uint32_t hash) const { return &__buckets[hash & (__capacity - 1)]; }
+
+    bool __overloaded() const { return (uint64_t) __size * 100 >= (uint64_t) __capacity * LoadFactor; }
+
+    template <class T>
+    T *__allocate(uint32_t n) {
+        __rebind<T> alloc(__alloc);
+        return std::allocator_traits<__rebind<T>>::allocate(alloc, n);
+    }
+
+    template <class T>
+    void __deallocate(T *ptr, uint32_t n) {
+        __rebind<T> alloc(__alloc);
+        std::allocator_traits<__rebind<T>>::deallocate(alloc, ptr, n);
+    }
+
+    void __init(uint32_t capacity) {
+        __allocate_arrays(capacity, __buckets, __entries, __keys, __values);
+        __capacity = capacity;
+    }
+
+    // Allocates the arrays of a table, all of them or, when one throws, none, with the buckets cleared. The pointers
+    // are only written once every allocation is done.
+    void __allocate_arrays(uint32_t capacity, __bucket *&buckets, struct __hashmap_entry *&entries, K *&keys,
+                           V *&values) {
+        __bucket               *b = __allocate<__bucket>(capacity);
+        struct __hashmap_entry *e = nullptr;
+        K                      *k = nullptr;
+        try {
+            e      = __allocate<struct __hashmap_entry>(capacity);
+            k      = __allocate<K>(capacity);
+            values = __allocate<V>(capacity);
+        } catch (...) {
+            if (k) __deallocate(k, capacity);
+            if (e) __deallocate(e, capacity);
+            __deallocate(b, capacity);
+            throw;
+        }
+        std::memset(b, 0, capacity * sizeof(__bucket));
+        buckets = b;
+        entries = e;
+        keys    = k;
+    }
+
+    void __deallocate_arrays(uint32_t capacity, __bucket *buckets, struct __hashmap_entry *entries, K *keys,
+                             V *values) {
+        __deallocate(buckets, capacity);
+        __deallocate(entries, capacity);
+        __deallocate(keys, capacity);
+        __deallocate(values, capacity);
+    }
+
+    // Leaves other without arrays, capacity 0, until its next insert or resize allocates them again.
+    void __take(hashmap &other) {
+        __size           = other.__size;
+        __capacity       = other.__capacity;
+        __current        = other.__current;
+        __freelist       = other.__freelist;
+        __rand           = other.__rand;
+        __buckets        = other.__buckets;
+        __entries        = other.__entries;
+        __keys           = other.__keys;
+        __values         = other.__values;
+        other.__size     = 0;
+        other.__capacity = 0;
+        other.__current  = 0;
+        other.__freelist = -1;
+        other.__buckets  = nullptr;
+        other.__entries  = nullptr;
+        other.__keys     = nullptr;
+        other.__values   = nullptr;
+    }
+
+    void __free() {
+        if (__buckets == nullptr) return;
+        __destroy_all();
+        __deallocate_arrays(__capacity, __buckets, __entries, __keys, __values);
+        __buckets = nullptr;
+    }
+
+    // Destroys every key and value and releases the skiplists, leaving the arrays allocated.
+    void __destroy_all() {
+        for (uint32_t i = 0; i < __capacity; i++) {
+            __bucket *bucket = &__buckets[i];
+            if (bucket->type == __HM_LIST && !__trivial) {
+                for (int32_t j = bucket->entry; j >= 0; j = __entries[j].next) {
+                    __destroy_entry(j);
+                }
+            } else if (bucket->type == __HM_SKIPLIST) {
+                __free_skiplist(bucket->skiplist);
+            }
+        }
+    }
+
+    V *__find(const K &key, uint32_t hash) const {
+        return_if(nullptr, __capacity == 0);
+        __bucket *bucket = __bucket_for(hash);
+        if (bucket->type == __HM_LIST) {
+            for (int32_t i = bucket->entry; i >= 0; i = __entries[i].next) {
+                return_if(&__values[i], __entries[i].hash == hash && __equal(__keys[i], key));
+            }
+        } else if (bucket->type == __HM_SKIPLIST) {
+            __node *node = __skiplist_find(bucket->skiplist, key, hash);
+            return_if(&node->v, node);
+        }
+        return nullptr;
+    }
+
+    // Files a key known to be absent, turning its bucket into a skiplist once the chain is Threshold long.
+    void __place(K &&key, V &&value, uint32_t hash) {
+        __bucket *bucket = __bucket_for(hash);
+        if (bucket->type == __HM_EMPTY) {
+            bucket->type  = __HM_LIST;
+            bucket->entry = -1;
+        }
+        if (bucket->type == __HM_LIST) {
+            uint32_t count = 0;
+            for (int32_t i = bucket->entry; i >= 0; i = __entries[i].next) count++;
+            if (count < Threshold) {
+                __list_insert(bucket, std::move(key), std::move(value), hash);
+                return;
+            }
+            __convert_to_skiplist(bucket);
+        }
+        __skiplist_insert(bucket->skiplist, __alloc_node(std::move(key), std::move(value), hash));
+        __size++;
+    }
+
+    void __list_insert(__bucket *bucket, K &&key, V &&value, uint32_t hash) {
+        int32_t entry = __freelist;
+        if (entry < 0) {
+            assert(__current < __capacity);
+            entry = __current++;
+        } else {
+            __freelist = __entries[entry].next;
+        }
+        ::new (static_cast<void *>(&__keys[entry])) K(std::move(key));
+        ::new (static_cast<void *>(&__values[entry])) V(std::move(value));
+        __entries[entry].hash = hash;
+        __entries[entry].next = bucket->entry;
+        bucket->entry         = entry;
+        __size++;
+    }
+
+    int __list_remove(__bucket *bucket, const K &key, uint32_t hash) {
+        for (int32_t prev = -1, curr = bucket->entry; curr >= 0; prev = curr, curr = __entries[curr].next) {
+            if (__entries[curr].hash != hash || !__equal(__keys[curr], key)) continue;
+            if (prev == -1)
+                bucket->entry = __entries[curr].next;
+            else
+                __entries[prev].next = __entries[curr].next;
+            __release_entry(curr);
+            __size--;
+            return 0;
+        }
+        return -1;
+    }
+
+    int __skiplist_remove(__bucket *bucket, const K &key, uint32_t hash) {
+        __node *node = __skiplist_pop(bucket->skiplist, key, hash);
+        return_if_null(-1, node);
+        __free_node(node);
+        __size--;
+        if (bucket->skiplist->size <= Threshold) __convert_to_list(bucket);
+        return 0;
+    }
+
+    void __destroy_entry(int32_t entry) {
+        __keys[entry].~K();
+        __values[entry].~V();
+    }
+
+    void __release_entry(int32_t entry) {
+        __destroy_entry(entry);
+        __entries[entry].next = __freelist;
+        __freelist            = entry;
+    }
+
+    // The skiplist and all its nodes are allocated before any entry moves out of the list, so a throw leaves the
+    // bucket as it was.
+    void __convert_to_skiplist(__bucket *bucket) {
+        __node     *nodes[Threshold];
+        uint32_t    count    = 0;
+        __skiplist *skiplist = __allocate<__skiplist>(1);
+        try {
+            for (int32_t i = bucket->entry; i >= 0; i = __entries[i].next) nodes[count++] = __allocate_node();
+        } catch (...) {
+            while (count > 0) __deallocate_node(nodes[--count]);
+            __deallocate(skiplist, 1);
+            throw;
+        }
+        std::memset(skiplist, 0, sizeof(__skiplist));
+        skiplist->level = 1;
+        for (int32_t i = bucket->entry, next; i >= 0; i = next) {
+            next         = __entries[i].next;
+            __node *node = nodes[--count];
+            ::new (static_cast<void *>(&node->k)) K(std::move(__keys[i]));
+            ::new (static_cast<void *>(&node->v)) V(std::move(__values[i]));
+            node->hash = __entries[i].hash;
+            __skiplist_insert(skiplist, node);
+            __release_entry(i);
+        }
+        bucket->type     = __HM_SKIPLIST;
+        bucket->entry    = -1;
+        bucket->skiplist = skiplist;
+    }
+
+    void __convert_to_list(__bucket *bucket) {
+        __skiplist *skiplist = bucket->skiplist;
+        bucket->type         = __HM_LIST;
+        bucket->entry        = -1;
+        bucket->skiplist     = nullptr;
+        for (__node *node = skiplist->head[0], *next; node; node = next) {
+            next = node->forward[0];
+            __list_insert(bucket, std::move(node->k), std::move(node->v), node->hash);
+            __size--;
+            __free_node(node);
+        }
+        __deallocate(skiplist, 1);
+    }
+
+    // Entries keep their indices, so keys and values move by index (a single memcpy when both are trivially
+    // copyable) and each old bucket only splits over the new buckets congruent to it, as in __hm_grow. Skiplist nodes
+    // are relinked, not rebuilt. Everything that allocates comes first, so a throw leaves the map as it was, and the
+    // rest assumes keys and values move without throwing.
+    void __grow(uint32_t capacity) {
+        __bucket               *buckets;
+        struct __hashmap_entry *entries;
+        K                      *keys;
+        V                      *values;
+        __allocate_arrays(capacity, buckets, entries, keys, values);
+        uint32_t old  = __capacity;
+        uint32_t mask = capacity - 1;
+        // A skiplist splits into one per new bucket its nodes land in, and those are the only nodes landing there.
+        try {
+            for (uint32_t i = 0; i < old; i++) {
+                if (__buckets[i].type != __HM_SKIPLIST) continue;
+                for (__node *node = __buckets[i].skiplist->head[0]; node; node = node->forward[0]) {
+                    __bucket *target = &buckets[node->hash & mask];
+                    if (target->type == __HM_SKIPLIST) continue;
+                    target->skiplist = __allocate<__skiplist>(1);
+                    std::memset(target->skiplist, 0, sizeof(__skiplist));
+                    target->skiplist->level = 1;
+                    target->type            = __HM_SKIPLIST;
+                    target->entry           = -1;
+                }
+            }
+        } catch (...) {
+            for (uint32_t i = 0; i < capacity; i++) {
+                if (buckets[i].type == __HM_SKIPLIST) __deallocate(buckets[i].skiplist, 1);
+            }
+            __deallocate_arrays(capacity, buckets, entries, keys, values);
+            throw;
+        }
+        std::memcpy(entries, __entries, __current * sizeof(struct __hashmap_entry));
+        if (__relocatable) {
+            std::memcpy(static_cast<void *>(keys), __keys, __current * sizeof(K));
+            std::memcpy(static_cast<void *>(values), __values, __current * sizeof(V));
+        }
+        for (uint32_t i = 0; i < old; i++) {
+            if (__buckets[i].type == __HM_LIST) {
+                for (int32_t j = __buckets[i].entry, next; j >= 0; j = next) {
+                    next = entries[j].next;
+                    if (!__relocatable) {
+                        ::new (static_cast<void *>(&keys[j])) K(std::move(__keys[j]));
+                        ::new (static_cast<void *>(&values[j])) V(std::move(__values[j]));
+                        __keys[j].~K();
+                        __values[j].~V();
+                    }
+                    __bucket *target = &buckets[entries[j].hash & mask];
+                    if (target->type == __HM_EMPTY) {
+                        target->type  = __HM_LIST;
+                        target->entry = -1;
+                    }
+                    entries[j].next = target->entry;
+                    target->entry   = j;
+                }
+            } else if (__buckets[i].type == __HM_SKIPLIST) {
+                __skiplist *skiplist = __buckets[i].skiplist;
+                for (__node *node = skiplist->head[0], *next; node; node = next) {
+                    next = node->forward[0];
+                    __skiplist_insert(buckets[node->hash & mask].skiplist, node);
+                }
+                __deallocate(skiplist, 1);
+            }
+        }
+        __deallocate_arrays(old, __buckets, __entries, __keys, __values);
+        __capacity = capacity;
+        __buckets  = buckets;
+        __entries  = entries;
+        __keys     = keys;
+        __values   = values;
+    }
+
+    // Skiplist nodes are ordered by hash alone: the few nodes sharing a hash are told apart with Eq on the bottom
+    // level, so keys need no ordering of their own.
+    uint32_t __rand_level() {
+        __rand ^= __rand << 13;
+        __rand ^= __rand >> 7;
+        __rand ^= __rand << 17;
+        uint32_t level = 1 + __builtin_ctzll(__rand | (1ull << 63));
+        return level < SKIPLIST_MAX_LEVEL ? level : SKIPLIST_MAX_LEVEL;
+    }
+
+    static size_t __node_words(uint32_t level) {
+        size_t size = sizeof(__node) + (level - 1) * sizeof(__node *);
+        return (size + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t);
+    }
+
+    __node *__alloc_node(K &&key, V &&value, uint32_t hash) {
+        __node *node = __allocate_node();
+        ::new (static_cast<void *>(&node->k)) K(std::move(key));
+        ::new (static_cast<void *>(&node->v)) V(std::move(value));
+        node->hash = hash;
+        return node;
+    }
+
+    // A node of a random level with neither key nor value built in it yet.
+    __node *__allocate_node() {
+        uint32_t level = __rand_level();
+        __node  *node  = reinterpret_cast<__node *>(__allocate<std::max_align_t>(__node_words(level)));
+        node->level    = level;
+        return node;
+    }
+
+    void __deallocate_node(__node *node) {
+        __deallocate(reinterpret_cast<std::max_align_t *>(node), __node_words(node->level));
+    }
+
+    void __free_node(__node *node) {
+        node->k.~K();
+        node->v.~V();
+        __deallocate_node(node);
+    }
+
+    void __free_skiplist(__skiplist *skiplist) {
+        for (__node *node = skiplist->head[0], *next; node; node = next) {
+            next = node->forward[0];
+            __free_node(node);
+        }
+        __deallocate(skiplist, 1);
+    }
+
+    // Returns the links standing right before the first node whose hash is not below the given one.
+    static __node **__skiplist_seek(__skiplist *skiplist, uint32_t hash, __node ***updates) {
+        __node **prev = skiplist->head;
+        for (int32_t lv = skiplist->level - 1; lv >= 0; lv--) {
+            while (prev[lv] && prev[lv]->hash < hash) prev = prev[lv]->forward;
+            if (updates) updates[lv] = prev;
+        }
+        return prev;
+    }
+
+    __node *__skiplist_find(__skiplist *skiplist, const K &key, uint32_t hash) const {
+        __node **prev = __skiplist_seek(skiplist, hash, nullptr);
+        for (__node *node = prev[0]; node && node->hash == hash; node = node->forward[0]) {
+            return_if(node, __equal(node->k, key));
+        }
+        return nullptr;
+    }
+
+    static void __skiplist_insert(__skiplist *skiplist, __node *node) {
+        __node **updates[SKIPLIST_MAX_LEVEL];
+        __skiplist_seek(skiplist, node->hash, updates);
+        for (uint32_t lv = skiplist->level; lv < node->level; lv++) {
+            updates[lv] = skiplist->head;
+        }
+        for (uint32_t lv = 0; lv < node->level; lv++) {
+            node->forward[lv] = updates[lv][lv];
+            updates[lv][lv]   = node;
+        }
+        if (skiplist->level < node->level) skiplist->level = node->level;
+        skiplist->size++;
+    }
+
+    __node *__skiplist_pop(__skiplist *skiplist, const K &key, uint32_t hash) {
+        __node **updates[SKIPLIST_MAX_LEVEL];
+        __node  *node = __skiplist_seek(skiplist, hash, updates)[0];
+        while (node && node->hash == hash && !__equal(node->k, key)) node = node->forward[0];
+        return_if(nullptr, node == nullptr || node->hash != hash);
+        // A node past the first of its hash is reached from the last link before it on each of its levels.
+        for (uint32_t lv = 0; lv < node->level; lv++) {
+            __node **prev = updates[lv];
+            while (prev[lv] != node) prev = prev[lv]->forward;
+            prev[lv] = node->forward[lv];
+        }
+        while (skiplist->level > 1 && skiplist->head[skiplist->level - 1] == nullptr) skiplist->level--;
+        skiplist->size--;
+        return node;
+    }
+};
@@ -0,0 +1,148 @@
+#include "hashmap_concurrent.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+
+// Internals of hashmap.c, entered with the hash already computed.
+int   __hm_ensure_capacity(hashmap_t *map);
+bool  __hm_exists(hashmap_t *, void *key, uint32_t hash);
+int   __hm_insert(hashmap_t *, void *key, void *value, uint32_t hash, bool update);
+int   __hm_remove(hashmap_t *, void *key, uint32_t hash);
+int   __hm_set(hashmap_t *, void *key, void *value, uint32_t hash);
+void *__hm_get(hashmap_t *map, void *key, void *default_value, uint32_t hash);
+
+// Segments are picked from the high bits of a multiplicative mix, so keys sharing a segment do not also share the
+// low bits that select their bucket inside it.
+#define __hmc_segment_for(MAP, HASH) \
+    (&(MAP)->__segments[((uint64_t) (uint32_t) ((HASH) * 0x9E3779B1u) * (MAP)->__nsegments) >> 32])
+#define __hmc_read_lock(SEGMENT) pthread_rwlock_rdlock(&(SEGMENT)->lock)
+#define __hmc_write_lock(SEGMENT) pthread_rwlock_wrlock(&(SEGMENT)->lock)
+#define __hmc_unlock(SEGMENT) pthread_rwlock_unlock(&(SEGMENT)->lock)
+// Segments start on a cache line and fill whole ones, so threads busy on neighbouring segments never pull each
+// other's locks back and forth.
+#define __HMC_CACHE_LINE 64
+
+_Static_assert(sizeof(struct __hashmap_segment) % __HMC_CACHE_LINE == 0, "segments are padded to whole cache lines");
+
+int hashmap_concurrent_init(hashmap_concurrent_t *map, uint32_t capacity, uint32_t segments,
+                            uint32_t (*hash)(void *), int (*equal)(void *, void *)) {
+    return_if(-1, segments == 0 || capacity > HASHMAP_MAX_SIZE);
+    struct __hashmap_segment *array = NULL;
+    uint64_t                  seed  = hash_seed();
+    return_if(-1, posix_memalign((void **) &array, __HMC_CACHE_LINE,
+                                 segments * sizeof(struct __hashmap_segment)) != 0);
+    for (uint32_t i = 0; i < segments; i++) {
+        // Segments never resize incrementally: a lookup must not move buckets while holding a read lock.
+        int ret = hashmap_init(&array[i].map, capacity / segments, hash, equal, NULL);
+        // The segment is picked with the same hash the segment map files the key under.
+        array[i].map.__seed = seed;
+        if (ret == 0 && pthread_rwlock_init(&array[i].lock, NULL) != 0) {
+            hashmap_free(&array[i].map);
+            ret = -1;
+        }
+        if (ret != 0) {
+            while (i--) {
+                pthread_rwlock_destroy(&array[i].lock);
+                hashmap_free(&array[i].map);
+            }
+            free(array);
+            return -1;
+        }
+    }
+    map->__nsegments = segments;
+    map->__segments  = array;
+    map->__hash      = hash;
+    map->__seed      = seed;
+    return 0;
+}
+
+int hashmap_concurrent_free(hashmap_concurrent_t *map) {
+    return_if_null(0, map->__segments);
+    for (uint32_t i = 0; i < map->__nsegments; i++) {
+        pthread_rwlock_destroy(&map->__segments[i].lock);
+        hashmap_free(&map->__segments[i].map);
+    }
+    free(map->__segments);
+    map->__segments = NULL;
+    return 0;
+}
+
+int hashmap_concurrent_destroy(hashmap_concurrent_t *map) {
+    hashmap_concurrent_free(map);
+    map->__nsegments = 0;
+    map->__hash      = NULL;
+    return 0;
+}
+
+uint32_t hashmap_concurrent_size(hashmap_concurrent_t *map) {
+    uint32_t size = 0;
+    for (uint32_t i = 0; i < map->__nsegments; i++) {
+        size += __atomic_load_n(&map->__segments[i].map.__size, __ATOMIC_RELAXED);
+    }
+    return size;
+}
+
+bool hashmap_concurrent_exists(hashmap_concurrent_t *map, void *key) {
+    uint32_t                  hash    = hashmap_concurrent_hash(map, key);
+    struct __hashmap_segment *segment = __hmc_segment_for(map, hash);
+    __hmc_read_lock(segment);
+    bool ret = __hm_exists(&segment->map, key, hash);
+    __hmc_unlock(segment);
+    return ret;
+}
+
+int hashmap_concurrent_insert(hashmap_concurrent_t *map, void *key, void *value, bool update) {
+    uint32_t                  hash    = hashmap_concurrent_hash(map, key);
+    struct __hashmap_segment *segment = __hmc_segment_for(map, hash);
+    __hmc_write_lock(segment);
+    int ret = __hm_ensure_capacity(&segment->map);
+    if (ret == 0) ret = __hm_insert(&segment->map, key, value, hash, update);
+    __hmc_unlock(segment);
+    return ret;
+}
+
+int hashmap_concurrent_remove(hashmap_concurrent_t *map, void *key) {
+    uint32_t                  hash    = hashmap_concurrent_hash(map, key);
+    struct __hashmap_segment *segment = __hmc_segment_for(map, hash);
+    __hmc_write_lock(segment);
+    int ret = __hm_remove(&segment->map, key, hash);
+    __hmc_unlock(segment);
+    return ret;
+}
+
+int hashmap_concurrent_set(hashmap_concurrent_t *map, void *key, void *value) {
+    uint32_t                  hash    = hashmap_concurrent_hash(map, key);
+    struct __hashmap_segment *segment = __hmc_segment_for(map, hash);
+    __hmc_write_lock(segment);
+    int ret = __hm_set(&segment->map, key, value, hash);
+    __hmc_unlock(segment);
+    return ret;
+}
+
+void *hashmap_concurrent_get(hashmap_concurrent_t *map, void *key, void *default_value) {
+    uint32_t                  hash    = hashmap_concurrent_hash(map, key);
+    struct __hashmap_segment *segment = __hmc_segment_for(map, hash);
+    __hmc_read_lock(segment);
+    void *ret = __hm_get(&segment->map, key, default_value, hash);
+    __hmc_unlock(segment);
+    return ret;
+}
+
+int hashmap_concurrent_clear(hashmap_concurrent_t *map) {
+    for (uint32_t i = 0; i < map->__nsegments; i++) {
+        __hmc_write_lock(&map->__segments[i]);
+        hashmap_clear(&map->__segments[i].map);
+        __hmc_unlock(&map->__segments[i]);
+    }
+    return 0;
+}
+
+void hashmap_concurrent_foreach(hashmap_concurrent_t *map, void (*predicate)(void *, void *, void *), void *args) {
+    for (uint32_t i = 0; i < map->__nsegments; i++) {
+        __hmc_read_lock(&map->__segments[i]);
+        hashmap_foreach(&map->__segments[i].map, predicate, args);
+        __hmc_unlock(&map->__segments[i]);
+    }
+}
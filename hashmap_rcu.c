@@ -0,0 +1,131 @@
+#include "hashmap_rcu.h"
+
+#include <stdlib.h>
+
+// Internals of hashmap.c, entered with the hash already computed.
+int   __hm_rehash(hashmap_t *, hashmap_t *newmap, uint32_t capacity, uint32_t load);
+bool  __hm_overloaded(hashmap_t *);
+bool  __hm_exists(hashmap_t *, void *key, uint32_t hash);
+int   __hm_insert(hashmap_t *, void *key, void *value, uint32_t hash, bool update);
+int   __hm_remove(hashmap_t *, void *key, uint32_t hash);
+int   __hm_set(hashmap_t *, void *key, void *value, uint32_t hash);
+void *__hm_get(hashmap_t *map, void *key, void *default_value, uint32_t hash);
+
+int  __hmr_publish(hashmap_rcu_t *rcu, uint32_t capacity);
+int  __hmr_ensure_capacity(hashmap_rcu_t *rcu);
+void __hmr_reclaim_map(void *ctx, void *map);
+
+// Only the writer replaces the map, so it reads the pointer plainly; readers pair the acquire with its release.
+#define __hmr_map(RCU) ((RCU)->__map)
+#define __hmr_reader_map(RCU) __atomic_load_n(&(RCU)->__map, __ATOMIC_ACQUIRE)
+#define __hmr_full(MAP) ((MAP)->__freelist < 0 && (MAP)->__current == (MAP)->__capacity)
+
+int hashmap_rcu_init(hashmap_rcu_t *rcu, uint32_t capacity, uint32_t (*hash)(void *), int (*equal)(void *, void *)) {
+    hashmap_t *map = (hashmap_t *) malloc(sizeof(hashmap_t));
+    return_if_null(-1, map);
+    return_if((free(map), -1), hashmap_init(map, capacity, hash, equal, NULL) != 0);
+    epoch_init(&rcu->__epoch);
+    map->__epoch = &rcu->__epoch;
+    rcu->__map   = map;
+    return 0;
+}
+
+int hashmap_rcu_free(hashmap_rcu_t *rcu) {
+    return_if_null(0, rcu->__map);
+    // Retired entries, nodes and maps go first: they may still point into the live map's pools.
+    epoch_free(&rcu->__epoch);
+    hashmap_free(rcu->__map);
+    free(rcu->__map);
+    rcu->__map = NULL;
+    return 0;
+}
+
+hashmap_rcu_reader_t *hashmap_rcu_register(hashmap_rcu_t *rcu) {
+    return epoch_register(&rcu->__epoch);
+}
+
+void hashmap_rcu_unregister(hashmap_rcu_reader_t *reader) {
+    epoch_unregister(reader);
+}
+
+uint32_t hashmap_rcu_size(hashmap_rcu_t *rcu) {
+    return __atomic_load_n(&__hmr_reader_map(rcu)->__size, __ATOMIC_RELAXED);
+}
+
+bool hashmap_rcu_exists(hashmap_rcu_t *rcu, hashmap_rcu_reader_t *reader, void *key) {
+    epoch_enter(reader);
+    hashmap_t *map = __hmr_reader_map(rcu);
+    bool       ret = __hm_exists(map, key, hashmap_hash(map, key));
+    epoch_exit(reader);
+    return ret;
+}
+
+void *hashmap_rcu_get(hashmap_rcu_t *rcu, hashmap_rcu_reader_t *reader, void *key, void *default_value) {
+    epoch_enter(reader);
+    hashmap_t *map = __hmr_reader_map(rcu);
+    void      *ret = __hm_get(map, key, default_value, hashmap_hash(map, key));
+    epoch_exit(reader);
+    return ret;
+}
+
+int hashmap_rcu_insert(hashmap_rcu_t *rcu, void *key, void *value, bool update) {
+    return_if(-1, __hmr_ensure_capacity(rcu) != 0);
+    hashmap_t *map = __hmr_map(rcu);
+    int        ret = __hm_insert(map, key, value, hashmap_hash(map, key), update);
+    epoch_collect(&rcu->__epoch);
+    return ret;
+}
+
+int hashmap_rcu_remove(hashmap_rcu_t *rcu, void *key) {
+    hashmap_t *map = __hmr_map(rcu);
+    int        ret = __hm_remove(map, key, hashmap_hash(map, key));
+    epoch_collect(&rcu->__epoch);
+    return ret;
+}
+
+int hashmap_rcu_set(hashmap_rcu_t *rcu, void *key, void *value) {
+    hashmap_t *map = __hmr_map(rcu);
+    return __hm_set(map, key, value, hashmap_hash(map, key));
+}
+
+int hashmap_rcu_clear(hashmap_rcu_t *rcu) {
+    hashmap_t *map    = __hmr_map(rcu);
+    hashmap_t *newmap = (hashmap_t *) malloc(sizeof(hashmap_t));
+    return_if_null(-1, newmap);
+    int ret = hashmap_init(newmap, map->__capacity, map->__hash, map->__equal, NULL);
+    return_if((free(newmap), -1), ret != 0);
+    newmap->__epoch = &rcu->__epoch;
+    __atomic_store_n(&rcu->__map, newmap, __ATOMIC_RELEASE);
+    epoch_retire(&rcu->__epoch, __hmr_reclaim_map, NULL, map);
+    epoch_collect(&rcu->__epoch);
+    return 0;
+}
+
+int __hmr_ensure_capacity(hashmap_rcu_t *rcu) {
+    hashmap_t *map = __hmr_map(rcu);
+    if (__hm_overloaded(map)) return __hmr_publish(rcu, map->__capacity << 1);
+    // Entries still waiting for readers are not on the free list yet. Once the readers move on, two epochs bring them
+    // back, so only readers that hold on make the table grow: a copy at the same capacity would free no more slots.
+    for (int i = 0; i < 3 && __hmr_full(map); i++) epoch_collect(&rcu->__epoch);
+    if (__hmr_full(map)) {
+        return_if(-1, map->__capacity >= HASHMAP_MAX_SIZE);
+        return __hmr_publish(rcu, map->__capacity << 1);
+    }
+    return 0;
+}
+
+int __hmr_publish(hashmap_rcu_t *rcu, uint32_t capacity) {
+    // The map is never resized in place: readers keep the old one until they leave their epoch.
+    hashmap_t *map    = __hmr_map(rcu);
+    hashmap_t *newmap = (hashmap_t *) malloc(sizeof(hashmap_t));
+    return_if_null(-1, newmap);
+    return_if((free(newmap), -1), __hm_rehash(map, newmap, capacity, map->__load) != 0);
+    __atomic_store_n(&rcu->__map, newmap, __ATOMIC_RELEASE);
+    epoch_retire(&rcu->__epoch, __hmr_reclaim_map, NULL, map);
+    return 0;
+}
+
+void __hmr_reclaim_map(void *ctx, void *map) {
+    hashmap_free((hashmap_t *) map);
+    free(map);
+}
@@ -0,0 +1,286 @@
+// MAP_FIXED_NOREPLACE is a GNU extension.
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "hashmap.h"
+
+// Internals of hashmap.c.
+int __hm_free_buckets(hashmap_t *);
+int __hm_free_entries(hashmap_t *);
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+#define __HMS_MAGIC 0x31504e534d48ull  // "HMSNP1"
+#define __HMS_VERSION 2
+#define __HMS_ALIGN 64
+// Key pointers are written for an address picked from the seed, so snapshots of different maps rarely want the same
+// one. A snapshot that cannot be mapped there is relocated instead.
+#define __hms_base_for(SEED) ((uint64_t) 0x100000000000ull + (((SEED) & 0xFFF) << 32))
+#define __hms_align(SIZE) (((SIZE) + __HMS_ALIGN - 1) & ~(uint64_t) (__HMS_ALIGN - 1))
+#define __HMS_BODY __hms_align(sizeof(struct __hms_header))
+#define __hms_header_of(MAP) ((struct __hms_header *) ((uint8_t *) (MAP)->__buckets - __HMS_BODY))
+#define __hms_checksum(DATA, LEN) wyhash((DATA), (LEN), __HMS_MAGIC)
+#define __hms_section(FILE, HEADER, NAME, TYPE) ((TYPE *) ((FILE) + (HEADER)->NAME))
+
+// A bucket holds one more than the head entry of its chain, 0 when empty, as in hashmap.c. Skiplist buckets are written
+// out as plain lists.
+
+struct __hms_header {
+    uint64_t magic;
+    uint32_t version, flags;
+    uint32_t size, capacity;
+    // Layout of the arrays as written, checked against the reader's.
+    uint32_t bucket_size, entry_size, key_size, pointer_size;
+    uint64_t seed;
+    uint64_t base, length;
+    // Section offsets from the start of the file.
+    uint64_t buckets, entries, vs, keys, bytes;
+    uint64_t checksum;  // Of everything after the header.
+    uint64_t header_checksum;
+};
+
+struct __hms_writer {
+    hashmap_t           *map;
+    uint32_t             mask;
+    uint32_t            *cursor;  // Per bucket: entries counted first, then the next index to fill.
+    uint64_t             bytes;   // Key bytes counted first, then the next offset to fill.
+    uint8_t             *file;
+    struct __hms_header *header;
+};
+
+uint32_t __hms_hash(hashmap_t *map, void *key);
+uint32_t __hms_key_bytes(hashmap_t *map, void *key);
+void     __hms_count(void *key, void *value, void *args);
+void     __hms_fill(void *key, void *value, void *args);
+void     __hms_link(struct __hms_header *header, uint8_t *file, uint32_t *cursor);
+void     __hms_layout(struct __hms_header *header);
+bool     __hms_valid(struct __hms_header *header, uint64_t length);
+int      __hms_relocate(struct __hms_header *header, uint8_t *file);
+
+int hashmap_save(hashmap_t *map, const char *path) {
+    uint32_t            capacity = hashmap_capacity(map);
+    bool                binary   = map->__flags & HASHMAP_BINARY_KEYS;
+    struct __hms_writer writer   = {.map = map, .mask = capacity - 1, .cursor = calloc(capacity, sizeof(uint32_t))};
+    return_if_null(-1, writer.cursor);
+    hashmap_foreach(map, __hms_count, &writer);
+    // Entries are laid out bucket by bucket, so every chain is a run of consecutive indices.
+    for (uint32_t i = 0, start = 0, count; i < capacity; i++, start += count) {
+        count            = writer.cursor[i];
+        writer.cursor[i] = start;
+    }
+    struct __hms_header header = {.magic        = __HMS_MAGIC,
+                                  .version      = __HMS_VERSION,
+                                  .flags        = map->__flags & (HASHMAP_BINARY_KEYS | HASHMAP_U64_KEYS),
+                                  .size         = hashmap_size(map),
+                                  .capacity     = capacity,
+                                  .bucket_size  = sizeof(struct __hashmap_bucket),
+                                  .entry_size   = sizeof(struct __hashmap_entry),
+                                  .key_size     = binary ? sizeof(struct __hashmap_key) : sizeof(void *),
+                                  .pointer_size = sizeof(void *),
+                                  .seed         = map->__seed,
+                                  .base         = __hms_base_for(map->__seed)};
+    __hms_layout(&header);
+    header.length = header.bytes + writer.bytes;
+    // Written aside and renamed over the target, so a reader never maps a half-written snapshot.
+    char tmp[4096];
+    return_if((free(writer.cursor), -1), snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp));
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    return_if((free(writer.cursor), -1), fd < 0);
+    uint8_t *file = MAP_FAILED;
+    if (ftruncate(fd, (off_t) header.length) == 0) {
+        file = (uint8_t *) mmap(NULL, header.length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (file == MAP_FAILED) {
+        free(writer.cursor);
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    writer.file   = file;
+    writer.header = &header;
+    writer.bytes  = 0;
+    hashmap_foreach(map, __hms_fill, &writer);
+    __hms_link(&header, file, writer.cursor);
+    free(writer.cursor);
+    header.checksum        = __hms_checksum(file + header.buckets, header.length - header.buckets);
+    header.header_checksum = __hms_checksum(&header, offsetof(struct __hms_header, header_checksum));
+    memcpy(file, &header, sizeof(header));
+    int ret = munmap(file, header.length);
+    if (ret == 0) ret = fsync(fd);
+    if (close(fd) != 0) ret = -1;
+    if (ret == 0) ret = rename(tmp, path);
+    return_if((unlink(tmp), -1), ret != 0);
+    return 0;
+}
+
+int hashmap_open_mmap(hashmap_t *map, const char *path, uint32_t (*hash)(void *), int (*equal)(void *, void *),
+                      bool verify) {
+    struct __hms_header header;
+    struct stat         st;
+    int                 fd = open(path, O_RDONLY);
+    return_if(-1, fd < 0);
+    if (fstat(fd, &st) != 0 || pread(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header) ||
+        !__hms_valid(&header, (uint64_t) st.st_size)) {
+        close(fd);
+        return -1;
+    }
+    uint8_t *file =
+        (uint8_t *) mmap((void *) header.base, header.length, PROT_READ, MAP_PRIVATE | MAP_FIXED_NOREPLACE, fd, 0);
+    if (file == MAP_FAILED) file = (uint8_t *) mmap(NULL, header.length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    return_if(-1, file == MAP_FAILED);
+    // Lookups land anywhere in the file, so read-ahead would only fetch pages nobody asks for.
+    madvise(file, header.length, MADV_RANDOM);
+    if (verify && __hms_checksum(file + header.buckets, header.length - header.buckets) != header.checksum) {
+        munmap(file, header.length);
+        return -1;
+    }
+    if ((uint64_t) (uintptr_t) file != header.base && __hms_relocate(&header, file) != 0) {
+        munmap(file, header.length);
+        return -1;
+    }
+    // Every member is set as for an empty map, then its arrays are swapped for the mapped ones.
+    if (hashmap_init_with(map, HASHMAP_MIN_SIZE, hash, equal, NULL, header.flags) != 0) {
+        munmap(file, header.length);
+        return -1;
+    }
+    __hm_free_buckets(map);
+    __hm_free_entries(map);
+    bool binary     = header.flags & HASHMAP_BINARY_KEYS;
+    map->__size     = header.size;
+    map->__capacity = header.capacity;
+    map->__current  = header.size;
+    map->__seed     = header.seed;
+    map->__flags    = header.flags | HASHMAP_SNAPSHOT;
+    map->__buckets  = __hms_section(file, &header, buckets, struct __hashmap_bucket);
+    map->__entries  = __hms_section(file, &header, entries, struct __hashmap_entry);
+    map->__vs       = __hms_section(file, &header, vs, void *);
+    map->__ks       = binary ? NULL : __hms_section(file, &header, keys, void *);
+    map->__keys     = binary ? __hms_section(file, &header, keys, struct __hashmap_key) : NULL;
+    return 0;
+}
+
+int __hm_close_snapshot(hashmap_t *map) {
+    return_if_null(0, map->__buckets);
+    struct __hms_header *header = __hms_header_of(map);
+    munmap(header, header->length);
+    map->__buckets = NULL;
+    map->__entries = NULL;
+    map->__ks      = NULL;
+    map->__vs      = NULL;
+    map->__keys    = NULL;
+    return 0;
+}
+
+uint32_t __hms_hash(hashmap_t *map, void *key) {
+    return_if((uint32_t) wyhash_u64((uintptr_t) key, map->__seed), map->__flags & HASHMAP_U64_KEYS);
+    return_if(hashmap_hash(map, key), !(map->__flags & HASHMAP_BINARY_KEYS));
+    return (uint32_t) wyhash(hashmap_key_data(key), hashmap_key_length(key), map->__seed);
+}
+
+// Bytes a key keeps outside its slot: all of a string, a binary key too long to be inline, none of an integer.
+uint32_t __hms_key_bytes(hashmap_t *map, void *key) {
+    return_if(0, map->__flags & HASHMAP_U64_KEYS);
+    return_if((uint32_t) strlen((char *) key) + 1, !(map->__flags & HASHMAP_BINARY_KEYS));
+    uint32_t len = hashmap_key_length(key);
+    return len > HASHMAP_INLINE_KEY ? len : 0;
+}
+
+void __hms_count(void *key, void *value, void *args) {
+    struct __hms_writer *writer = (struct __hms_writer *) args;
+    writer->cursor[__hms_hash(writer->map, key) & writer->mask]++;
+    writer->bytes += __hms_key_bytes(writer->map, key);
+}
+
+void __hms_fill(void *key, void *value, void *args) {
+    struct __hms_writer *writer = (struct __hms_writer *) args;
+    struct __hms_header *header = writer->header;
+    uint32_t             hash   = __hms_hash(writer->map, key);
+    uint32_t             i      = writer->cursor[hash & writer->mask]++;
+    uint32_t             len    = __hms_key_bytes(writer->map, key);
+    uint64_t             offset = header->bytes + writer->bytes;
+    __hms_section(writer->file, header, entries, struct __hashmap_entry)[i].hash = hash;
+    __hms_section(writer->file, header, vs, void *)[i]                          = value;
+    if (header->flags & HASHMAP_BINARY_KEYS) {
+        struct __hashmap_key *slot = &__hms_section(writer->file, header, keys, struct __hashmap_key)[i];
+        memcpy(slot, key, sizeof(struct __hashmap_key));
+        if (len > 0) {
+            memcpy(writer->file + offset, hashmap_key_data(key), len);
+            slot->ptr = (uint8_t *) (uintptr_t) (header->base + offset);
+        }
+    } else if (header->flags & HASHMAP_U64_KEYS) {
+        __hms_section(writer->file, header, keys, void *)[i] = key;
+    } else {
+        memcpy(writer->file + offset, key, len);
+        __hms_section(writer->file, header, keys, void *)[i] = (void *) (uintptr_t) (header->base + offset);
+    }
+    writer->bytes += len;
+}
+
+// Once filled, cursor[i] is where bucket i + 1 starts.
+void __hms_link(struct __hms_header *header, uint8_t *file, uint32_t *cursor) {
+    struct __hashmap_bucket *buckets = __hms_section(file, header, buckets, struct __hashmap_bucket);
+    struct __hashmap_entry  *entries = __hms_section(file, header, entries, struct __hashmap_entry);
+    for (uint32_t i = 0, start = 0; i < header->capacity; start = cursor[i++]) {
+        buckets[i].index = start < cursor[i] ? (int32_t) start + 1 : 0;
+        for (uint32_t j = start; j < cursor[i]; j++) {
+            entries[j].next = j + 1 < cursor[i] ? (int32_t) (j + 1) : -1;
+        }
+    }
+}
+
+// Sections follow the header in a fixed order, each aligned, so their offsets follow from the capacity and sizes.
+void __hms_layout(struct __hms_header *header) {
+    header->buckets = __HMS_BODY;
+    header->entries = __hms_align(header->buckets + (uint64_t) header->capacity * header->bucket_size);
+    header->vs      = __hms_align(header->entries + (uint64_t) header->capacity * header->entry_size);
+    header->keys    = __hms_align(header->vs + (uint64_t) header->capacity * header->pointer_size);
+    header->bytes   = __hms_align(header->keys + (uint64_t) header->capacity * header->key_size);
+}
+
+// Every offset is checked against the layout the writer computes, so no section can overlap another or run past the
+// file, whatever the header says.
+bool __hms_valid(struct __hms_header *header, uint64_t length) {
+    return_if(false, header->magic != __HMS_MAGIC || header->version != __HMS_VERSION);
+    return_if(false, header->header_checksum != __hms_checksum(header, offsetof(struct __hms_header, header_checksum)));
+    return_if(false, header->bucket_size != sizeof(struct __hashmap_bucket) || header->pointer_size != sizeof(void *) ||
+                         header->entry_size != sizeof(struct __hashmap_entry));
+    return_if(false, header->capacity < HASHMAP_MIN_SIZE || (header->capacity & (header->capacity - 1)) != 0);
+    uint32_t keys = HASHMAP_BINARY_KEYS | HASHMAP_U64_KEYS;
+    return_if(false, (header->flags & ~keys) != 0 || (header->flags & keys) == keys);
+    return_if(false, header->key_size != (header->flags & HASHMAP_BINARY_KEYS ? sizeof(struct __hashmap_key)
+                                                                               : sizeof(void *)));
+    struct __hms_header layout = *header;
+    __hms_layout(&layout);
+    return header->length == length && header->buckets == layout.buckets && header->entries == layout.entries &&
+           header->vs == layout.vs && header->keys == layout.keys && header->bytes == layout.bytes &&
+           header->bytes <= length && header->size <= header->capacity;
+}
+
+// Mapped somewhere else: key pointers move by the same distance as the file. Only the key pages become private.
+int __hms_relocate(struct __hms_header *header, uint8_t *file) {
+    return_if(0, header->flags & HASHMAP_U64_KEYS);  // Integer keys point nowhere.
+    uint64_t page  = (uint64_t) sysconf(_SC_PAGESIZE);
+    uint64_t start = header->keys & ~(page - 1);
+    uint64_t size  = header->keys + (uint64_t) header->capacity * header->key_size - start;
+    uint64_t delta = (uint64_t) (uintptr_t) file - header->base;
+    return_if(-1, mprotect(file + start, size, PROT_READ | PROT_WRITE) != 0);
+    for (uint32_t i = 0; i < header->size; i++) {
+        if (header->flags & HASHMAP_BINARY_KEYS) {
+            struct __hashmap_key *slot = &__hms_section(file, header, keys, struct __hashmap_key)[i];
+            if (slot->len > HASHMAP_INLINE_KEY) slot->ptr += delta;
+        } else {
+            __hms_section(file, header, keys, uint8_t *)[i] += delta;
+        }
+    }
+    return mprotect(file + start, size, PROT_READ);
+}
@@ -0,0 +1,457 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "hashmap.h"
+
+// Internals of hashmap.c.
+int __hm_finish_migration(hashmap_t *);
+int __hm_compare_keys(void *a, void *b);
+int __hm_free_views(hashmap_t *);
+
+// A view reads the arrays of the table it was taken of while the writer goes on changing them in place. Before the
+// writer first writes a page of an array after a snapshot, it copies the page for the views that may still read it,
+// an undo log kept a page at a time, so a snapshot costs nothing up front and a write only pays for the pages it
+// touches. A view reads a page from its copy when there is one and from the table otherwise, and looks for a copy
+// again after reading the table, as the writer puts the copy in place before it writes. A copy is freed with the last
+// view holding it. Whatever else the writer drops that views may still read, keys, skiplists and whole tables, is
+// retired to an epoch that every view holds open until it is released.
+#define __HMV_PAGE 4096
+// Arrays read by views, each split into pages of whole elements.
+enum { __HMV_BUCKETS, __HMV_ENTRIES, __HMV_VS, __HMV_KEYS, __HMV_ARRAYS };
+
+// Entry slots and key size as in hashmap.c.
+#define __hmv_slots(MAP)                                                                                        \
+    ((MAP)->__flags & HASHMAP_COMPACT ? (uint32_t) ((uint64_t) (MAP)->__capacity * (MAP)->__load / 100) \
+                                      : (MAP)->__capacity)
+#define __hmv_key_size(MAP) ((MAP)->__flags & HASHMAP_BINARY_KEYS ? sizeof(struct __hashmap_key) : sizeof(void *))
+#define __hmv_binary(FRAME) ((FRAME)->flags & HASHMAP_BINARY_KEYS)
+#define __hmv_u64(FRAME) ((FRAME)->flags & HASHMAP_U64_KEYS)
+#define __hmv_get(FRAME, ARRAY, I, TYPE)                \
+    ({                                                  \
+        TYPE __value;                                   \
+        __hmv_read((FRAME), (ARRAY), (I), &__value);    \
+        __value;                                        \
+    })
+#define __hmv_key_view(VIEW, KEY, LEN)           \
+    do {                                         \
+        (VIEW)->len = (LEN);                     \
+        if ((LEN) <= HASHMAP_INLINE_KEY)         \
+            memcpy((VIEW)->bytes, (KEY), (LEN)); \
+        else                                     \
+            (VIEW)->ptr = (uint8_t *) (KEY);     \
+    } while (0)
+// A bucket holds one more than its head entry, or one less than minus the entry holding its skiplist, as in hashmap.c.
+// Views are never taken halfway through an incremental resize, so no bucket is migrated.
+#define __hmv_skiplist(FRAME, INDEX) __hmv_get((FRAME), __HMV_VS, -(INDEX) - 1, skiplist_t *)
+#define __hmv_bucket(FRAME, HASH) \
+    __hmv_get((FRAME), __HMV_BUCKETS, (HASH) & ((FRAME)->layout.length[__HMV_BUCKETS] - 1), int32_t)
+
+// A saved page, shared by the views that lacked it when it was saved. Only the writer counts them.
+struct __hmv_copy {
+    size_t  refs;
+    uint8_t data[];
+};
+
+struct __hmv_layout {
+    uint8_t *base[__HMV_ARRAYS];
+    uint32_t length[__HMV_ARRAYS];    // In elements.
+    uint32_t size[__HMV_ARRAYS];      // Of an element.
+    uint32_t per_page[__HMV_ARRAYS];  // Elements in a page, so that none straddles two.
+    uint32_t first[__HMV_ARRAYS];     // Index of the array's first page among the pages of all arrays.
+    uint32_t pages;
+};
+
+// The table as it was at one snapshot. Only pages and copied change, and only the writer changes them.
+struct __hashmap_frame {
+    struct __hmv_layout     layout;
+    struct __hmv_copy     **pages;  // Per page: the copy saved before the writer wrote it, or NULL while it has not.
+    uint32_t                size, flags, table;
+    uint64_t                seed;
+    uint32_t                (*hash)(void *);
+    int                     (*equal)(void *, void *);
+    size_t                  copied;
+    bool                    released;
+    struct __epoch_record  *record;
+    struct __hashmap_cow   *cow;
+    struct __hashmap_frame *next;
+};
+
+struct __hashmap_cow {
+    epoch_t                 epoch;
+    struct __hmv_layout     layout;      // Of the map's table.
+    uint32_t               *saved;       // Per page of the table: the snapshot it was last copied for.
+    uint32_t                generation;  // Of the newest snapshot.
+    uint32_t                table;       // Moves on every time the map moves to a new table.
+    uint32_t                frontier;    // Entries from here on are in no view of the table.
+    bool                    shared;      // Whether any view reads the table.
+    struct __hashmap_frame *frames;      // Newest first.
+    uint32_t                released;    // Views released, counted before they are marked so.
+    uint32_t                reaped;      // Views freed since.
+};
+
+int      __hmv_init(hashmap_t *map);
+void     __hmv_layout(hashmap_t *map, struct __hmv_layout *layout);
+void     __hmv_reap(hashmap_t *map);
+void     __hmv_free_frame(struct __hashmap_frame *frame);
+bool     __hmv_settle(hashmap_t *map);
+void     __hmv_read(struct __hashmap_frame *frame, uint32_t array, uint32_t i, void *value);
+uint32_t __hmv_hash(struct __hashmap_frame *frame, void *key);
+bool     __hmv_equal(struct __hashmap_frame *frame, int32_t i, void *key);
+bool     __hmv_find(struct __hashmap_frame *frame, void *key, uint32_t hash, void **value);
+void     __hmv_reclaim_table(void *ctx, void *map);
+
+// Takes a read-only view of the map as it is now, which stays the same whatever the map goes through until it is
+// released, and may be read on other threads while the writer goes on. Taking it copies nothing: the writer copies a
+// page of the table the first time it writes it after the snapshot, and a skiplist bucket the first time it changes
+// it. While views are live the table never grows in place, and an incremental resize is done in one go. The engines,
+// maps under epoch reclamation and maps opened from a file have no views. The map must outlive its views.
+//
+// A view compares keys with the map's equal and hands out the stored key and value pointers, so keys and values the
+// map no longer holds, removed, replaced or evicted, must outlive every view taken before they went. The map frees its
+// own copies of binary keys, the skiplists and the old tables only once the oldest view that was live when they went
+// is released: a view held for long keeps all of them, from after it was taken as well. Page copies are not held
+// that way; each goes with the last view it was made for.
+int hashmap_snapshot(hashmap_t *map, hashmap_view_t *view) {
+    return_if(-1, map->__swisstable || map->__robinhood || map->__epoch || (map->__flags & HASHMAP_SNAPSHOT));
+    return_if(-1, __hm_finish_migration(map) != 0);
+    if (map->__cow) __hmv_reap(map);
+    return_if(-1, map->__cow == NULL && __hmv_init(map) != 0);
+    struct __hashmap_cow   *cow    = map->__cow;
+    struct __hashmap_frame *frame  = (struct __hashmap_frame *) calloc(1, sizeof(struct __hashmap_frame));
+    struct __hmv_copy     **pages  = frame ? (struct __hmv_copy **) calloc(cow->layout.pages, sizeof(void *)) : NULL;
+    struct __epoch_record  *record = pages ? epoch_register(&cow->epoch) : NULL;
+    if (record == NULL) {
+        free(pages);
+        free(frame);
+        __hmv_reap(map);
+        return -1;
+    }
+    // Anything the writer retires from now on waits for the view.
+    epoch_enter(record);
+    frame->layout  = cow->layout;
+    frame->pages   = pages;
+    frame->size    = map->__size;
+    frame->flags   = map->__flags;
+    frame->table   = cow->table;
+    frame->seed    = map->__seed;
+    frame->hash    = map->__hash;
+    frame->equal   = map->__equal;
+    frame->record  = record;
+    frame->cow     = cow;
+    frame->next    = cow->frames;
+    cow->frames    = frame;
+    cow->frontier  = map->__current;
+    cow->shared    = true;
+    view->__frame  = frame;
+    cow->generation++;
+    return 0;
+}
+
+// Gives the view up, on any thread. Whatever the writer kept for it is freed on a later write or snapshot.
+int hashmap_view_release(hashmap_view_t *view) {
+    struct __hashmap_frame *frame = view->__frame;
+    return_if_null(0, frame);
+    view->__frame = NULL;
+    epoch_exit(frame->record);
+    epoch_unregister(frame->record);
+    // The count tells the writer to look, and the state outlives the views until it sees them all marked. From then on
+    // the frame is the writer's to free.
+    __atomic_fetch_add(&frame->cow->released, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&frame->released, true, __ATOMIC_RELEASE);
+    return 0;
+}
+
+uint32_t hashmap_view_size(hashmap_view_t *view) {
+    return view->__frame ? view->__frame->size : 0;
+}
+
+bool hashmap_view_exists(hashmap_view_t *view, void *key) {
+    struct __hashmap_frame *frame = view->__frame;
+    void                   *value;
+    return_if(false, frame == NULL);
+    if (__hmv_binary(frame)) {
+        struct __hashmap_key bytes;
+        uint32_t             len = (uint32_t) strlen((char *) key);
+        __hmv_key_view(&bytes, key, len);
+        return __hmv_find(frame, &bytes, (uint32_t) wyhash(key, len, frame->seed), &value);
+    }
+    return __hmv_find(frame, key, __hmv_hash(frame, key), &value);
+}
+
+void *hashmap_view_get(hashmap_view_t *view, void *key, void *default_value) {
+    struct __hashmap_frame *frame = view->__frame;
+    void                   *value = default_value;
+    return_if(default_value, frame == NULL);
+    return_if(hashmap_view_get_bytes(view, key, strlen((char *) key), default_value), __hmv_binary(frame));
+    __hmv_find(frame, key, __hmv_hash(frame, key), &value);
+    return value;
+}
+
+void *hashmap_view_get_bytes(hashmap_view_t *view, const void *key, uint32_t len, void *default_value) {
+    struct __hashmap_frame *frame = view->__frame;
+    void                   *value = default_value;
+    return_if(default_value, frame == NULL || !__hmv_binary(frame));
+    struct __hashmap_key bytes;
+    __hmv_key_view(&bytes, key, len);
+    __hmv_find(frame, &bytes, (uint32_t) wyhash(key, len, frame->seed), &value);
+    return value;
+}
+
+void *hashmap_view_get_u64(hashmap_view_t *view, uint64_t key, void *default_value) {
+    struct __hashmap_frame *frame = view->__frame;
+    void                   *value = default_value;
+    return_if(default_value, frame == NULL || !__hmv_u64(frame));
+    __hmv_find(frame, (void *) (uintptr_t) key, __hmv_hash(frame, (void *) (uintptr_t) key), &value);
+    return value;
+}
+
+// Walks the view bucket by bucket. A binary key in a chain is passed as a copy that only lasts for the call.
+void hashmap_view_foreach(hashmap_view_t *view, void (*predicate)(void *, void *, void *), void *args) {
+    struct __hashmap_frame *frame = view->__frame;
+    for (uint32_t b = 0; frame && b < frame->layout.length[__HMV_BUCKETS]; b++) {
+        int32_t index = __hmv_get(frame, __HMV_BUCKETS, b, int32_t);
+        if (index < 0) {
+            skiplist_foreach(__hmv_skiplist(frame, index), predicate, args);
+            continue;
+        }
+        for (int32_t i = index - 1; i >= 0; i = __hmv_get(frame, __HMV_ENTRIES, i, struct __hashmap_entry).next) {
+            void *value = __hmv_get(frame, __HMV_VS, i, void *);
+            if (__hmv_binary(frame)) {
+                struct __hashmap_key key = __hmv_get(frame, __HMV_KEYS, i, struct __hashmap_key);
+                predicate(&key, value, args);
+            } else {
+                predicate(__hmv_get(frame, __HMV_KEYS, i, void *), value, args);
+            }
+        }
+    }
+}
+
+// Bytes the writer has copied so far to keep the view as it was: its write amplification. A page copied for several
+// views counts for each.
+size_t hashmap_view_copied(hashmap_view_t *view) {
+    return view->__frame ? __atomic_load_n(&view->__frame->copied, __ATOMIC_RELAXED) : 0;
+}
+
+// Called by the writer before it writes slot, in any of the arrays views read. On failure the page is left unsaved,
+// and the write must not happen.
+int __hm_cow_save(hashmap_t *map, void *slot) {
+    struct __hashmap_cow *cow    = map->__cow;
+    struct __hmv_layout  *layout = &cow->layout;
+    uint32_t              array  = 0;
+    // Views of older tables read nothing in this one.
+    return_if(0, !__hmv_settle(map) || !cow->shared);
+    for (; array < __HMV_ARRAYS; array++) {
+        uint8_t *base = layout->base[array];
+        if ((uint8_t *) slot >= base && (uint8_t *) slot < base + (size_t) layout->length[array] * layout->size[array])
+            break;
+    }
+    return_if(0, array == __HMV_ARRAYS);
+    uint32_t i    = (uint32_t) (((uint8_t *) slot - layout->base[array]) / layout->size[array]);
+    uint32_t page = layout->first[array] + i / layout->per_page[array];
+    // Entries past the last one in use at the newest snapshot were never in any view.
+    return_if(0, (array != __HMV_BUCKETS && i >= cow->frontier) || cow->saved[page] == cow->generation);
+    uint32_t start = i - i % layout->per_page[array];
+    uint32_t count = layout->length[array] - start;
+    if (count > layout->per_page[array]) count = layout->per_page[array];
+    size_t             bytes = (size_t) count * layout->size[array];
+    struct __hmv_copy *copy  = (struct __hmv_copy *) malloc(sizeof(struct __hmv_copy) + bytes);
+    return_if_null(-1, copy);
+    memcpy(copy->data, layout->base[array] + (size_t) start * layout->size[array], bytes);
+    copy->refs = 0;
+    for (struct __hashmap_frame *frame = cow->frames; frame; frame = frame->next) {
+        if (frame->table != cow->table || frame->pages[page] || __atomic_load_n(&frame->released, __ATOMIC_ACQUIRE))
+            continue;
+        __atomic_store_n(&frame->pages[page], copy, __ATOMIC_RELEASE);
+        __atomic_fetch_add(&frame->copied, bytes, __ATOMIC_RELAXED);
+        copy->refs++;
+    }
+    if (copy->refs == 0) free(copy);
+    cow->saved[page] = cow->generation;
+    // The copy is in place before the page changes.
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return 0;
+}
+
+// Tells whether a view may read what the value slot holds, which it may if it was there at the newest snapshot of the
+// table. The writer changes a skiplist only after it made sure no view can walk it.
+bool __hm_cow_shared(hashmap_t *map, void **slot) {
+    struct __hashmap_cow   *cow    = map->__cow;
+    struct __hmv_layout    *layout = &cow->layout;
+    return_if(false, !__hmv_settle(map) || !cow->shared);
+    struct __hashmap_frame *newest = cow->frames;
+    return_if(false, newest->table != cow->table);
+    uint32_t i = (uint32_t) (slot - (void **) layout->base[__HMV_VS]);
+    return_if(false, i >= cow->frontier);
+    struct __hmv_copy *copy = newest->pages[layout->first[__HMV_VS] + i / layout->per_page[__HMV_VS]];
+    return copy == NULL || ((void **) copy->data)[i % layout->per_page[__HMV_VS]] == *slot;
+}
+
+// Frees what views may still read once they are gone, and right away when no view reads the table. Retired things go
+// in order, as a table goes with the pool that older ones came from.
+int __hm_cow_retire(hashmap_t *map, void (*reclaim)(void *, void *), void *ctx, void *ptr) {
+    if (!map->__cow->shared && epoch_pending(&map->__cow->epoch) == 0) {
+        reclaim(ctx, ptr);
+        return 0;
+    }
+    return epoch_retire(&map->__cow->epoch, reclaim, ctx, ptr);
+}
+
+// The map moves into newmap's table, and its old table is left to the views, which never see the new one. On failure
+// newmap is freed and the map left as it was.
+int __hm_cow_replace(hashmap_t *map, hashmap_t *newmap) {
+    struct __hashmap_cow *cow = map->__cow;
+    struct __hmv_layout   layout;
+    hashmap_t            *old = (hashmap_t *) malloc(sizeof(hashmap_t));
+    __hmv_layout(newmap, &layout);
+    uint32_t *saved = old ? (uint32_t *) calloc(layout.pages, sizeof(uint32_t)) : NULL;
+    if (saved == NULL || (memcpy(old, map, sizeof(hashmap_t)), old->__cow = NULL,
+                          __hm_cow_retire(map, __hmv_reclaim_table, NULL, old) != 0)) {
+        free(saved);
+        free(old);
+        hashmap_free(newmap);
+        return -1;
+    }
+    memcpy(map, newmap, sizeof(hashmap_t));
+    map->__cow    = cow;
+    cow->layout   = layout;
+    free(cow->saved);
+    cow->saved    = saved;
+    cow->table++;
+    cow->frontier = 0;
+    cow->shared   = false;
+    return 0;
+}
+
+// Everything views still held goes with them. The map is being freed, so there must be none.
+int __hm_free_views(hashmap_t *map) {
+    struct __hashmap_cow *cow = map->__cow;
+    return_if_null(0, cow);
+    map->__cow = NULL;
+    epoch_free(&cow->epoch);
+    for (struct __hashmap_frame *frame = cow->frames, *next; frame; frame = next) {
+        next = frame->next;
+        __hmv_free_frame(frame);
+    }
+    free(cow->saved);
+    free(cow);
+    return 0;
+}
+
+int __hmv_init(hashmap_t *map) {
+    struct __hashmap_cow *cow;
+    return_if(-1, posix_memalign((void **) &cow, _Alignof(struct __hashmap_cow), sizeof(struct __hashmap_cow)) != 0);
+    memset(cow, 0, sizeof(struct __hashmap_cow));
+    __hmv_layout(map, &cow->layout);
+    cow->saved = (uint32_t *) calloc(cow->layout.pages, sizeof(uint32_t));
+    return_if((free(cow), -1), cow->saved == NULL);
+    epoch_init(&cow->epoch);
+    map->__cow = cow;
+    return 0;
+}
+
+void __hmv_layout(hashmap_t *map, struct __hmv_layout *layout) {
+    bool     binary = map->__flags & HASHMAP_BINARY_KEYS;
+    void    *base[] = {map->__buckets, map->__entries, map->__vs, binary ? (void *) map->__keys : (void *) map->__ks};
+    uint32_t size[] = {sizeof(struct __hashmap_bucket), sizeof(struct __hashmap_entry), sizeof(void *),
+                       __hmv_key_size(map)};
+    layout->pages   = 0;
+    for (uint32_t a = 0; a < __HMV_ARRAYS; a++) {
+        layout->base[a]     = (uint8_t *) base[a];
+        layout->length[a]   = a == __HMV_BUCKETS ? map->__capacity : __hmv_slots(map);
+        layout->size[a]     = size[a];
+        layout->per_page[a] = __HMV_PAGE / size[a];
+        layout->first[a]    = layout->pages;
+        layout->pages += (layout->length[a] + layout->per_page[a] - 1) / layout->per_page[a];
+    }
+}
+
+// Frees the views released since the last time, then the state kept for views if none is left.
+void __hmv_reap(hashmap_t *map) {
+    struct __hashmap_cow *cow    = map->__cow;
+    bool                  shared = false;
+    for (struct __hashmap_frame **at = &cow->frames, *frame; (frame = *at);) {
+        if (!__atomic_load_n(&frame->released, __ATOMIC_ACQUIRE)) {
+            shared |= frame->table == cow->table;
+            at = &frame->next;
+            continue;
+        }
+        *at = frame->next;
+        __hmv_free_frame(frame);
+        cow->reaped++;
+    }
+    cow->shared = shared;
+    epoch_collect(&cow->epoch);
+    if (cow->frames == NULL) __hm_free_views(map);
+}
+
+// Frees a released view, with the page copies no other view holds.
+void __hmv_free_frame(struct __hashmap_frame *frame) {
+    for (uint32_t page = 0; page < frame->layout.pages; page++) {
+        struct __hmv_copy *copy = frame->pages[page];
+        if (copy && --copy->refs == 0) free(copy);
+    }
+    free(frame->pages);
+    free(frame);
+}
+
+// Reaps views released since the last time, if any. Tells whether views are left.
+bool __hmv_settle(hashmap_t *map) {
+    if (__atomic_load_n(&map->__cow->released, __ATOMIC_ACQUIRE) != map->__cow->reaped) __hmv_reap(map);
+    return map->__cow != NULL;
+}
+
+// Reads element i of an array as the view sees it. A page the writer saves while it is being read from the table may
+// have been read halfway through a write, so its copy is looked for again and read instead.
+void __hmv_read(struct __hashmap_frame *frame, uint32_t array, uint32_t i, void *value) {
+    struct __hmv_layout *layout = &frame->layout;
+    uint32_t             size   = layout->size[array], page = layout->first[array] + i / layout->per_page[array];
+    struct __hmv_copy   *copy   = __atomic_load_n(&frame->pages[page], __ATOMIC_ACQUIRE);
+    if (copy == NULL) {
+        memcpy(value, layout->base[array] + (size_t) i * size, size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        copy = __atomic_load_n(&frame->pages[page], __ATOMIC_RELAXED);
+        if (copy == NULL) return;
+    }
+    memcpy(value, copy->data + (size_t) (i % layout->per_page[array]) * size, size);
+}
+
+uint32_t __hmv_hash(struct __hashmap_frame *frame, void *key) {
+    return_if((uint32_t) wyhash_u64((uintptr_t) key, frame->seed), __hmv_u64(frame));
+    return frame->hash ? frame->hash(key) : (uint32_t) wyhash_str(key, frame->seed);
+}
+
+bool __hmv_equal(struct __hashmap_frame *frame, int32_t i, void *key) {
+    if (__hmv_binary(frame)) {
+        struct __hashmap_key stored = __hmv_get(frame, __HMV_KEYS, i, struct __hashmap_key);
+        return __hm_compare_keys(&stored, key) == 0;
+    }
+    void *stored = __hmv_get(frame, __HMV_KEYS, i, void *);
+    return __hmv_u64(frame) ? stored == key : frame->equal(stored, key) == 0;
+}
+
+// A lookup as the map does it, on the view. Skiplists are walked as they are: the writer never changes one a view
+// can reach.
+bool __hmv_find(struct __hashmap_frame *frame, void *key, uint32_t hash, void **value) {
+    int32_t index = __hmv_bucket(frame, hash);
+    if (index < 0) {
+        skiplist_t *skiplist = __hmv_skiplist(frame, index);
+        return_if(false, !skiplist_exists(skiplist, key, hash));
+        *value = skiplist_get(skiplist, key, hash, *value);
+        return true;
+    }
+    for (int32_t i = index - 1; i >= 0;) {
+        struct __hashmap_entry entry = __hmv_get(frame, __HMV_ENTRIES, i, struct __hashmap_entry);
+        if (entry.hash == hash && __hmv_equal(frame, i, key)) {
+            *value = __hmv_get(frame, __HMV_VS, i, void *);
+            return true;
+        }
+        i = entry.next;
+    }
+    return false;
+}
+
+void __hmv_reclaim_table(void *ctx, void *map) {
+    hashmap_free((hashmap_t *) map);
+    free(map);
+}
@@ -1,13 +1,55 @@
+// mremap is a GNU extension.
+#define _GNU_SOURCE
+
 #include "mpalloc.h"
 
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 
 #include "log.h"
 
 #define __MP_BLOCK_DATA_SIZE (PAGE_SIZE - sizeof(struct __mp_block))
 
 #define __mp_align_of(SIZE) (((SIZE) + (typeof(SIZE)) 0xF) & (~(typeof(SIZE)) 0xF))
+// Every block starts on a page, so the block owning a pointer is found from its address alone.
+#define __mp_block_of(PTR) ((struct __mp_block *) ((uintptr_t) (PTR) & ~(uintptr_t) (PAGE_SIZE - 1)))
+
+// Mapped regions are whole huge pages; the low bit of their length says they come from the hugetlb reserve.
+#define __MP_HUGE_PAGE ((size_t) 2 << 20)
+#define __MP_HUGETLB 1u
+#define __mp_map_length(SIZE) (((SIZE) + __MP_HUGE_PAGE - 1) & ~(__MP_HUGE_PAGE - 1))
+
+// Objects a thread cache holds per size class, and moves to or from the shared pool at once.
+#define __MP_MAGAZINE 64
+#define __MP_REFILL (__MP_MAGAZINE / 2)
+
+struct __mp_cache {
+    memory_pool_t     *pool;
+    struct __mp_cache *next;
+    uint32_t           count[__MP_SIZE_CLASSES];
+    void              *objects[__MP_SIZE_CLASSES][__MP_MAGAZINE];
+};
+
+uint32_t           __mp_class_of(size_t size);
+size_t             __mp_class_size(uint32_t sizeclass);
+struct __mp_block *__mp_new_page(memory_pool_t *pool, uint32_t sizeclass);
+void              *__mp_alloc_small(memory_pool_t *pool, uint32_t sizeclass);
+void               __mp_free_small(memory_pool_t *pool, void *ptr, uint32_t sizeclass);
+void              *__mp_alloc_large(memory_pool_t *pool, size_t size);
+void               __mp_free_large(memory_pool_t *pool, struct __mp_block *large);
+struct __mp_cache *__mp_cache_for(memory_pool_t *pool);
+void              *__mp_cache_alloc(memory_pool_t *pool, uint32_t sizeclass);
+void               __mp_cache_free(memory_pool_t *pool, void *ptr, uint32_t sizeclass);
+void               __mp_cache_flush(struct __mp_cache *cache);
+void               __mp_cache_release(void *cache);
+struct __mp_block *__mp_map(size_t size);
+void               __mp_unmap(struct __mp_block *block);
+void               __mp_link_mapped(memory_pool_t *pool, struct __mp_block *block);
+void               __mp_unlink_mapped(memory_pool_t *pool, struct __mp_block *block);
 
 #ifdef DEBUG
 
@@ -24,10 +66,24 @@
         free(PTR);                          \
     } while (0)
 
+#define __mp_page_alloc(SIZE)                                                    \
+    ({                                                                           \
+        void *__ptr = NULL;                                                      \
+        if (posix_memalign(&__ptr, PAGE_SIZE, (SIZE)) != 0) __ptr = NULL;        \
+        INFO("Memory pool alloc %d bytes on a page at %p", (int) (SIZE), __ptr); \
+        __ptr;                                                                   \
+    })
+
 #else
 
 #define __mp_default_alloc(SIZE) malloc(SIZE)
 #define __mp_default_free(PTR) free(PTR);
+#define __mp_page_alloc(SIZE)                                             \
+    ({                                                                    \
+        void *__ptr = NULL;                                               \
+        if (posix_memalign(&__ptr, PAGE_SIZE, (SIZE)) != 0) __ptr = NULL; \
+        __ptr;                                                            \
+    })
 
 #endif
 
@@ -41,66 +97,126 @@
     } while (0)
 
 int memory_pool_init(memory_pool_t *pool, size_t max_tries) {
-    pool->__max_tries = max_tries;
-    pool->__small     = NULL;
-    pool->__large     = NULL;
+    pool->__max_tries   = max_tries;
+    pool->__small       = NULL;
+    pool->__large       = NULL;
+    pool->__spare       = NULL;
+    pool->__reclaimable = 0;
+    pool->__shared      = false;
+    pool->__caches      = NULL;
+    pool->__mapped      = NULL;
+    for (uint32_t i = 0; i < __MP_SIZE_CLASSES; i++) {
+        pool->__current[i] = NULL;
+        pool->__free[i]    = NULL;
+    }
+    return 0;
+}
+
+int memory_pool_init_shared(memory_pool_t *pool, size_t max_tries) {
+    memory_pool_init(pool, max_tries);
+    if (pthread_mutex_init(&pool->__lock, NULL) != 0) return -1;
+    // A thread's cache goes back to the pool when the thread exits.
+    if (pthread_key_create(&pool->__key, __mp_cache_release) != 0) {
+        pthread_mutex_destroy(&pool->__lock);
+        return -1;
+    }
+    pool->__shared = true;
     return 0;
 }
 
 int memory_pool_free(memory_pool_t *pool) {
     if (pool) {
+        if (pool->__shared) {
+            // Threads still alive drop their caches here: their objects live in pages freed below.
+            pthread_key_delete(pool->__key);
+            pthread_mutex_destroy(&pool->__lock);
+            for (struct __mp_cache *cache = pool->__caches, *next; cache; cache = next) {
+                next = cache->next;
+                free(cache);
+            }
+            pool->__caches = NULL;
+            pool->__shared = false;
+        }
         __mp_free_blocks(pool->__large);
         __mp_free_blocks(pool->__small);
+        __mp_free_blocks(pool->__spare);
+        for (struct __mp_block *mapped = pool->__mapped, *next; mapped; mapped = next) {
+            next = mapped->next;
+            __mp_unmap(mapped);
+        }
+        pool->__mapped = NULL;
     }
     return 0;
 }
 
 int memory_pool_clear(memory_pool_t *pool) {
     if (pool) {
+        // No other thread may be using a shared pool while it is cleared.
+        for (struct __mp_cache *cache = pool->__caches; cache; cache = cache->next) {
+            memset(cache->count, 0, sizeof(cache->count));
+        }
         __mp_free_blocks(pool->__large);
-        for (struct __mp_block *small = pool->__small; small; small = small->next) {
-            small->used = 0;
+        pool->__large = NULL;
+        for (struct __mp_block *mapped = pool->__mapped, *next; mapped; mapped = next) {
+            next = mapped->next;
+            __mp_unmap(mapped);
         }
+        pool->__mapped = NULL;
+        // Emptied pages go back to the spare list, where any size class may take them.
+        while (pool->__small) {
+            struct __mp_block *small = pool->__small;
+            pool->__small            = small->next;
+            small->next              = pool->__spare;
+            pool->__spare            = small;
+        }
+        for (uint32_t i = 0; i < __MP_SIZE_CLASSES; i++) {
+            pool->__current[i] = NULL;
+            pool->__free[i]    = NULL;
+        }
+        pool->__reclaimable = 0;
     }
     return 0;
 }
 
 int memory_pool_destroy(memory_pool_t *pool) {
     if (pool) {
-        __mp_free_blocks(pool->__large);
-        __mp_free_blocks(pool->__small);
-        pool->__max_tries = 0;
-        pool->__small     = NULL;
-        pool->__large     = NULL;
+        memory_pool_free(pool);
+        memory_pool_init(pool, 0);
     }
     return 0;
 }
 
+size_t memory_pool_reclaimable(memory_pool_t *pool) {
+    return pool ? __atomic_load_n(&pool->__reclaimable, __ATOMIC_RELAXED) : 0;
+}
+
+size_t memory_pool_size(memory_pool_t *pool) {
+    size_t size = 0;
+    if (pool == NULL) return 0;
+    if (pool->__shared) pthread_mutex_lock(&pool->__lock);
+    for (struct __mp_block *block = pool->__small; block; block = block->next) size += PAGE_SIZE;
+    for (struct __mp_block *block = pool->__spare; block; block = block->next) size += PAGE_SIZE;
+    for (struct __mp_block *block = pool->__large; block; block = block->next) {
+        size += sizeof(struct __mp_block) + block->size;
+    }
+    for (struct __mp_block *block = pool->__mapped; block; block = block->next) size += block->used & ~__MP_HUGETLB;
+    if (pool->__shared) pthread_mutex_unlock(&pool->__lock);
+    return size;
+}
+
 void *mpalloc(memory_pool_t *pool, size_t size) {
     void *ptr = NULL;
     if (pool) {
         size_t aligned_size = __mp_align_of(size);
-        if (aligned_size <= __MP_BLOCK_DATA_SIZE) {
-            struct __mp_block *small = pool->__small;
-            for (size_t i = 0; small && i < pool->__max_tries; i++, small = small->next) {
-                if (small->used + aligned_size <= __MP_BLOCK_DATA_SIZE) {
-                    ptr = small->data + small->used;
-                    small->used += aligned_size;
-                    return ptr;
-                }
-            }
-            small = (struct __mp_block *) __mp_default_alloc(PAGE_SIZE);
-            if (small == NULL) return NULL;
-            small->used   = aligned_size;
-            small->next   = pool->__small;
-            pool->__small = small;
-            ptr           = small->data;
+        if (aligned_size <= __MP_SMALL_MAX) {
+            uint32_t sizeclass = __mp_class_of(aligned_size);
+            ptr = pool->__shared ? __mp_cache_alloc(pool, sizeclass) : __mp_alloc_small(pool, sizeclass);
+        } else if (pool->__shared) {
+            pthread_mutex_lock(&pool->__lock);
+            ptr = __mp_alloc_large(pool, size);
+            pthread_mutex_unlock(&pool->__lock);
         } else {
-            struct __mp_block *large = (struct __mp_block *) __mp_default_alloc(sizeof(struct __mp_block) + size);
-            if (large == NULL) return NULL;
-            large->next   = pool->__large;
-            pool->__large = large;
-            ptr           = large->data;
+            ptr = __mp_alloc_large(pool, size);
         }
     } else {
         ptr = __mp_default_alloc(size);
@@ -110,20 +226,275 @@ void *mpalloc(memory_pool_t *pool, size_t size) {
 
 void mpfree(memory_pool_t *pool, void *ptr) {
     if (pool) {
-        struct __mp_block *prev = NULL, *curr = pool->__large;
-        while (curr) {
-            if (curr->data == ptr) {
-                if (prev)
-                    prev->next = curr->next;
-                else
-                    pool->__large = curr->next;
-                __mp_default_free(curr);
-                break;
-            }
-            prev = curr;
-            curr = curr->next;
+        if (ptr == NULL) return;
+        struct __mp_block *block = __mp_block_of(ptr);
+        if (block->size <= __MP_SMALL_MAX) {
+            uint32_t sizeclass = __mp_class_of(block->size);
+            if (pool->__shared)
+                __mp_cache_free(pool, ptr, sizeclass);
+            else
+                __mp_free_small(pool, ptr, sizeclass);
+        } else if (pool->__shared) {
+            pthread_mutex_lock(&pool->__lock);
+            __mp_free_large(pool, block);
+            pthread_mutex_unlock(&pool->__lock);
+        } else {
+            __mp_free_large(pool, block);
         }
     } else {
         __mp_default_free(ptr);
     }
 }
+
+void *mpmap(memory_pool_t *pool, size_t size) {
+    // Below a huge page there is no TLB reach to gain, and the pool serves the request.
+    if (size < MP_MAP_THRESHOLD) return mpalloc(pool, size);
+    struct __mp_block *block = __mp_map(sizeof(struct __mp_block) + size);
+    if (block == NULL) return NULL;
+    block->size = size;
+    __mp_link_mapped(pool, block);
+    return block->data;
+}
+
+void *mpremap(memory_pool_t *pool, void *ptr, size_t old_size, size_t size) {
+    struct __mp_block *block = __mp_block_of(ptr);
+    if (old_size >= MP_MAP_THRESHOLD && size >= MP_MAP_THRESHOLD && !(block->used & __MP_HUGETLB)) {
+        // The kernel moves the page tables, not the data; the region keeps its huge page advice.
+        size_t length = __mp_map_length(sizeof(struct __mp_block) + size);
+        __mp_unlink_mapped(pool, block);
+        void *moved = mremap(block, block->used, length, MREMAP_MAYMOVE);
+        if (moved != MAP_FAILED) {
+            block       = (struct __mp_block *) moved;
+            block->used = length;
+            block->size = size;
+        }
+        __mp_link_mapped(pool, block);
+        return moved == MAP_FAILED ? NULL : block->data;
+    }
+    void *copy = mpmap(pool, size);
+    if (copy == NULL) return NULL;
+    memcpy(copy, ptr, old_size < size ? old_size : size);
+    mpunmap(pool, ptr, old_size);
+    return copy;
+}
+
+void mpunmap(memory_pool_t *pool, void *ptr, size_t size) {
+    if (size < MP_MAP_THRESHOLD) {
+        mpfree(pool, ptr);
+        return;
+    }
+    if (ptr == NULL) return;
+    struct __mp_block *block = __mp_block_of(ptr);
+    __mp_unlink_mapped(pool, block);
+    __mp_unmap(block);
+}
+
+// Gives back the pages of a region from mpmap past its first size bytes, a huge page at a time, so that a large region
+// can be let go in slices. It is still released with mpunmap and the size it was mapped with.
+void mpshrink(memory_pool_t *pool, void *ptr, size_t old_size, size_t size) {
+    if (old_size < MP_MAP_THRESHOLD) return;
+    struct __mp_block *block  = __mp_block_of(ptr);
+    size_t             used   = block->used & ~(size_t) __MP_HUGETLB;
+    size_t             length = __mp_map_length(sizeof(struct __mp_block) + size);
+    if (length >= used) return;
+    munmap((uint8_t *) block + length, used - length);
+    if (pool && pool->__shared) pthread_mutex_lock(&pool->__lock);
+    block->used = length | (block->used & __MP_HUGETLB);
+    if (pool && pool->__shared) pthread_mutex_unlock(&pool->__lock);
+}
+
+uint32_t __mp_class_of(size_t size) {
+    // 16-byte steps up to 128, then four classes per power of two, so rounding wastes at most a fifth.
+    if (size <= 128) return size ? (uint32_t) ((size - 1) >> 4) : 0;
+    uint32_t shift = 63 - __builtin_clzll(size - 1);
+    return 8 + ((shift - 7) << 2) + (uint32_t) (((size - 1) - ((size_t) 1 << shift)) >> (shift - 2));
+}
+
+size_t __mp_class_size(uint32_t sizeclass) {
+    if (sizeclass < 8) return (size_t) (sizeclass + 1) << 4;
+    uint32_t shift = 7 + ((sizeclass - 8) >> 2);
+    return ((size_t) 1 << shift) + ((size_t) (((sizeclass - 8) & 3) + 1) << (shift - 2));
+}
+
+struct __mp_block *__mp_new_page(memory_pool_t *pool, uint32_t sizeclass) {
+    struct __mp_block *small = pool->__spare;
+    if (small)
+        pool->__spare = small->next;
+    else if ((small = (struct __mp_block *) __mp_page_alloc(PAGE_SIZE)) == NULL)
+        return NULL;
+    // The rest of the class's previous page is dropped: it is smaller than one object.
+    small->size                = __mp_class_size(sizeclass);
+    small->used                = 0;
+    small->prev                = NULL;
+    small->next                = pool->__small;
+    pool->__small              = small;
+    pool->__current[sizeclass] = small;
+    return small;
+}
+
+void *__mp_alloc_small(memory_pool_t *pool, uint32_t sizeclass) {
+    // A freed object of the same class first, then the class's current page, then a fresh page.
+    void *ptr = pool->__free[sizeclass];
+    if (ptr) {
+        pool->__free[sizeclass] = *(void **) ptr;
+        __atomic_store_n(&pool->__reclaimable, pool->__reclaimable - __mp_class_size(sizeclass), __ATOMIC_RELAXED);
+        return ptr;
+    }
+    struct __mp_block *small = pool->__current[sizeclass];
+    if (small == NULL || small->used + small->size > __MP_BLOCK_DATA_SIZE) {
+        small = __mp_new_page(pool, sizeclass);
+        if (small == NULL) return NULL;
+    }
+    ptr = small->data + small->used;
+    small->used += small->size;
+    return ptr;
+}
+
+void __mp_free_small(memory_pool_t *pool, void *ptr, uint32_t sizeclass) {
+    // Small objects go onto their class's free list, linked through their first word.
+    *(void **) ptr          = pool->__free[sizeclass];
+    pool->__free[sizeclass] = ptr;
+    __atomic_store_n(&pool->__reclaimable, pool->__reclaimable + __mp_class_size(sizeclass), __ATOMIC_RELAXED);
+}
+
+void *__mp_alloc_large(memory_pool_t *pool, size_t size) {
+    struct __mp_block *large = (struct __mp_block *) __mp_page_alloc(sizeof(struct __mp_block) + size);
+    if (large == NULL) return NULL;
+    large->size = size;
+    large->prev = NULL;
+    large->next = pool->__large;
+    if (pool->__large) pool->__large->prev = large;
+    pool->__large = large;
+    return large->data;
+}
+
+void __mp_free_large(memory_pool_t *pool, struct __mp_block *large) {
+    if (large->prev)
+        large->prev->next = large->next;
+    else
+        pool->__large = large->next;
+    if (large->next) large->next->prev = large->prev;
+    __mp_default_free(large);
+}
+
+struct __mp_cache *__mp_cache_for(memory_pool_t *pool) {
+    struct __mp_cache *cache = (struct __mp_cache *) pthread_getspecific(pool->__key);
+    if (cache) return cache;
+    cache = (struct __mp_cache *) calloc(1, sizeof(struct __mp_cache));
+    if (cache == NULL) return NULL;
+    cache->pool = pool;
+    pthread_mutex_lock(&pool->__lock);
+    cache->next    = pool->__caches;
+    pool->__caches = cache;
+    pthread_mutex_unlock(&pool->__lock);
+    pthread_setspecific(pool->__key, cache);
+    return cache;
+}
+
+void *__mp_cache_alloc(memory_pool_t *pool, uint32_t sizeclass) {
+    struct __mp_cache *cache = __mp_cache_for(pool);
+    if (cache == NULL) return NULL;
+    if (cache->count[sizeclass] == 0) {
+        // An empty magazine is refilled with half a magazine under a single lock.
+        pthread_mutex_lock(&pool->__lock);
+        for (uint32_t n = 0; n < __MP_REFILL; n++) {
+            void *ptr = __mp_alloc_small(pool, sizeclass);
+            if (ptr == NULL) break;
+            cache->objects[sizeclass][cache->count[sizeclass]++] = ptr;
+        }
+        pthread_mutex_unlock(&pool->__lock);
+        if (cache->count[sizeclass] == 0) return NULL;
+    }
+    return cache->objects[sizeclass][--cache->count[sizeclass]];
+}
+
+void __mp_cache_free(memory_pool_t *pool, void *ptr, uint32_t sizeclass) {
+    struct __mp_cache *cache = __mp_cache_for(pool);
+    if (cache == NULL) {
+        pthread_mutex_lock(&pool->__lock);
+        __mp_free_small(pool, ptr, sizeclass);
+        pthread_mutex_unlock(&pool->__lock);
+        return;
+    }
+    if (cache->count[sizeclass] == __MP_MAGAZINE) {
+        // A full magazine hands half of its objects back, keeping the rest for the next allocations.
+        pthread_mutex_lock(&pool->__lock);
+        for (uint32_t n = 0; n < __MP_MAGAZINE - __MP_REFILL; n++) {
+            __mp_free_small(pool, cache->objects[sizeclass][--cache->count[sizeclass]], sizeclass);
+        }
+        pthread_mutex_unlock(&pool->__lock);
+    }
+    cache->objects[sizeclass][cache->count[sizeclass]++] = ptr;
+}
+
+void __mp_cache_flush(struct __mp_cache *cache) {
+    memory_pool_t *pool = cache->pool;
+    pthread_mutex_lock(&pool->__lock);
+    for (uint32_t i = 0; i < __MP_SIZE_CLASSES; i++) {
+        while (cache->count[i] > 0) {
+            __mp_free_small(pool, cache->objects[i][--cache->count[i]], i);
+        }
+    }
+    pthread_mutex_unlock(&pool->__lock);
+}
+
+void __mp_cache_release(void *ptr) {
+    struct __mp_cache *cache = (struct __mp_cache *) ptr;
+    memory_pool_t     *pool  = cache->pool;
+    __mp_cache_flush(cache);
+    pthread_mutex_lock(&pool->__lock);
+    struct __mp_cache **link = &pool->__caches;
+    while (*link != cache) {
+        link = &(*link)->next;
+    }
+    *link = cache->next;
+    pthread_mutex_unlock(&pool->__lock);
+    free(cache);
+}
+
+struct __mp_block *__mp_map(size_t size) {
+    size_t             length = __mp_map_length(size);
+    struct __mp_block *block  = (struct __mp_block *) mmap(NULL, length, PROT_READ | PROT_WRITE,
+                                                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (block != MAP_FAILED) {
+        block->used = length | __MP_HUGETLB;
+        return block;
+    }
+    // Without reserved huge pages, a region aligned to a huge page lets the kernel back it with transparent ones.
+    uint8_t *raw = (uint8_t *) mmap(NULL, length + __MP_HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                                    -1, 0);
+    if (raw == MAP_FAILED) return NULL;
+    uint8_t *start = (uint8_t *) (((uintptr_t) raw + __MP_HUGE_PAGE - 1) & ~(uintptr_t) (__MP_HUGE_PAGE - 1));
+    if (start > raw) munmap(raw, start - raw);
+    munmap(start + length, raw + __MP_HUGE_PAGE - start);
+    madvise(start, length, MADV_HUGEPAGE);
+    block       = (struct __mp_block *) start;
+    block->used = length;
+    return block;
+}
+
+void __mp_unmap(struct __mp_block *block) {
+    munmap(block, block->used & ~(size_t) __MP_HUGETLB);
+}
+
+void __mp_link_mapped(memory_pool_t *pool, struct __mp_block *block) {
+    block->prev = NULL;
+    block->next = NULL;
+    if (pool == NULL) return;
+    if (pool->__shared) pthread_mutex_lock(&pool->__lock);
+    block->next = pool->__mapped;
+    if (pool->__mapped) pool->__mapped->prev = block;
+    pool->__mapped = block;
+    if (pool->__shared) pthread_mutex_unlock(&pool->__lock);
+}
+
+void __mp_unlink_mapped(memory_pool_t *pool, struct __mp_block *block) {
+    if (pool == NULL) return;
+    if (pool->__shared) pthread_mutex_lock(&pool->__lock);
+    if (block->prev)
+        block->prev->next = block->next;
+    else
+        pool->__mapped = block->next;
+    if (block->next) block->next->prev = block->prev;
+    if (pool->__shared) pthread_mutex_unlock(&pool->__lock);
+}
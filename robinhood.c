@@ -0,0 +1,232 @@
+#include "robinhood.h"
+
+#include <string.h>
+
+#include "hash.h"
+
+// Misses stop at the first slot whose entry is closer to its home than the probe is to the key's, so at 15/16 load a
+// probe still only looks at a handful of slots.
+#define __robinhood_load_max(CAPACITY) ((CAPACITY) - ((CAPACITY) >> 4))
+// An insert that leaves an entry further than this from its home grows the table, unless the table is so empty that
+// the hash must be to blame. The longest probe of a good hash grows with the log of the capacity, some 100 slots for
+// 8M at full load.
+#define __robinhood_probe_max(CAPACITY) ((uint32_t) __builtin_ctz(CAPACITY) << 3)
+#define __ROBINHOOD_MIN_SIZE 16
+
+// Homes come from the top bits of one multiplicative mix, so clustered user hashes still spread over the table.
+#define __robinhood_home(T, HASH) \
+    ((uint32_t) ((((uint64_t) (HASH)) * 0x9E3779B97F4A7C15ull) >> 32) & ((T)->__capacity - 1))
+#define __robinhood_alloc_meta(POOL, N) \
+    (struct __robinhood_meta *) mpmap((POOL), (size_t) (N) * sizeof(struct __robinhood_meta))
+#define __robinhood_alloc_slots(POOL, N) \
+    (struct __robinhood_slot *) mpmap((POOL), (size_t) (N) * sizeof(struct __robinhood_slot))
+#define __robinhood_free_meta(POOL, META, N) mpunmap((POOL), (META), (size_t) (N) * sizeof(struct __robinhood_meta))
+#define __robinhood_free_slots(POOL, SLOTS, N) \
+    mpunmap((POOL), (SLOTS), (size_t) (N) * sizeof(struct __robinhood_slot))
+
+bool     __robinhood_probe(robinhood_t *table, void *key, uint32_t hash, uint32_t *at, uint32_t *dist);
+int64_t  __robinhood_find(robinhood_t *table, void *key, uint32_t hash);
+uint32_t __robinhood_place(robinhood_t *table, uint32_t at, struct __robinhood_meta meta, struct __robinhood_slot slot);
+void     __robinhood_erase(robinhood_t *table, uint32_t i);
+int      __robinhood_resize(robinhood_t *table, uint32_t capacity);
+
+int robinhood_init(robinhood_t *table, uint32_t capacity, uint32_t (*hash)(void *), int (*equal)(void *, void *),
+                   memory_pool_t *pool) {
+    return_if(-1, capacity < __ROBINHOOD_MIN_SIZE || (capacity & (capacity - 1)) != 0);
+    struct __robinhood_meta *meta = __robinhood_alloc_meta(pool, capacity);
+    return_if_null(-1, meta);
+    struct __robinhood_slot *slots = __robinhood_alloc_slots(pool, capacity);
+    return_if_null((__robinhood_free_meta(pool, meta, capacity), -1), slots);
+    memset(meta, 0, (size_t) capacity * sizeof(struct __robinhood_meta));
+    table->__size       = 0;
+    table->__capacity   = capacity;
+    table->__meta       = meta;
+    table->__slots      = slots;
+    table->__pool       = pool;
+    table->__hash       = hash;
+    table->__seed       = hash_seed();
+    table->__equal      = equal;
+    table->__generation = 0;
+    return 0;
+}
+
+int robinhood_free(robinhood_t *table) {
+    if (table->__meta) __robinhood_free_meta(table->__pool, table->__meta, table->__capacity);
+    if (table->__slots) __robinhood_free_slots(table->__pool, table->__slots, table->__capacity);
+    table->__meta  = NULL;
+    table->__slots = NULL;
+    return 0;
+}
+
+uint32_t robinhood_size(robinhood_t *table) {
+    return table->__size;
+}
+
+uint32_t robinhood_capacity(robinhood_t *table) {
+    return table->__capacity;
+}
+
+// Changes whenever entries move to other slots, which inserts and removes do as well as resizes.
+uint32_t robinhood_generation(robinhood_t *table) {
+    return table->__generation;
+}
+
+bool robinhood_exists(robinhood_t *table, void *key) {
+    return __robinhood_find(table, key, robinhood_hash(table, key)) >= 0;
+}
+
+int robinhood_insert(robinhood_t *table, void *key, void *value, bool update) {
+    uint32_t hash = robinhood_hash(table, key), at, dist;
+    if (__robinhood_probe(table, key, hash, &at, &dist)) {
+        return update ? (table->__slots[at].v = value, 0) : -1;
+    }
+    if (table->__size >= __robinhood_load_max(table->__capacity)) {
+        return_if(-1, __robinhood_resize(table, table->__capacity << 1) != 0);
+        __robinhood_probe(table, key, hash, &at, &dist);
+    }
+    struct __robinhood_meta meta = {.hash = hash, .dist = dist};
+    struct __robinhood_slot slot = {.k = key, .v = value};
+    uint32_t                longest = __robinhood_place(table, at, meta, slot);
+    table->__size++;
+    // The entry is in either way; a failed grow only leaves the probes long.
+    uint32_t capacity = table->__capacity;
+    if (longest > __robinhood_probe_max(capacity) && table->__size >= __robinhood_load_max(capacity) >> 2) {
+        __robinhood_resize(table, capacity << 1);
+    }
+    return 0;
+}
+
+int robinhood_remove(robinhood_t *table, void *key) {
+    int64_t i = __robinhood_find(table, key, robinhood_hash(table, key));
+    return_if(-1, i < 0);
+    __robinhood_erase(table, (uint32_t) i);
+    table->__size--;
+    return 0;
+}
+
+int robinhood_set(robinhood_t *table, void *key, void *value) {
+    int64_t i = __robinhood_find(table, key, robinhood_hash(table, key));
+    return_if(-1, i < 0);
+    table->__slots[i].v = value;
+    return 0;
+}
+
+void *robinhood_get(robinhood_t *table, void *key, void *default_value) {
+    int64_t i = __robinhood_find(table, key, robinhood_hash(table, key));
+    return i >= 0 ? table->__slots[i].v : default_value;
+}
+
+int robinhood_clear(robinhood_t *table) {
+    memset(table->__meta, 0, (size_t) table->__capacity * sizeof(struct __robinhood_meta));
+    table->__size = 0;
+    table->__generation++;
+    return 0;
+}
+
+int robinhood_resize(robinhood_t *table, uint32_t capacity) {
+    return_if(-1, capacity < __ROBINHOOD_MIN_SIZE || __robinhood_load_max(capacity) < table->__size);
+    return __robinhood_resize(table, capacity);
+}
+
+// The first full slot at or after i, with its key and value, or the capacity when there is none.
+uint32_t robinhood_next(robinhood_t *table, uint32_t i, void **key, void **value) {
+    for (; i < table->__capacity; i++) {
+        if (table->__meta[i].dist == 0) continue;
+        *key   = table->__slots[i].k;
+        *value = table->__slots[i].v;
+        return i;
+    }
+    return table->__capacity;
+}
+
+void robinhood_foreach(robinhood_t *table, void (*predicate)(void *, void *, void *), void *args) {
+    for (uint32_t i = 0; i < table->__capacity; i++) {
+        if (table->__meta[i].dist) predicate(table->__slots[i].k, table->__slots[i].v, args);
+    }
+}
+
+// The most slots any lookup of a present key looks at.
+uint32_t robinhood_longest_probe(robinhood_t *table) {
+    uint32_t longest = 0;
+    for (uint32_t i = 0; i < table->__capacity; i++) {
+        if (table->__meta[i].dist > longest) longest = table->__meta[i].dist;
+    }
+    return longest;
+}
+
+// Walks the probe sequence of hash to the key, or to where the key would go: the first slot that is empty or holds an
+// entry closer to its home. Slots hold entries in the order of their homes, so the key cannot be further on. *dist is
+// the probe distance at *at, counting the home as 1, as an empty slot holds distance 0.
+bool __robinhood_probe(robinhood_t *table, void *key, uint32_t hash, uint32_t *at, uint32_t *dist) {
+    struct __robinhood_meta *meta = table->__meta;
+    uint32_t                 mask = table->__capacity - 1, i = __robinhood_home(table, hash), d = 1;
+    for (; meta[i].dist >= d; i = (i + 1) & mask, d++) {
+        if (meta[i].hash == hash && robinhood_equal(table, table->__slots[i].k, key) == 0) break;
+    }
+    *at   = i;
+    *dist = d;
+    return meta[i].dist >= d;
+}
+
+int64_t __robinhood_find(robinhood_t *table, void *key, uint32_t hash) {
+    uint32_t at, dist;
+    return __robinhood_probe(table, key, hash, &at, &dist) ? (int64_t) at : -1;
+}
+
+// Puts an entry where __robinhood_probe stopped. An entry on the way that is closer to its home than the one in hand
+// trades places with it, and the probe goes on with the displaced entry, up to the first empty slot. Returns the
+// longest probe distance any of them ends up at.
+uint32_t __robinhood_place(robinhood_t *table, uint32_t at, struct __robinhood_meta meta,
+                           struct __robinhood_slot slot) {
+    uint32_t mask = table->__capacity - 1, longest = meta.dist;
+    for (uint32_t i = at;; i = (i + 1) & mask, meta.dist++) {
+        if (table->__meta[i].dist == 0) {
+            table->__meta[i]  = meta;
+            table->__slots[i] = slot;
+            table->__generation += i != at;
+            return meta.dist > longest ? meta.dist : longest;
+        }
+        if (table->__meta[i].dist < meta.dist) {
+            struct __robinhood_meta held_meta = table->__meta[i];
+            struct __robinhood_slot held_slot = table->__slots[i];
+            table->__meta[i]                  = meta;
+            table->__slots[i]                 = slot;
+            if (meta.dist > longest) longest = meta.dist;
+            meta = held_meta;
+            slot = held_slot;
+        }
+    }
+}
+
+// Backward-shift deletion: the entries after i move one slot closer to their homes, up to one that is already home or
+// an empty slot, so no tombstone is left to lengthen later probes.
+void __robinhood_erase(robinhood_t *table, uint32_t i) {
+    uint32_t mask = table->__capacity - 1;
+    for (uint32_t next = (i + 1) & mask; table->__meta[next].dist > 1; i = next, next = (next + 1) & mask) {
+        table->__meta[i] = table->__meta[next];
+        table->__meta[i].dist--;
+        table->__slots[i] = table->__slots[next];
+        table->__generation++;
+    }
+    table->__meta[i].dist = 0;
+}
+
+int __robinhood_resize(robinhood_t *table, uint32_t capacity) {
+    robinhood_t newtable;
+    int         ret = robinhood_init(&newtable, capacity, table->__hash, table->__equal, table->__pool);
+    return_if(-1, ret != 0);
+    newtable.__seed       = table->__seed;
+    newtable.__generation = table->__generation + 1;
+    for (uint32_t i = 0; i < table->__capacity; i++) {
+        if (table->__meta[i].dist == 0) continue;
+        // Keys are known to be distinct, so the probe only looks for the place, never compares a key.
+        struct __robinhood_meta meta = {.hash = table->__meta[i].hash, .dist = 1};
+        uint32_t                mask = capacity - 1, at = __robinhood_home(&newtable, meta.hash);
+        for (; newtable.__meta[at].dist >= meta.dist; at = (at + 1) & mask) meta.dist++;
+        __robinhood_place(&newtable, at, meta, table->__slots[i]);
+    }
+    newtable.__size = table->__size;
+    robinhood_free(table);
+    memcpy(table, &newtable, sizeof(newtable));
+    return 0;
+}
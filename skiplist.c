@@ -3,16 +3,27 @@
 #include <string.h>
 
 uint32_t                __skiplist_rand_level();
-struct __skiplist_node* __skiplist_alloc_node(memory_pool_t* pool, void* key, void* value, uint32_t level);
+struct __skiplist_node* __skiplist_alloc_node(memory_pool_t* pool, void* key, void* value, uint32_t hash,
+                                              uint32_t level);
+void                    __skiplist_reclaim_node(void* pool, void* node);
+
+// Nodes are ordered by (hash, key): the key comparison only runs between nodes whose hashes are equal.
+#define __skiplist_compare_node(SKIPLIST, NODE, K, HASH) \
+    ((NODE)->hash != (HASH) ? ((NODE)->hash < (HASH) ? -1 : 1) : skiplist_compare((SKIPLIST), (NODE)->k, (K)))
+
+// Links and values are published with release stores so lock-free readers always see fully built nodes.
+#define __skiplist_load(PTR) __atomic_load_n((PTR), __ATOMIC_ACQUIRE)
+#define __skiplist_store(PTR, VALUE) __atomic_store_n((PTR), (VALUE), __ATOMIC_RELEASE)
 
 int skiplist_init(skiplist_t* skiplist, int (*compare)(void*, void*), memory_pool_t* pool) {
-    struct __skiplist_node* head = __skiplist_alloc_node(pool, NULL, NULL, SKIPLIST_MAX_LEVEL);
+    struct __skiplist_node* head = __skiplist_alloc_node(pool, NULL, NULL, 0, SKIPLIST_MAX_LEVEL);
     return_if_null(-1, head);
     skiplist->__size    = 0;
     skiplist->__level   = 1;
     skiplist->__head    = head;
     skiplist->__pool    = pool;
     skiplist->__compare = compare;
+    skiplist->__epoch   = NULL;
     memset(head->forward, 0, SKIPLIST_MAX_LEVEL * sizeof(void*));
     return 0;
 }
@@ -42,11 +53,12 @@ int skiplist_destroy(skiplist_t* skiplist) {
     return 0;
 }
 
-bool skiplist_exists(skiplist_t* skiplist, void* k) {
+bool skiplist_exists(skiplist_t* skiplist, void* k, uint32_t hash) {
     struct __skiplist_node *prev = skiplist->__head, *curr = NULL;
-    for (int64_t lv = skiplist->__level - 1; lv >= 0; --lv) {
-        for (curr = prev->forward[lv]; curr; prev = curr, curr = curr->forward[lv]) {
-            int ret = skiplist_compare(skiplist, curr->k, k);
+    for (int64_t lv = __skiplist_load(&skiplist->__level) - 1; lv >= 0; --lv) {
+        for (curr = __skiplist_load(&prev->forward[lv]); curr;
+             prev = curr, curr = __skiplist_load(&curr->forward[lv])) {
+            int ret = __skiplist_compare_node(skiplist, curr, k, hash);
             if (ret < 0) continue;
             return_if(true, ret == 0);
             break;
@@ -55,78 +67,90 @@ bool skiplist_exists(skiplist_t* skiplist, void* k) {
     return false;
 }
 
-int skiplist_insert(skiplist_t* skiplist, void* k, void* v, bool update) {
+int skiplist_insert(skiplist_t* skiplist, void* k, void* v, uint32_t hash, bool update) {
     struct __skiplist_node* updates[SKIPLIST_MAX_LEVEL];
     struct __skiplist_node *prev = skiplist->__head, *curr = NULL;
     for (int64_t lv = skiplist->__level - 1; lv >= 0; --lv) {
         for (curr = prev->forward[lv]; curr; prev = curr, curr = curr->forward[lv]) {
-            int ret = skiplist_compare(skiplist, curr->k, k);
+            int ret = __skiplist_compare_node(skiplist, curr, k, hash);
             if (ret < 0) continue;
             if (ret == 0) {
-                return update ? (curr->v = v, skiplist->__size++, 0) : -1;
+                return update ? (__skiplist_store(&curr->v, v), 0) : -1;
             }
             break;
         }
         updates[lv] = prev;
     }
     uint32_t                level = __skiplist_rand_level();
-    struct __skiplist_node* node  = __skiplist_alloc_node(skiplist->__pool, k, v, level);
+    struct __skiplist_node* node  = __skiplist_alloc_node(skiplist->__pool, k, v, hash, level);
     return_if_null(-1, node);
-    while (skiplist->__level < node->level) {
-        updates[skiplist->__level++] = skiplist->__head;
+    for (uint32_t lv = skiplist->__level; lv < node->level; lv++) {
+        updates[lv] = skiplist->__head;
     }
     for (uint32_t lv = 0; lv < node->level; lv++) {
-        node->forward[lv]        = updates[lv]->forward[lv];
-        updates[lv]->forward[lv] = node;
+        node->forward[lv] = updates[lv]->forward[lv];
+        __skiplist_store(&updates[lv]->forward[lv], node);
     }
+    if (skiplist->__level < node->level) __skiplist_store(&skiplist->__level, node->level);
     skiplist->__size++;
     return 0;
 }
 
-int skiplist_remove(skiplist_t* skiplist, void* k) {
+int skiplist_remove(skiplist_t* skiplist, void* k, uint32_t hash) {
+    return skiplist_pop(skiplist, k, hash, NULL);
+}
+
+int skiplist_pop(skiplist_t* skiplist, void* k, uint32_t hash, void** stored) {
     struct __skiplist_node* updates[SKIPLIST_MAX_LEVEL];
     int                     ret  = -1;
     struct __skiplist_node *prev = skiplist->__head, *curr = NULL;
     for (int64_t lv = skiplist->__level - 1; lv >= 0; --lv) {
         for (curr = prev->forward[lv]; curr; prev = curr, curr = curr->forward[lv]) {
-            ret = skiplist_compare(skiplist, curr->k, k);
+            ret = __skiplist_compare_node(skiplist, curr, k, hash);
             if (ret < 0) continue;
             break;
         }
         updates[lv] = prev;
     }
     return_if(-1, ret != 0);
+    // The caller may own what the node's key points to and needs it back to release it.
+    if (stored) *stored = curr->k;
     for (uint32_t lv = 0; lv < curr->level; lv++) {
-        updates[lv]->forward[lv] = curr->forward[lv];
+        __skiplist_store(&updates[lv]->forward[lv], curr->forward[lv]);
     }
     while (skiplist->__level > 1 && skiplist->__head->forward[skiplist->__level - 1] == NULL) {
-        skiplist->__level--;
+        __skiplist_store(&skiplist->__level, skiplist->__level - 1);
     }
-    mpfree(skiplist->__pool, curr);
+    // The unlinked node keeps its links for readers standing on it until the epoch has moved past them.
+    if (skiplist->__epoch)
+        epoch_retire(skiplist->__epoch, __skiplist_reclaim_node, skiplist->__pool, curr);
+    else
+        mpfree(skiplist->__pool, curr);
     skiplist->__size--;
     return 0;
 }
 
-void* skiplist_get(skiplist_t* skiplist, void* k, void* default_value) {
+void* skiplist_get(skiplist_t* skiplist, void* k, uint32_t hash, void* default_value) {
     struct __skiplist_node *prev = skiplist->__head, *curr = NULL;
-    for (int64_t lv = skiplist->__level - 1; lv >= 0; --lv) {
-        for (curr = prev->forward[lv]; curr; prev = curr, curr = curr->forward[lv]) {
-            int ret = skiplist_compare(skiplist, curr->k, k);
+    for (int64_t lv = __skiplist_load(&skiplist->__level) - 1; lv >= 0; --lv) {
+        for (curr = __skiplist_load(&prev->forward[lv]); curr;
+             prev = curr, curr = __skiplist_load(&curr->forward[lv])) {
+            int ret = __skiplist_compare_node(skiplist, curr, k, hash);
             if (ret < 0) continue;
-            return_if(curr->v, ret == 0);
+            return_if(__skiplist_load(&curr->v), ret == 0);
             break;
         }
     }
     return default_value;
 }
 
-int skiplist_set(skiplist_t* skiplist, void* k, void* v) {
+int skiplist_set(skiplist_t* skiplist, void* k, void* v, uint32_t hash) {
     struct __skiplist_node *prev = skiplist->__head, *curr = NULL;
     for (int64_t lv = skiplist->__level - 1; lv >= 0; --lv) {
         for (curr = prev->forward[lv]; curr; prev = curr, curr = curr->forward[lv]) {
-            int ret = skiplist_compare(skiplist, curr->k, k);
+            int ret = __skiplist_compare_node(skiplist, curr, k, hash);
             if (ret < 0) continue;
-            return_if((curr->v = v, 0), ret == 0);
+            return_if((__skiplist_store(&curr->v, v), 0), ret == 0);
             break;
         }
     }
@@ -145,6 +169,32 @@ int skiplist_clear(skiplist_t* skiplist) {
     return 0;
 }
 
+// Moves the nodes whose hash has any bit of mask into an empty skiplist of the same pool. Nodes keep their order and
+// their levels, so both skiplists are relinked in one walk, and nothing is allocated.
+void skiplist_split(skiplist_t* skiplist, skiplist_t* into, uint32_t mask) {
+    struct __skiplist_node *keep[SKIPLIST_MAX_LEVEL], *move[SKIPLIST_MAX_LEVEL];
+    struct __skiplist_node* node = skiplist->__head->forward[0];
+    for (uint32_t lv = 0; lv < SKIPLIST_MAX_LEVEL; lv++) {
+        keep[lv] = skiplist->__head;
+        move[lv] = into->__head;
+    }
+    memset(skiplist->__head->forward, 0, SKIPLIST_MAX_LEVEL * sizeof(void*));
+    skiplist->__size  = 0;
+    skiplist->__level = 1;
+    for (struct __skiplist_node* next = NULL; node; node = next) {
+        next                            = node->forward[0];
+        skiplist_t*              target = node->hash & mask ? into : skiplist;
+        struct __skiplist_node** tails  = node->hash & mask ? move : keep;
+        for (uint32_t lv = 0; lv < node->level; lv++) {
+            tails[lv]->forward[lv] = node;
+            tails[lv]              = node;
+            node->forward[lv]      = NULL;
+        }
+        if (target->__level < node->level) target->__level = node->level;
+        target->__size++;
+    }
+}
+
 void skiplist_foreach(skiplist_t* skiplist, void (*predicate)(void*, void*, void*), void* args) {
     if (skiplist->__head) {
         for (struct __skiplist_node* node = skiplist->__head->forward[0]; node; node = node->forward[0]) {
@@ -161,11 +211,18 @@ uint32_t __skiplist_rand_level() {
     return lv;
 }
 
-struct __skiplist_node* __skiplist_alloc_node(memory_pool_t* pool, void* key, void* value, uint32_t level) {
+struct __skiplist_node* __skiplist_alloc_node(memory_pool_t* pool, void* key, void* value, uint32_t hash,
+                                              uint32_t level) {
     size_t                  size = sizeof(struct __skiplist_node) + level * sizeof(void*);
     struct __skiplist_node* node = (struct __skiplist_node*) mpalloc(pool, size);
+    return_if_null(NULL, node);
     node->k                      = key;
     node->v                      = value;
+    node->hash                   = hash;
     node->level                  = level;
     return node;
-}
\ No newline at end of file
+}
+
+void __skiplist_reclaim_node(void* pool, void* node) {
+    mpfree((memory_pool_t*) pool, node);
+}
@@ -0,0 +1,247 @@
+#include "swisstable.h"
+
+#include <string.h>
+
+#include "hash.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define __SWISSTABLE_GROUP 16
+#define __SWISSTABLE_EMPTY ((int8_t) -128)
+#define __SWISSTABLE_DELETED ((int8_t) -2)
+
+// Both halves come from one multiplicative mix so clustered user hashes still spread over the groups.
+#define __swisstable_mix(HASH) (((uint64_t) (HASH)) * 0x9E3779B97F4A7C15ull)
+#define __swisstable_h1(HASH) ((uint32_t) (__swisstable_mix(HASH) >> 25))
+#define __swisstable_h2(HASH) ((int8_t) (__swisstable_mix(HASH) >> 57))
+#define __swisstable_load_max(CAPACITY) ((CAPACITY) - ((CAPACITY) >> 3))
+#define __swisstable_alloc_ctrl(POOL, N) (int8_t *) mpmap((POOL), (size_t) (N) + __SWISSTABLE_GROUP)
+#define __swisstable_alloc_slots(POOL, N) \
+    (struct __swisstable_slot *) mpmap((POOL), (size_t) (N) * sizeof(struct __swisstable_slot))
+#define __swisstable_free_ctrl(POOL, CTRL, N) mpunmap((POOL), (CTRL), (size_t) (N) + __SWISSTABLE_GROUP)
+#define __swisstable_free_slots(POOL, SLOTS, N) \
+    mpunmap((POOL), (SLOTS), (size_t) (N) * sizeof(struct __swisstable_slot))
+
+uint32_t __swisstable_match(const int8_t *group, int8_t h2);
+uint32_t __swisstable_match_empty(const int8_t *group);
+uint32_t __swisstable_match_free(const int8_t *group);
+int64_t  __swisstable_find(swisstable_t *table, void *key, uint32_t hash);
+uint32_t __swisstable_find_free(swisstable_t *table, uint32_t hash);
+void     __swisstable_set_ctrl(swisstable_t *table, uint32_t i, int8_t ctrl);
+int      __swisstable_resize(swisstable_t *table, uint32_t capacity);
+
+int swisstable_init(swisstable_t *table, uint32_t capacity, uint32_t (*hash)(void *), int (*equal)(void *, void *),
+                    memory_pool_t *pool) {
+    return_if(-1, capacity < __SWISSTABLE_GROUP || (capacity & (capacity - 1)) != 0);
+    int8_t *ctrl = __swisstable_alloc_ctrl(pool, capacity);
+    return_if_null(-1, ctrl);
+    struct __swisstable_slot *slots = __swisstable_alloc_slots(pool, capacity);
+    return_if_null((__swisstable_free_ctrl(pool, ctrl, capacity), -1), slots);
+    memset(ctrl, __SWISSTABLE_EMPTY, capacity + __SWISSTABLE_GROUP);
+    table->__size        = 0;
+    table->__capacity    = capacity;
+    table->__growth_left = __swisstable_load_max(capacity);
+    table->__ctrl        = ctrl;
+    table->__slots       = slots;
+    table->__pool        = pool;
+    table->__hash        = hash;
+    table->__seed        = hash_seed();
+    table->__equal       = equal;
+    table->__generation  = 0;
+    return 0;
+}
+
+int swisstable_free(swisstable_t *table) {
+    if (table->__ctrl) __swisstable_free_ctrl(table->__pool, table->__ctrl, table->__capacity);
+    if (table->__slots) __swisstable_free_slots(table->__pool, table->__slots, table->__capacity);
+    table->__ctrl  = NULL;
+    table->__slots = NULL;
+    return 0;
+}
+
+uint32_t swisstable_size(swisstable_t *table) {
+    return table->__size;
+}
+
+uint32_t swisstable_capacity(swisstable_t *table) {
+    return table->__capacity;
+}
+
+// Changes whenever entries move to other slots, which only a resize or an in-place rehash does.
+uint32_t swisstable_generation(swisstable_t *table) {
+    return table->__generation;
+}
+
+bool swisstable_exists(swisstable_t *table, void *key) {
+    return __swisstable_find(table, key, swisstable_hash(table, key)) >= 0;
+}
+
+int swisstable_insert(swisstable_t *table, void *key, void *value, bool update) {
+    uint32_t hash = swisstable_hash(table, key);
+    int64_t  i    = __swisstable_find(table, key, hash);
+    if (i >= 0) {
+        return update ? (table->__slots[i].v = value, 0) : -1;
+    }
+    uint32_t slot = __swisstable_find_free(table, hash);
+    if (table->__growth_left == 0 && table->__ctrl[slot] == __SWISSTABLE_EMPTY) {
+        // Grow when live entries fill the table, otherwise rehash in place to drop tombstones.
+        uint32_t capacity = table->__size >= (__swisstable_load_max(table->__capacity) >> 1) ? table->__capacity << 1
+                                                                                            : table->__capacity;
+        return_if(-1, __swisstable_resize(table, capacity) != 0);
+        slot = __swisstable_find_free(table, hash);
+    }
+    table->__growth_left -= table->__ctrl[slot] == __SWISSTABLE_EMPTY;
+    __swisstable_set_ctrl(table, slot, __swisstable_h2(hash));
+    table->__slots[slot].k    = key;
+    table->__slots[slot].v    = value;
+    table->__slots[slot].hash = hash;
+    table->__size++;
+    return 0;
+}
+
+int swisstable_remove(swisstable_t *table, void *key) {
+    int64_t i = __swisstable_find(table, key, swisstable_hash(table, key));
+    return_if(-1, i < 0);
+    // A slot may become empty again only if no probe sequence could have walked past it.
+    uint32_t mask         = table->__capacity - 1;
+    uint32_t empty_before = __swisstable_match_empty(&table->__ctrl[(i - __SWISSTABLE_GROUP) & mask]);
+    uint32_t empty_after  = __swisstable_match_empty(&table->__ctrl[i]);
+    bool     never_full   = empty_before && empty_after &&
+                      (__builtin_ctz(empty_after) + __builtin_clz(empty_before) - 16) < __SWISSTABLE_GROUP;
+    __swisstable_set_ctrl(table, i, never_full ? __SWISSTABLE_EMPTY : __SWISSTABLE_DELETED);
+    table->__growth_left += never_full;
+    table->__size--;
+    return 0;
+}
+
+int swisstable_set(swisstable_t *table, void *key, void *value) {
+    int64_t i = __swisstable_find(table, key, swisstable_hash(table, key));
+    return_if(-1, i < 0);
+    table->__slots[i].v = value;
+    return 0;
+}
+
+void *swisstable_get(swisstable_t *table, void *key, void *default_value) {
+    int64_t i = __swisstable_find(table, key, swisstable_hash(table, key));
+    return i >= 0 ? table->__slots[i].v : default_value;
+}
+
+int swisstable_clear(swisstable_t *table) {
+    memset(table->__ctrl, __SWISSTABLE_EMPTY, table->__capacity + __SWISSTABLE_GROUP);
+    table->__size        = 0;
+    table->__growth_left = __swisstable_load_max(table->__capacity);
+    return 0;
+}
+
+int swisstable_resize(swisstable_t *table, uint32_t capacity) {
+    return_if(-1, capacity < __SWISSTABLE_GROUP || __swisstable_load_max(capacity) < table->__size);
+    return __swisstable_resize(table, capacity);
+}
+
+// The first full slot at or after i, with its key and value, or the capacity when there is none.
+uint32_t swisstable_next(swisstable_t *table, uint32_t i, void **key, void **value) {
+    for (; i < table->__capacity; i++) {
+        if (table->__ctrl[i] < 0) continue;
+        *key   = table->__slots[i].k;
+        *value = table->__slots[i].v;
+        return i;
+    }
+    return table->__capacity;
+}
+
+void swisstable_foreach(swisstable_t *table, void (*predicate)(void *, void *, void *), void *args) {
+    for (uint32_t i = 0; i < table->__capacity; i++) {
+        if (table->__ctrl[i] >= 0) predicate(table->__slots[i].k, table->__slots[i].v, args);
+    }
+}
+
+#ifdef __SSE2__
+
+uint32_t __swisstable_match(const int8_t *group, int8_t h2) {
+    __m128i ctrl = _mm_loadu_si128((const __m128i *) group);
+    return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(h2)));
+}
+
+uint32_t __swisstable_match_empty(const int8_t *group) {
+    return __swisstable_match(group, __SWISSTABLE_EMPTY);
+}
+
+uint32_t __swisstable_match_free(const int8_t *group) {
+    return (uint32_t) _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) group));
+}
+
+#else
+
+uint32_t __swisstable_match(const int8_t *group, int8_t h2) {
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < __SWISSTABLE_GROUP; i++) {
+        mask |= (uint32_t) (group[i] == h2) << i;
+    }
+    return mask;
+}
+
+uint32_t __swisstable_match_empty(const int8_t *group) {
+    return __swisstable_match(group, __SWISSTABLE_EMPTY);
+}
+
+uint32_t __swisstable_match_free(const int8_t *group) {
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < __SWISSTABLE_GROUP; i++) {
+        mask |= (uint32_t) (group[i] < 0) << i;
+    }
+    return mask;
+}
+
+#endif
+
+int64_t __swisstable_find(swisstable_t *table, void *key, uint32_t hash) {
+    uint32_t mask = table->__capacity - 1;
+    int8_t   h2   = __swisstable_h2(hash);
+    // Triangular probing over whole groups visits every group of a power-of-two table.
+    uint32_t step = __SWISSTABLE_GROUP;
+    for (uint32_t pos = __swisstable_h1(hash) & mask;; pos = (pos + step) & mask, step += __SWISSTABLE_GROUP) {
+        const int8_t *group = &table->__ctrl[pos];
+        for (uint32_t match = __swisstable_match(group, h2); match; match &= match - 1) {
+            uint32_t i = (pos + __builtin_ctz(match)) & mask;
+            return_if(i, swisstable_equal(table, table->__slots[i].k, key) == 0);
+        }
+        return_if(-1, __swisstable_match_empty(group) != 0);
+    }
+}
+
+uint32_t __swisstable_find_free(swisstable_t *table, uint32_t hash) {
+    uint32_t mask = table->__capacity - 1;
+    uint32_t step = __SWISSTABLE_GROUP;
+    for (uint32_t pos = __swisstable_h1(hash) & mask;; pos = (pos + step) & mask, step += __SWISSTABLE_GROUP) {
+        uint32_t match = __swisstable_match_free(&table->__ctrl[pos]);
+        return_if((pos + __builtin_ctz(match)) & mask, match != 0);
+    }
+}
+
+void __swisstable_set_ctrl(swisstable_t *table, uint32_t i, int8_t ctrl) {
+    table->__ctrl[i] = ctrl;
+    // The first group is mirrored past the end so unaligned group loads never wrap.
+    if (i < __SWISSTABLE_GROUP) table->__ctrl[table->__capacity + i] = ctrl;
+}
+
+int __swisstable_resize(swisstable_t *table, uint32_t capacity) {
+    swisstable_t newtable;
+    int          ret = swisstable_init(&newtable, capacity, table->__hash, table->__equal, table->__pool);
+    return_if(-1, ret != 0);
+    newtable.__seed       = table->__seed;
+    newtable.__generation = table->__generation + 1;
+    for (uint32_t i = 0; i < table->__capacity; i++) {
+        if (table->__ctrl[i] < 0) continue;
+        struct __swisstable_slot *slot = &table->__slots[i];
+        uint32_t                  j    = __swisstable_find_free(&newtable, slot->hash);
+        __swisstable_set_ctrl(&newtable, j, table->__ctrl[i]);
+        newtable.__slots[j] = *slot;
+    }
+    newtable.__size = table->__size;
+    newtable.__growth_left -= table->__size;
+    swisstable_free(table);
+    memcpy(table, &newtable, sizeof(newtable));
+    return 0;
+}
@@ -1,24 +1,84 @@
 #include <assert.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "hash.h"
 #include "hashmap.h"
+#include "hashmap_concurrent.h"
+#include "hashmap_rcu.h"
 
 typedef uint32_t (*hash_fn_t)(void*);
 typedef int (*equal_fn_t)(void*, void*);
 
 void test_hashmap();
-void benchmark();
+void benchmark(uint32_t flags);
+void benchmark_batch(uint32_t flags);
+void benchmark_binary();
+void benchmark_u64();
+void benchmark_iterate();
+void benchmark_build();
+void benchmark_resize();
+void benchmark_compact();
+void benchmark_cache();
+void benchmark_lookup(uint32_t flags);
+void benchmark_misses(uint32_t flags);
+void benchmark_memory();
+void benchmark_snapshot();
+void benchmark_views();
+void test_views(uint32_t flags);
+void benchmark_pool();
+void benchmark_pool_threads();
+void benchmark_latency(uint32_t flags);
+void benchmark_concurrent(uint32_t segments);
+void benchmark_rcu();
+void benchmark_hash();
 void print_hashmap(hashmap_t* map);
+int dtlb_open();
+long long dtlb_read(int fd);
+size_t anon_huge_kb();
 
 int main(int argc, char const* argv[]) {
     // test_hashmap();
+    benchmark_hash();
     for (size_t i = 0; i < 10; i++) {
-        benchmark();
+        benchmark(0);
+        benchmark(HASHMAP_ENGINE_SWISS);
+        benchmark(HASHMAP_ENGINE_ROBINHOOD);
         // usleep(100 * 1000);
     }
+    benchmark_batch(0);
+    benchmark_batch(HASHMAP_ENGINE_SWISS);
+    benchmark_binary();
+    benchmark_u64();
+    benchmark_iterate();
+    benchmark_build();
+    benchmark_resize();
+    benchmark_compact();
+    benchmark_cache();
+    benchmark_lookup(0);
+    benchmark_lookup(HASHMAP_ENGINE_SWISS);
+    benchmark_lookup(HASHMAP_ENGINE_ROBINHOOD);
+    benchmark_misses(0);
+    benchmark_misses(HASHMAP_ENGINE_ROBINHOOD);
+    benchmark_memory();
+    benchmark_snapshot();
+    benchmark_views();
+    test_views(0);
+    test_views(HASHMAP_BINARY_KEYS);
+    test_views(HASHMAP_U64_KEYS);
+    benchmark_pool();
+    benchmark_latency(0);
+    benchmark_latency(HASHMAP_INCREMENTAL_RESIZE);
+    benchmark_concurrent(1);
+    benchmark_concurrent(64);
+    benchmark_rcu();
+    benchmark_pool_threads();
     // sizeof(hashmap_t);
     return 0;
 }
@@ -65,11 +125,14 @@ void test_hashmap() {
 
 #define N (1000 * 1024)
 
-void benchmark() {
-    printf("N = %d, ", N);
+const char* engine_name(uint32_t flags) {
+    return flags & HASHMAP_ENGINE_SWISS ? "swiss" : flags & HASHMAP_ENGINE_ROBINHOOD ? "robin" : "chained";
+}
+
+void benchmark(uint32_t flags) {
+    printf("%-7s N = %d, ", engine_name(flags), N);
     //
-    char strs[N][8];
-    memset(strs, 0, sizeof(strs));
+    char(*strs)[8] = calloc(N, sizeof(*strs));
     for (size_t i = 0; i < N; i++) {
         sprintf(strs[i], "%d", (int) i);
     }
@@ -77,7 +140,7 @@ void benchmark() {
     clock_t tic = clock();
     {
         hashmap_t map;
-        hashmap_init(&map, 16, NULL, NULL, NULL);
+        hashmap_init_with(&map, 16, NULL, NULL, NULL, flags);
         for (size_t i = 0; i < N; i++) {
             hashmap_insert(&map, strs[i], strs[i], true);
             if (i % 2) {
@@ -100,9 +163,1111 @@ void benchmark() {
     //
     double ms = 1000 * (double) (toc - tic) / CLOCKS_PER_SEC;
     printf("T = %f ms\n", ms);
+    free(strs);
     // }
 }
 
+// Keys differ only in a counter spelled over their last four characters, as ids and paths usually do. The chi-square
+// over 2^16 buckets taken from the low bits, divided by its degrees of freedom, is about 1 for a uniform hash.
+double hash_quality(size_t len, int wide) {
+    uint32_t* counts = calloc(1 << 16, sizeof(uint32_t));
+    char*     key    = malloc(len + 1);
+    memset(key, 'k', len);
+    key[len] = 0;
+    for (uint32_t i = 0; i < (1 << 20); i++) {
+        for (size_t j = 0; j < 4; j++) {
+            key[len - 1 - j] = '0' + ((i >> (6 * j)) & 63);
+        }
+        uint32_t h = wide ? (uint32_t) wyhash(key, len, 42) : bkdr_hash(key);
+        counts[h & 0xFFFF]++;
+    }
+    double chi2 = 0, expected = (double) (1 << 20) / (1 << 16);
+    for (uint32_t i = 0; i < (1 << 16); i++) {
+        chi2 += (counts[i] - expected) * (counts[i] - expected) / expected;
+    }
+    free(key);
+    free(counts);
+    return chi2 / ((1 << 16) - 1);
+}
+
+// Share of the 32 low output bits that flip when one bit of the counter flips: 0.5 for a well-mixed hash.
+double hash_avalanche(size_t len, int wide) {
+    char* key = malloc(len + 1);
+    memset(key, 'k', len);
+    key[len]       = 0;
+    uint64_t flips = 0, trials = 0;
+    for (uint32_t i = 0; i < (1 << 14); i++) {
+        key[len - 1] = '0' + (i & 63);
+        key[len - 2] = '0' + ((i >> 6) & 63);
+        uint32_t h   = wide ? (uint32_t) wyhash(key, len, 42) : bkdr_hash(key);
+        for (uint32_t bit = 0; bit < 5; bit++) {
+            key[len - 1] ^= 1 << bit;
+            uint32_t g = wide ? (uint32_t) wyhash(key, len, 42) : bkdr_hash(key);
+            key[len - 1] ^= 1 << bit;
+            flips += __builtin_popcount(h ^ g);
+            trials += 32;
+        }
+    }
+    free(key);
+    return (double) flips / trials;
+}
+
+void benchmark_hash() {
+    size_t lens[] = {4, 8, 16, 32, 64, 256, 1024};
+    char*  buf    = malloc(1024 + 1);
+    for (size_t i = 0; i < 1024; i++) {
+        buf[i] = 'a' + i % 26;
+    }
+    for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+        size_t   len = lens[l], rounds = (256 << 20) / len;
+        uint64_t sink = 0;
+        buf[len]      = 0;
+        clock_t tic   = clock();
+        for (size_t i = 0; i < rounds; i++) {
+            buf[0] = 'a' + i % 26;
+            sink += bkdr_hash(buf);
+        }
+        clock_t toc = clock();
+        double  bkdr = (256.0 / 1024) / ((double) (toc - tic) / CLOCKS_PER_SEC);
+        tic          = clock();
+        for (size_t i = 0; i < rounds; i++) {
+            buf[0] = 'a' + i % 26;
+            sink += wyhash(buf, len, i);
+        }
+        toc       = clock();
+        double wy = (256.0 / 1024) / ((double) (toc - tic) / CLOCKS_PER_SEC);
+        buf[len]  = 'a' + len % 26;
+        printf("len = %4zu: bkdr = %5.2f GB/s, chi2/df = %4.2f, avalanche = %4.2f | "
+               "wyhash = %5.2f GB/s, chi2/df = %4.2f, avalanche = %4.2f [%u]\n",
+               len, bkdr, hash_quality(len, 0), hash_avalanche(len, 0), wy, hash_quality(len, 1),
+               hash_avalanche(len, 1), (uint32_t) sink & 1);
+    }
+    free(buf);
+}
+
+#define BATCH 256
+
+void benchmark_batch(uint32_t flags) {
+    printf("%-7s N = %d, ", engine_name(flags), 4 * N);
+    //
+    char(*strs)[12] = malloc(4 * N * sizeof(*strs));
+    void** keys     = malloc(4 * N * sizeof(void*));
+    void** values   = malloc(4 * N * sizeof(void*));
+    for (size_t i = 0; i < 4 * N; i++) {
+        sprintf(strs[i], "%d", (int) i);
+        keys[i] = strs[i];
+    }
+    hashmap_t map;
+    hashmap_init_with(&map, 16, NULL, NULL, NULL, flags);
+    //
+    clock_t tic = clock();
+    for (size_t i = 0; i < 4 * N; i += BATCH) {
+        hashmap_insert_batch(&map, &keys[i], &keys[i], BATCH, true);
+    }
+    clock_t toc = clock();
+    printf("insert_batch = %.1f ms, ", 1000 * (double) (toc - tic) / CLOCKS_PER_SEC);
+    // Lookups go in a scattered order so the table does not stay in cache between neighbouring keys.
+    for (size_t i = 0; i < 4 * N; i++) {
+        keys[i] = strs[(i * 2654435761u) % (4 * N)];
+    }
+    tic = clock();
+    for (size_t i = 0; i < 4 * N; i++) {
+        values[i] = hashmap_get(&map, keys[i], NULL);
+    }
+    toc = clock();
+    printf("get = %.1f ms, ", 1000 * (double) (toc - tic) / CLOCKS_PER_SEC);
+    tic = clock();
+    for (size_t i = 0; i < 4 * N; i += BATCH) {
+        hashmap_get_batch(&map, &keys[i], &values[i], BATCH, NULL);
+    }
+    toc = clock();
+    printf("get_batch = %.1f ms\n", 1000 * (double) (toc - tic) / CLOCKS_PER_SEC);
+    for (size_t i = 0; i < 4 * N; i++) {
+        if (values[i] != keys[i])
+            printf("!!![ERROR]!!!");
+    }
+    hashmap_destroy(&map);
+    free(values);
+    free(keys);
+    free(strs);
+}
+
+// 16-byte session ids: stored inline as raw bytes, against the same ids spelled out as 32-character hex strings.
+void benchmark_binary() {
+    printf("binary  N = %d, ", N);
+    //
+    uint8_t(*ids)[16] = malloc(N * sizeof(*ids));
+    char(*hex)[33]    = malloc(N * sizeof(*hex));
+    for (size_t i = 0; i < N; i++) {
+        // Only the generator's top bits have a long enough period to keep a million ids distinct.
+        for (size_t j = 0; j < 16; j++) {
+            ids[i][j] = (uint8_t) (randu32() >> 23);
+            sprintf(&hex[i][2 * j], "%02x", ids[i][j]);
+        }
+    }
+    hashmap_t map;
+    hashmap_init_with(&map, 16, NULL, NULL, NULL, HASHMAP_BINARY_KEYS);
+    clock_t tic = clock();
+    for (size_t i = 0; i < N; i++) {
+        hashmap_insert_bytes(&map, ids[i], 16, (void*) (i + 1), true);
+    }
+    for (size_t i = 0; i < N; i++) {
+        if (hashmap_get_bytes(&map, ids[i], 16, NULL) != (void*) (i + 1))
+            printf("!!![ERROR]!!!");
+    }
+    clock_t toc = clock();
+    printf("bytes = %.1f ms, ", 1000 * (double) (toc - tic) / CLOCKS_PER_SEC);
+    hashmap_destroy(&map);
+    //
+    hashmap_init(&map, 16, NULL, NULL, NULL);
+    tic = clock();
+    for (size_t i = 0; i < N; i++) {
+        hashmap_insert(&map, hex[i], (void*) (i + 1), true);
+    }
+    for (size_t i = 0; i < N; i++) {
+        if (hashmap_get(&map, hex[i], NULL) != (void*) (i + 1))
+            printf("!!![ERROR]!!!");
+    }
+    toc = clock();
+    printf("hex strings = %.1f ms\n", 1000 * (double) (toc - tic) / CLOCKS_PER_SEC);
+    hashmap_destroy(&map);
+    free(hex);
+    free(ids);
+}
+
+uint32_t id_hash(void* p) {
+    return (uint32_t) wyhash_u64((uint64_t) (uintptr_t) p, 0);
+}
+
+int id_equal(void* a, void* b) {
+    return a != b;
+}
+
+// The same 64-bit ids as decimal strings, as pointers with callbacks, and as inline integer keys.
+void benchmark_u64() {
+    printf("u64     N = %d, ", N);
+    //
+    uint64_t* ids  = malloc(N * sizeof(*ids));
+    char(*dec)[24] = malloc(N * sizeof(*dec));
+    for (size_t i = 0; i < N; i++) {
+        ids[i] = (((uint64_t) randu32() << 32 | randu32()) & ~0xFFFFFull) | i;  // The low bits keep them distinct.
+        sprintf(dec[i], "%llu", (unsigned long long) ids[i]);
+    }
+    hashmap_t map;
+    hashmap_init(&map, 16, NULL, NULL, NULL);
+    clock_t tic = clock();
+    for (size_t i = 0; i < N; i++) {
+        hashmap_insert(&map, dec[i], (void*) (i + 1), true);
+    }
+    for (size_t i = 0; i < N; i++) {
+        if (hashmap_get(&map, dec[i], NULL) != (void*) (i + 1))
+            printf("!!![ERROR]!!!");
+    }
+    clock_t toc = clock();
+    printf("strings = %.1f ms, ", 1000 * (double) (toc - tic) / CLOCKS_PER_SEC);
+    hashmap_destroy(&map);
+    //
+    hashmap_init(&map, 16, id_hash, id_equal, NULL);
+    tic = clock();
+    for (size_t i = 0; i < N; i++) {
+        hashmap_insert(&map, (void*) (uintptr_t) ids[i], (void*) (i + 1), true);
+    }
+    for (size_t i = 0; i < N; i++) {
+        if (hashmap_get(&map, (void*) (uintptr_t) ids[i], NULL) != (void*) (i + 1))
+            printf("!!![ERROR]!!!");
+    }
+    toc = clock();
+    printf("callbacks = %.1f ms, ", 1000 * (double) (toc - tic) / CLOCKS_PER_SEC);
+    hashmap_destroy(&map);
+    //
+    hashmap_init_with(&map, 16, NULL, NULL, NULL, HASHMAP_U64_KEYS);
+    tic = clock();
+    for (size_t i = 0; i < N; i++) {
+        hashmap_insert_u64(&map, ids[i], (void*) (i + 1), true);
+    }
+    for (size_t i = 0; i < N; i++) {
+        if (hashmap_get_u64(&map, ids[i], NULL) != (void*) (i + 1))
+            printf("!!![ERROR]!!!");
+    }
+    toc = clock();
+    printf("u64 keys = %.1f ms\n", 1000 * (double) (toc - tic) / CLOCKS_PER_SEC);
+    hashmap_destroy(&map);
+    free(dec);
+    free(ids);
+}
+
+// Hits and misses timed apart: a miss walks the whole chain, a hit stops at its key and reads the value.
+void sum_values(void* key, void* value, void* args) {
+    *(uintptr_t*) args += (uintptr_t) value;
+}
+
+// Half the entries are removed first, so both scans have free slots to step over.
+void benchmark_iterate() {
+    printf("iterate N = %d, ", N);
+    //
+    char(*keys)[24] = malloc(N * sizeof(*keys));
+    hashmap_t map;
+    hashmap_init(&map, 16, NULL, NULL, NULL);
+    uintptr_t expect = 0;
+    for (size_t i = 0; i < N; i++) {
+        sprintf(keys[i], "%zu", i);
+        hashmap_insert(&map, keys[i], (void*) (i + 1), true);
+    }
+    for (size_t i = 0; i < N; i++) {
+        if (i & 1)
+            expect += i + 1;
+        else
+            hashmap_remove(&map, keys[i]);
+    }
+    uintptr_t sum = 0;
+    clock_t   tic = clock();
+    for (int round = 0; round < 10; round++) {
+        hashmap_foreach(&map, sum_values, &sum);
+    }
+    clock_t toc = clock();
+    printf("foreach = %.1f ms, ", 1000 * (double) (toc - tic) / CLOCKS_PER_SEC);
+    if (sum != 10 * expect)
+        printf("!!![ERROR]!!!");
+    //
+    void* ks[256];
+    void* vs[256];
+    sum = 0;
+    tic = clock();
+    for (int round = 0; round < 10; round++) {
+        hashmap_cursor_t cursor;
+        hashmap_cursor_init(&map, &cursor);
+        for (int n; (n = hashmap_cursor_fetch(&map, &cursor, ks, vs, 256)) > 0;) {
+            for (int i = 0; i < n; i++) {
+                sum += (uintptr_t) vs[i];
+            }
+        }
+    }
+    toc = clock();
+    printf("cursor = %.1f ms\n", 1000 * (double) (toc - tic) / CLOCKS_PER_SEC);
+    if (sum != 10 * expect)
+        printf("!!![ERROR]!!!");
+    hashmap_destroy(&map);
+    free(keys);
+}
+
+void benchmark_build() {
+    printf("build   N = %d, ", N);
+    //
+    char(*dec)[24] = malloc(N * sizeof(*dec));
+    void** keys    = malloc(N * sizeof(void*));
+    void** values  = malloc(N * sizeof(void*));
+    for (size_t i = 0; i < N; i++) {
+        sprintf(dec[i], "%llu", (unsigned long long) ((uint64_t) randu32() << 20 | i));
+        keys[i]   = dec[i];
+        values[i] = (void*) (i + 1);
+    }
+    hashmap_t map;
+    hashmap_init(&map, 16, NULL, NULL, NULL);
+    clock_t tic = clock();
+    for (size_t i = 0; i < N; i++) {
+        hashmap_insert(&map, keys[i], values[i], true);
+    }
+    clock_t toc = clock();
+    printf("inserts = %.1f ms, build", 1000 * (double) (toc - tic) / CLOCKS_PER_SEC);
+    hashmap_destroy(&map);
+    // Wall time, as the build runs on several threads.
+    for (uint32_t nthreads = 1; nthreads <= 8; nthreads <<= 1) {
+        hashmap_init(&map, 16, NULL, NULL, NULL);
+        struct timespec tic, toc;
+        clock_gettime(CLOCK_MONOTONIC, &tic);
+        if (hashmap_build(&map, keys, values, N, nthreads) != 0 || hashmap_size(&map) != N)
+            printf("!!![ERROR]!!!");
+        clock_gettime(CLOCK_MONOTONIC, &toc);
+        printf(" %ut = %.1f ms", nthreads, (toc.tv_sec - tic.tv_sec) * 1e3 + (toc.tv_nsec - tic.tv_nsec) / 1e6);
+        hashmap_destroy(&map);
+    }
+    printf("\n");
+    free(values);
+    free(keys);
+    free(dec);
+}
+
+// Explicit resizes of a full map to 4x, with the old buckets relinked on one thread or on one per CPU.
+void benchmark_resize() {
+    printf("resize  N = %d,", N);
+    //
+    char(*dec)[24] = malloc(N * sizeof(*dec));
+    for (size_t i = 0; i < N; i++) {
+        sprintf(dec[i], "%zu", i);
+    }
+    uint32_t flags[] = {0, HASHMAP_PARALLEL_RESIZE};
+    for (size_t f = 0; f < sizeof(flags) / sizeof(flags[0]); f++) {
+        hashmap_t map;
+        hashmap_init_with(&map, 16, NULL, NULL, NULL, flags[f]);
+        for (size_t i = 0; i < N; i++) {
+            hashmap_insert(&map, dec[i], (void*) (i + 1), true);
+        }
+        struct timespec tic, toc;
+        clock_gettime(CLOCK_MONOTONIC, &tic);
+        hashmap_resize(&map, hashmap_capacity(&map) * 4);
+        clock_gettime(CLOCK_MONOTONIC, &toc);
+        for (size_t i = 0; i < N; i++) {
+            if (hashmap_get(&map, dec[i], NULL) != (void*) (i + 1))
+                printf("!!![ERROR]!!!");
+        }
+        printf(" %s = %.1f ms", flags[f] ? "parallel" : "serial",
+               (toc.tv_sec - tic.tv_sec) * 1e3 + (toc.tv_nsec - tic.tv_nsec) / 1e6);
+        hashmap_destroy(&map);
+    }
+    printf("\n");
+    free(dec);
+}
+
+// A bulk expiry leaves 5% of the keys. Lookups of the survivors are timed before and after hashmap_compact.
+void benchmark_compact() {
+    printf("compact N = %d, ", N);
+    //
+    char(*dec)[24] = malloc(N * sizeof(*dec));
+    hashmap_t map;
+    hashmap_init(&map, 16, NULL, NULL, NULL);
+    for (size_t i = 0; i < N; i++) {
+        sprintf(dec[i], "%zu", i);
+        hashmap_insert(&map, dec[i], (void*) (i + 1), true);
+    }
+    for (size_t i = 0; i < N; i++) {
+        if (i % 20)
+            hashmap_remove(&map, dec[i]);
+    }
+    // Survivors are looked up in a random order, so every lookup lands on a chain far from the last one, as a sparse
+    // table scatters them.
+    size_t* order = malloc(N / 20 * sizeof(*order));
+    for (size_t i = 0; i < N / 20; i++) {
+        size_t j = randu32() % (i + 1);
+        order[i] = order[j];
+        order[j] = i * 20;
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        hashmap_stats_t stats;
+        hashmap_stats(&map, &stats);
+        clock_t tic = clock();
+        for (int round = 0; round < 20; round++) {
+            for (size_t i = 0; i < N / 20; i++) {
+                if (hashmap_get(&map, dec[order[i]], NULL) != (void*) (order[i] + 1))
+                    printf("!!![ERROR]!!!");
+            }
+        }
+        clock_t toc = clock();
+        printf("%s: table = %.1f MB, hits = %.1f ms", pass ? "compacted" : "sparse", stats.table_bytes / 1048576.0,
+               1000 * (double) (toc - tic) / CLOCKS_PER_SEC);
+        if (pass == 0) {
+            tic = clock();
+            hashmap_compact(&map);
+            toc = clock();
+            printf(", compact = %.1f ms, ", 1000 * (double) (toc - tic) / CLOCKS_PER_SEC);
+        }
+    }
+    printf("\n");
+    hashmap_destroy(&map);
+    free(order);
+    free(dec);
+}
+
+void count_eviction(void* key, void* value, void* args) {
+    (*(size_t*) args)++;
+}
+
+void benchmark_cache() {
+    printf("cache   N = %d", N);
+    //
+    size_t    n   = 4 * (size_t) N;
+    uint64_t* ids = malloc(n * sizeof(*ids));
+    for (size_t i = 0; i < n; i++) {
+        double u = randu32() / 4294967296.0;
+        ids[i]   = (uint64_t) (u * u * u * N);  // Skewed towards the low keys, like the hot keys of a real cache.
+    }
+    for (uint32_t capacity = N / 100; capacity <= N / 10; capacity *= 10) {
+        size_t          hits = 0, evictions = 0;
+        hashmap_cache_t cache = {.max_entries = capacity, .evict = count_eviction, .args = &evictions};
+        hashmap_t       map;
+        hashmap_init_with(&map, 16, NULL, NULL, NULL, HASHMAP_U64_KEYS | HASHMAP_LRU);
+        hashmap_set_cache(&map, &cache);
+        clock_t tic = clock();
+        for (size_t i = 0; i < n; i++) {
+            if (hashmap_get_u64(&map, ids[i], NULL))
+                hits++;
+            else
+                hashmap_insert_u64(&map, ids[i], (void*) (uintptr_t) (ids[i] + 1), false);
+        }
+        clock_t toc = clock();
+        // Every miss inserts, and every insert is either still there or evicted.
+        if (hashmap_size(&map) > capacity || hits + evictions + hashmap_size(&map) != n)
+            printf("!!![ERROR]!!!");
+        printf(", capacity %u: hits = %.1f%%, %.1f Mops/s", capacity, 100.0 * hits / n,
+               n / (1e6 * (toc - tic) / CLOCKS_PER_SEC));
+        hashmap_destroy(&map);
+    }
+    printf("\n");
+    free(ids);
+}
+
+void benchmark_lookup(uint32_t flags) {
+    printf("%-7s N = %d, ", engine_name(flags), 4 * N);
+    //
+    char(*strs)[12]   = malloc(4 * N * sizeof(*strs));
+    char(*absent)[12] = malloc(4 * N * sizeof(*absent));
+    for (size_t i = 0; i < 4 * N; i++) {
+        sprintf(strs[i], "%d", (int) i);
+        sprintf(absent[i], "-%d", (int) i);
+    }
+    hashmap_t map;
+    hashmap_init_with(&map, 16, NULL, NULL, NULL, flags);
+    for (size_t i = 0; i < 4 * N; i++) {
+        hashmap_insert(&map, strs[i], strs[i], true);
+    }
+    // Scattered order, so neighbouring lookups do not share cache lines.
+    int     fd  = dtlb_open();
+    clock_t tic = clock();
+    for (size_t i = 0; i < 4 * N; i++) {
+        char* key = strs[(i * 2654435761u) % (4 * N)];
+        if (hashmap_get(&map, key, NULL) != key)
+            printf("!!![ERROR]!!!");
+    }
+    clock_t toc = clock();
+    printf("hit = %.1f ms, ", 1000 * (double) (toc - tic) / CLOCKS_PER_SEC);
+    if (fd >= 0)
+        printf("dTLB misses = %lld, ", dtlb_read(fd));
+    else
+        printf("dTLB misses = n/a, ");
+    printf("huge pages = %zu kB, ", anon_huge_kb());
+    tic = clock();
+    for (size_t i = 0; i < 4 * N; i++) {
+        if (hashmap_get(&map, absent[(i * 2654435761u) % (4 * N)], NULL) != NULL)
+            printf("!!![ERROR]!!!");
+    }
+    toc = clock();
+    printf("miss = %.1f ms\n", 1000 * (double) (toc - tic) / CLOCKS_PER_SEC);
+    hashmap_destroy(&map);
+    free(absent);
+    free(strs);
+}
+
+// Each engine filled as far as it goes without growing, 3/4 for chains and 9/10 for Robin Hood, then asked for keys it
+// does not hold, which is where open addressing has to prove itself.
+void benchmark_misses(uint32_t flags) {
+    hashmap_t map;
+    hashmap_init_with(&map, 4 * N, NULL, NULL, NULL, flags);
+    uint32_t capacity = hashmap_capacity(&map);
+    uint32_t n        = flags & HASHMAP_ENGINE_ROBINHOOD ? capacity / 10 * 9 : capacity / 4 * 3;
+    printf("%-7s N = %u, ", engine_name(flags), n);
+    //
+    char(*strs)[12]   = malloc(n * sizeof(*strs));
+    char(*absent)[12] = malloc(n * sizeof(*absent));
+    for (size_t i = 0; i < n; i++) {
+        sprintf(strs[i], "%d", (int) i);
+        sprintf(absent[i], "-%d", (int) i);
+    }
+    for (size_t i = 0; i < n; i++) {
+        hashmap_insert(&map, strs[i], strs[i], true);
+    }
+    hashmap_stats_t stats;
+    hashmap_stats(&map, &stats);
+    clock_t tic = clock();
+    for (size_t i = 0; i < n; i++) {
+        if (hashmap_get(&map, absent[(i * 2654435761u) % n], NULL) != NULL)
+            printf("!!![ERROR]!!!");
+    }
+    clock_t toc = clock();
+    printf("load = %.1f%%, longest = %u, table = %.1f MB, miss = %.1f ms\n", 100 * stats.load_factor,
+           stats.longest_chain, stats.table_bytes / 1048576.0, 1000 * (double) (toc - tic) / CLOCKS_PER_SEC);
+    hashmap_destroy(&map);
+    free(absent);
+    free(strs);
+}
+
+// Bytes the table spends per key, keys themselves not counted, from a size just past a grow to a nearly full table.
+void benchmark_memory() {
+    size_t sizes[] = {1000, 3073, 100000, 786433, 1000000, 4000000};
+    size_t n       = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+    char(*dec)[12] = malloc(n * sizeof(*dec));
+    for (size_t i = 0; i < n; i++) {
+        sprintf(dec[i], "%zu", i);
+    }
+    uint32_t    flags[] = {0, HASHMAP_COMPACT, HASHMAP_COMPACT, HASHMAP_ENGINE_ROBINHOOD};
+    uint32_t    loads[] = {75, 75, 100, 0};
+    const char* names[] = {"chained", "compact", "compact 100%", "robin"};
+    for (size_t f = 0; f < sizeof(flags) / sizeof(flags[0]); f++) {
+        printf("memory  %-12s", names[f]);
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            hashmap_t map;
+            hashmap_init_with(&map, 16, NULL, NULL, NULL, flags[f]);
+            if (loads[f])
+                hashmap_set_load_factor(&map, loads[f]);
+            clock_t tic = clock();
+            for (size_t i = 0; i < sizes[s]; i++) {
+                hashmap_insert(&map, dec[i], (void*) (i + 1), true);
+            }
+            clock_t toc = clock();
+            for (size_t i = 0; i < sizes[s]; i++) {
+                size_t k = (i * 2654435761u) % sizes[s];
+                if (hashmap_get(&map, dec[k], NULL) != (void*) (k + 1))
+                    printf("!!![ERROR]!!!");
+            }
+            clock_t         hit = clock();
+            hashmap_stats_t stats;
+            hashmap_stats(&map, &stats);
+            printf(" | %zu: %.1f B/key, %.0f/%.0f ns", sizes[s],
+                   (double) (stats.table_bytes + stats.ownpool_bytes) / sizes[s],
+                   1e9 * (double) (toc - tic) / CLOCKS_PER_SEC / sizes[s],
+                   1e9 * (double) (hit - toc) / CLOCKS_PER_SEC / sizes[s]);
+            hashmap_destroy(&map);
+        }
+        printf("\n");
+    }
+    free(dec);
+}
+
+// A cold start: the map built again from its keys, against a snapshot mapped back in and probed once through.
+void benchmark_snapshot() {
+    printf("snapshot N = %d, ", 4 * N);
+    //
+    char(*strs)[12] = malloc(4 * N * sizeof(*strs));
+    for (size_t i = 0; i < 4 * N; i++) {
+        sprintf(strs[i], "%d", (int) i);
+    }
+    hashmap_t map;
+    clock_t tic = clock();
+    hashmap_init(&map, 16, NULL, NULL, NULL);
+    for (size_t i = 0; i < 4 * N; i++) {
+        hashmap_insert(&map, strs[i], (void*) (i + 1), true);
+    }
+    clock_t toc = clock();
+    printf("build = %.1f ms, ", 1000 * (double) (toc - tic) / CLOCKS_PER_SEC);
+    tic = clock();
+    if (hashmap_save(&map, "/tmp/test-hashmap.snapshot") != 0)
+        printf("!!![ERROR]!!!");
+    toc = clock();
+    printf("save = %.1f ms, ", 1000 * (double) (toc - tic) / CLOCKS_PER_SEC);
+    hashmap_destroy(&map);
+    tic = clock();
+    if (hashmap_open_mmap(&map, "/tmp/test-hashmap.snapshot", NULL, NULL, false) != 0)
+        printf("!!![ERROR]!!!");
+    toc = clock();
+    printf("open = %.3f ms, ", 1000 * (double) (toc - tic) / CLOCKS_PER_SEC);
+    tic = clock();
+    for (size_t i = 0; i < 4 * N; i++) {
+        if (hashmap_get(&map, strs[(i * 2654435761u) % (4 * N)], NULL) != (void*) ((i * 2654435761u) % (4 * N) + 1))
+            printf("!!![ERROR]!!!");
+    }
+    toc = clock();
+    printf("first pass = %.1f ms\n", 1000 * (double) (toc - tic) / CLOCKS_PER_SEC);
+    hashmap_destroy(&map);
+    unlink("/tmp/test-hashmap.snapshot");
+    free(strs);
+}
+
+// Values overwritten at random, with no view and with one taken just before. A view costs the first write to each page
+// a page copy, so copied shows the write amplification and the slowdown fades as the writes land on saved pages.
+void benchmark_views() {
+    printf("views   N = %d, ", N);
+    //
+    char(*dec)[24] = malloc(N * sizeof(*dec));
+    hashmap_t map;
+    hashmap_init(&map, 16, NULL, NULL, NULL);
+    for (size_t i = 0; i < N; i++) {
+        sprintf(dec[i], "%zu", i);
+        hashmap_insert(&map, dec[i], (void*) (i + 1), true);
+    }
+    struct timespec tic, toc;
+    clock_gettime(CLOCK_MONOTONIC, &tic);
+    hashmap_view_t views[64];
+    for (int v = 0; v < 64; v++) {
+        if (hashmap_snapshot(&map, &views[v]) != 0)
+            printf("!!![ERROR]!!!");
+    }
+    clock_gettime(CLOCK_MONOTONIC, &toc);
+    printf("snapshot = %.2f us, ", ((toc.tv_sec - tic.tv_sec) * 1e9 + (toc.tv_nsec - tic.tv_nsec)) / 1e3 / 64);
+    for (int v = 0; v < 64; v++) {
+        hashmap_view_release(&views[v]);
+    }
+    size_t writes[] = {N / 1000, N / 100, N / 10, N};
+    for (size_t w = 0; w < sizeof(writes) / sizeof(writes[0]); w++) {
+        for (int live = 0; live < 2; live++) {
+            if (live && hashmap_snapshot(&map, &views[0]) != 0)
+                printf("!!![ERROR]!!!");
+            clock_gettime(CLOCK_MONOTONIC, &tic);
+            for (size_t i = 0; i < writes[w]; i++) {
+                size_t k = (i * 2654435761u) % N;
+                hashmap_set(&map, dec[k], (void*) (k + 2 + live));
+            }
+            clock_gettime(CLOCK_MONOTONIC, &toc);
+            double ns = ((toc.tv_sec - tic.tv_sec) * 1e9 + (toc.tv_nsec - tic.tv_nsec)) / writes[w];
+            if (!live) {
+                printf("\n        %7zu writes: plain = %.1f ns/op", writes[w], ns);
+                continue;
+            }
+            size_t k = (writes[w] - 1) * 2654435761u % N;
+            if (hashmap_view_get(&views[0], dec[k], NULL) != (void*) (k + 2))
+                printf("!!![ERROR]!!!");
+            printf(", viewed = %.1f ns/op, copied = %.2f MB", ns, hashmap_view_copied(&views[0]) / 1048576.0);
+            hashmap_view_release(&views[0]);
+        }
+    }
+    printf("\n");
+    hashmap_destroy(&map);
+    free(dec);
+}
+
+// Keys of test_views fall into 64 buckets when the map takes the hash from us, so most buckets turn into skiplists.
+uint32_t view_hash(void* key) {
+    return (uint32_t) atoi((char*) key) % 64;
+}
+
+int view_equal(void* a, void* b) {
+    return strcmp((char*) a, (char*) b);
+}
+
+struct view_check {
+    hashmap_view_t* view;
+    uint32_t flags, n, seen, errors, done;
+    char (*dec)[24];
+    void** values;  // At the snapshot, NULL for a key the map did not hold.
+};
+
+int view_insert(hashmap_t* map, uint32_t flags, char* key, uint32_t i, void* value) {
+    if (flags & HASHMAP_U64_KEYS)
+        return hashmap_insert_u64(map, i + 1, value, true);
+    if (flags & HASHMAP_BINARY_KEYS)
+        return hashmap_insert_bytes(map, key, strlen(key), value, true);
+    return hashmap_insert(map, key, value, true);
+}
+
+int view_remove(hashmap_t* map, uint32_t flags, char* key, uint32_t i) {
+    if (flags & HASHMAP_U64_KEYS)
+        return hashmap_remove_u64(map, i + 1);
+    if (flags & HASHMAP_BINARY_KEYS)
+        return hashmap_remove_bytes(map, key, strlen(key));
+    return hashmap_remove(map, key);
+}
+
+void* view_lookup(struct view_check* check, uint32_t i) {
+    if (check->flags & HASHMAP_U64_KEYS)
+        return hashmap_view_get_u64(check->view, i + 1, NULL);
+    if (check->flags & HASHMAP_BINARY_KEYS)
+        return hashmap_view_get_bytes(check->view, check->dec[i], strlen(check->dec[i]), NULL);
+    return hashmap_view_get(check->view, check->dec[i], NULL);
+}
+
+void view_visit(void* key, void* value, void* args) {
+    struct view_check* check = (struct view_check*) args;
+    char buf[24] = {0};
+    uint32_t i;
+    if (check->flags & HASHMAP_U64_KEYS) {
+        i = (uint32_t) ((uintptr_t) key - 1);
+    } else if (check->flags & HASHMAP_BINARY_KEYS) {
+        memcpy(buf, hashmap_key_data(key), hashmap_key_length(key) < 23 ? hashmap_key_length(key) : 23);
+        i = (uint32_t) atoi(buf);
+    } else {
+        i = (uint32_t) atoi((char*) key);
+    }
+    check->seen++;
+    if (i >= check->n || check->values[i] == NULL || check->values[i] != value)
+        check->errors++;
+}
+
+// Every key looked up, the size and a full walk of the view, against the values at the snapshot.
+void view_verify(struct view_check* check) {
+    uint32_t size = 0;
+    for (uint32_t i = 0; i < check->n; i++) {
+        void* key = check->flags & HASHMAP_U64_KEYS ? (void*) (uintptr_t) (i + 1) : check->dec[i];
+        size += check->values[i] != NULL;
+        if (view_lookup(check, i) != check->values[i] ||
+            hashmap_view_exists(check->view, key) != (check->values[i] != NULL))
+            check->errors++;
+    }
+    check->seen = 0;
+    hashmap_view_foreach(check->view, view_visit, check);
+    if (hashmap_view_size(check->view) != size || check->seen != size)
+        check->errors++;
+}
+
+void* view_reader(void* p) {
+    struct view_check* check = (struct view_check*) p;
+    for (int round = 0; round < 10; round++) {
+        view_verify(check);
+    }
+    __atomic_store_n(&check->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Random inserts, updates and removes, mirrored in values.
+void view_churn(hashmap_t* map, uint32_t flags, char (*dec)[24], void** values, uint32_t n, uint32_t* seed) {
+    *seed = *seed * 1103515245 + 12345;
+    uint32_t i = (*seed >> 8) % n;
+    if (*seed & 0x10000) {
+        values[i] = (void*) (uintptr_t) (*seed | 1);
+        if (view_insert(map, flags, dec[i], i, values[i]) != 0)
+            printf("!!![ERROR]!!!");
+    } else if (view_remove(map, flags, dec[i], i) == 0) {
+        values[i] = NULL;
+    }
+}
+
+// Views checked key by key and walked whole against the map as it was at their snapshot, after writes to lists and
+// skiplists, clear, resize and compact, and by a reader thread while the map changes under it. A view taken first
+// stays live through all of it.
+void test_views(uint32_t flags) {
+    const char* steps[] = {"writes", "clear", "resize", "compact", "threads"};
+    uint32_t    n       = 20000, seed = 1;
+    char(*dec)[24]      = malloc(n * sizeof(*dec));
+    void** values       = calloc(n, sizeof(void*));
+    void** first        = malloc(n * sizeof(void*));
+    void** at           = malloc(n * sizeof(void*));
+    hashmap_t map;
+    bool      own_hash = !(flags & (HASHMAP_BINARY_KEYS | HASHMAP_U64_KEYS));
+    hashmap_init_with(&map, 16, own_hash ? view_hash : NULL, own_hash ? view_equal : NULL, NULL, flags);
+    for (uint32_t i = 0; i < n; i++) {
+        sprintf(dec[i], "%u", i);
+        if (i % 2 == 0)
+            values[i] = (void*) (uintptr_t) (i + 1), view_insert(&map, flags, dec[i], i, values[i]);
+    }
+    hashmap_view_t    oldest, view;
+    struct view_check kept = {&oldest, flags, n, 0, 0, 0, dec, first};
+    memcpy(first, values, n * sizeof(void*));
+    if (hashmap_snapshot(&map, &oldest) != 0)
+        printf("!!![ERROR]!!!");
+    uint32_t errors = 0;
+    for (size_t step = 0; step < sizeof(steps) / sizeof(steps[0]); step++) {
+        struct view_check check = {&view, flags, n, 0, 0, 0, dec, at};
+        memcpy(at, values, n * sizeof(void*));
+        if (hashmap_snapshot(&map, &view) != 0)
+            printf("!!![ERROR]!!!");
+        if (step == 1) {
+            hashmap_clear(&map);
+            memset(values, 0, n * sizeof(void*));
+        } else if (step == 2) {
+            hashmap_resize(&map, hashmap_capacity(&map) * 4);
+        } else if (step == 3) {
+            for (uint32_t i = 0; i < n; i++) {
+                if (i % 10 && view_remove(&map, flags, dec[i], i) == 0)
+                    values[i] = NULL;
+            }
+            hashmap_compact(&map);
+        }
+        pthread_t reader;
+        if (step == 4)
+            pthread_create(&reader, NULL, view_reader, &check);
+        for (uint32_t i = 0; i < 4 * n || (step == 4 && !__atomic_load_n(&check.done, __ATOMIC_ACQUIRE)); i++) {
+            view_churn(&map, flags, dec, values, n, &seed);
+        }
+        if (step == 4)
+            pthread_join(reader, NULL);
+        view_verify(&check);
+        hashmap_view_release(&view);
+        for (uint32_t i = 0; i < n; i++) {
+            void* value = flags & HASHMAP_U64_KEYS      ? hashmap_get_u64(&map, i + 1, NULL)
+                          : flags & HASHMAP_BINARY_KEYS ? hashmap_get_bytes(&map, dec[i], strlen(dec[i]), NULL)
+                                                        : hashmap_get(&map, dec[i], NULL);
+            check.errors += value != values[i];
+        }
+        if (check.errors)
+            printf("views   %s: %u errors !!![ERROR]!!!\n", steps[step], check.errors);
+        errors += check.errors;
+    }
+    view_verify(&kept);
+    hashmap_view_release(&oldest);
+    errors += kept.errors;
+    printf("views   %s keys, N = %u: %s\n",
+           flags & HASHMAP_U64_KEYS ? "u64" : flags & HASHMAP_BINARY_KEYS ? "binary" : "skiplist", n,
+           errors ? "!!![ERROR]!!!" : "writes, clear, resize, compact and a reader thread ok");
+    hashmap_destroy(&map);
+    free(dec);
+    free(values);
+    free(first);
+    free(at);
+}
+
+// dTLB load misses counted from here on, or -1 where the PMU is not available to us.
+int dtlb_open() {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size           = sizeof(attr);
+    attr.type           = PERF_TYPE_HW_CACHE;
+    attr.config         = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                          (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+long long dtlb_read(int fd) {
+    long long count = -1;
+    if (read(fd, &count, sizeof(count)) != sizeof(count))
+        count = -1;
+    close(fd);
+    return count;
+}
+
+// Anonymous memory the kernel backs with transparent huge pages.
+size_t anon_huge_kb() {
+    FILE* f = fopen("/proc/self/smaps_rollup", "r");
+    char line[256];
+    size_t kb = 0;
+    while (f && fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "AnonHugePages: %zu kB", &kb) == 1)
+            break;
+    }
+    if (f)
+        fclose(f);
+    return kb;
+}
+
+// Small objects freed and allocated again, in the sizes skiplist nodes and boxed keys come in.
+void benchmark_pool() {
+    printf("pool    N = %d, ", 4 * N);
+    //
+    void** ptrs = malloc(256 * sizeof(void*));
+    memory_pool_t pool;
+    memory_pool_init(&pool, 8);
+    clock_t tic = clock();
+    for (size_t i = 0; i < 4 * N; i += 256) {
+        for (size_t j = 0; j < 256; j++) {
+            ptrs[j] = mpalloc(&pool, 24 + 8 * ((i + j) % 16));
+        }
+        for (size_t j = 0; j < 256; j++) {
+            mpfree(&pool, ptrs[j]);
+        }
+    }
+    clock_t toc = clock();
+    printf("mpalloc = %.1f ms (%zu bytes reclaimable), ", 1000 * (double) (toc - tic) / CLOCKS_PER_SEC,
+           memory_pool_reclaimable(&pool));
+    memory_pool_destroy(&pool);
+    tic = clock();
+    for (size_t i = 0; i < 4 * N; i += 256) {
+        for (size_t j = 0; j < 256; j++) {
+            ptrs[j] = malloc(24 + 8 * ((i + j) % 16));
+        }
+        for (size_t j = 0; j < 256; j++) {
+            free(ptrs[j]);
+        }
+    }
+    toc = clock();
+    printf("malloc = %.1f ms\n", 1000 * (double) (toc - tic) / CLOCKS_PER_SEC);
+    free(ptrs);
+}
+
+int compare_double(const void* a, const void* b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+void benchmark_latency(uint32_t flags) {
+    printf("%-11s N = %d, ", flags & HASHMAP_INCREMENTAL_RESIZE ? "incremental" : "rehash", 4 * N);
+    //
+    char(*strs)[12] = malloc(4 * N * sizeof(*strs));
+    double* lat     = malloc(4 * N * sizeof(double));
+    for (size_t i = 0; i < 4 * N; i++) {
+        sprintf(strs[i], "%d", (int) i);
+    }
+    //
+    hashmap_t map;
+    hashmap_init_with(&map, 16, NULL, NULL, NULL, flags);
+    for (size_t i = 0; i < 4 * N; i++) {
+        struct timespec tic, toc;
+        clock_gettime(CLOCK_MONOTONIC, &tic);
+        hashmap_insert(&map, strs[i], strs[i], true);
+        clock_gettime(CLOCK_MONOTONIC, &toc);
+        lat[i] = (toc.tv_sec - tic.tv_sec) * 1e6 + (toc.tv_nsec - tic.tv_nsec) / 1e3;
+    }
+    hashmap_destroy(&map);
+    //
+    qsort(lat, 4 * N, sizeof(double), compare_double);
+    printf("insert p99.9 = %.3f us, max = %.3f us\n", lat[(size_t) 4 * N * 999 / 1000], lat[4 * N - 1]);
+    free(lat);
+    free(strs);
+}
+
+struct worker_args {
+    hashmap_concurrent_t* map;
+    char (*strs)[12];
+    uint32_t seed, reads;
+};
+
+void* concurrent_worker(void* p) {
+    struct worker_args* args = (struct worker_args*) p;
+    for (size_t i = 0; i < N; i++) {
+        args->seed = args->seed * 1103515245 + 12345;
+        char* key  = args->strs[(args->seed >> 8) % N];
+        if ((args->seed >> 4) % 100 < args->reads) {
+            hashmap_concurrent_get(args->map, key, NULL);
+        } else if (args->seed & 1) {
+            hashmap_concurrent_insert(args->map, key, key, true);
+        } else {
+            hashmap_concurrent_remove(args->map, key);
+        }
+    }
+    return NULL;
+}
+
+void benchmark_concurrent(uint32_t segments) {
+    char(*strs)[12] = malloc(N * sizeof(*strs));
+    for (size_t i = 0; i < N; i++) {
+        sprintf(strs[i], "%d", (int) i);
+    }
+    uint32_t reads[] = {50, 90, 99};
+    for (size_t r = 0; r < sizeof(reads) / sizeof(reads[0]); r++) {
+        printf("segments = %2u, reads = %u%%:", segments, reads[r]);
+        for (uint32_t nthreads = 1; nthreads <= 8; nthreads <<= 1) {
+            hashmap_concurrent_t map;
+            if (hashmap_concurrent_init(&map, N, segments, NULL, NULL) != 0) {
+                printf("!!![ERROR]!!!\n");
+                break;
+            }
+            for (size_t i = 0; i < N; i += 2) {
+                if (hashmap_concurrent_insert(&map, strs[i], strs[i], true) != 0)
+                    printf("!!![ERROR]!!!");
+            }
+            if (hashmap_concurrent_size(&map) != N / 2 || hashmap_concurrent_exists(&map, strs[1]) ||
+                hashmap_concurrent_get(&map, strs[N - 2], NULL) != strs[N - 2])
+                printf("!!![ERROR]!!!");
+            pthread_t          threads[8];
+            struct worker_args args[8];
+            struct timespec    tic, toc;
+            clock_gettime(CLOCK_MONOTONIC, &tic);
+            for (uint32_t t = 0; t < nthreads; t++) {
+                args[t] = (struct worker_args){&map, strs, t + 1, reads[r]};
+                pthread_create(&threads[t], NULL, concurrent_worker, &args[t]);
+            }
+            for (uint32_t t = 0; t < nthreads; t++) {
+                pthread_join(threads[t], NULL);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &toc);
+            double s = (toc.tv_sec - tic.tv_sec) + (toc.tv_nsec - tic.tv_nsec) / 1e9;
+            printf(" %ut = %.2f Mops/s", nthreads, nthreads * N / s / 1e6);
+            hashmap_concurrent_destroy(&map);
+        }
+        printf("\n");
+    }
+    free(strs);
+}
+
+struct rcu_args {
+    hashmap_rcu_t* map;
+    char (*strs)[12];
+    uint32_t seed;
+    int      done;
+};
+
+void* rcu_reader(void* p) {
+    struct rcu_args*      args   = (struct rcu_args*) p;
+    hashmap_rcu_reader_t* reader = hashmap_rcu_register(args->map);
+    for (size_t i = 0; i < N; i++) {
+        args->seed = args->seed * 1103515245 + 12345;
+        hashmap_rcu_get(args->map, reader, args->strs[(args->seed >> 8) % N], NULL);
+    }
+    hashmap_rcu_unregister(reader);
+    return NULL;
+}
+
+void* rcu_writer(void* p) {
+    struct rcu_args* args = (struct rcu_args*) p;
+    while (!__atomic_load_n(&args->done, __ATOMIC_ACQUIRE)) {
+        args->seed = args->seed * 1103515245 + 12345;
+        char* key  = args->strs[(args->seed >> 8) % N];
+        if (args->seed & 1) {
+            hashmap_rcu_insert(args->map, key, key, true);
+        } else {
+            hashmap_rcu_remove(args->map, key);
+        }
+    }
+    return NULL;
+}
+
+void benchmark_rcu() {
+    char(*strs)[12] = malloc(N * sizeof(*strs));
+    for (size_t i = 0; i < N; i++) {
+        sprintf(strs[i], "%d", (int) i);
+    }
+    printf("rcu, 1 writer:");
+    for (uint32_t nthreads = 1; nthreads <= 8; nthreads <<= 1) {
+        hashmap_rcu_t map;
+        hashmap_rcu_init(&map, N, NULL, NULL);
+        for (size_t i = 0; i < N; i += 2) {
+            hashmap_rcu_insert(&map, strs[i], strs[i], true);
+        }
+        pthread_t       threads[8], writer;
+        struct rcu_args args[8], wargs = {&map, strs, 0, 0};
+        struct timespec tic, toc;
+        pthread_create(&writer, NULL, rcu_writer, &wargs);
+        clock_gettime(CLOCK_MONOTONIC, &tic);
+        for (uint32_t t = 0; t < nthreads; t++) {
+            args[t] = (struct rcu_args){&map, strs, t + 1, 0};
+            pthread_create(&threads[t], NULL, rcu_reader, &args[t]);
+        }
+        for (uint32_t t = 0; t < nthreads; t++) {
+            pthread_join(threads[t], NULL);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &toc);
+        __atomic_store_n(&wargs.done, 1, __ATOMIC_RELEASE);
+        pthread_join(writer, NULL);
+        double s = (toc.tv_sec - tic.tv_sec) + (toc.tv_nsec - tic.tv_nsec) / 1e9;
+        printf(" %ut = %.2f Mreads/s", nthreads, nthreads * N / s / 1e6);
+        hashmap_rcu_free(&map);
+    }
+    printf("\n");
+    free(strs);
+}
+
+struct pool_args {
+    memory_pool_t*   pool;
+    pthread_mutex_t* lock;
+};
+
+void* pool_worker(void* p) {
+    struct pool_args* args = (struct pool_args*) p;
+    void*             ptrs[256];
+    for (size_t i = 0; i < N; i += 256) {
+        for (size_t j = 0; j < 256; j++) {
+            if (args->lock) pthread_mutex_lock(args->lock);
+            ptrs[j] = mpalloc(args->pool, 24 + 8 * ((i + j) % 16));
+            if (args->lock) pthread_mutex_unlock(args->lock);
+        }
+        for (size_t j = 0; j < 256; j++) {
+            if (args->lock) pthread_mutex_lock(args->lock);
+            mpfree(args->pool, ptrs[j]);
+            if (args->lock) pthread_mutex_unlock(args->lock);
+        }
+    }
+    return NULL;
+}
+
+// One pool shared by every thread: behind a global lock, through thread caches, and plain malloc for reference.
+void benchmark_pool_threads() {
+    const char* names[] = {"locked", "cached", "malloc"};
+    for (size_t mode = 0; mode < 3; mode++) {
+        printf("pool %-6s:", names[mode]);
+        for (uint32_t nthreads = 1; nthreads <= 8; nthreads <<= 1) {
+            memory_pool_t   pool;
+            pthread_mutex_t lock;
+            pthread_mutex_init(&lock, NULL);
+            if (mode == 1)
+                memory_pool_init_shared(&pool, 8);
+            else
+                memory_pool_init(&pool, 8);
+            pthread_t        threads[8];
+            struct pool_args args = {mode == 2 ? NULL : &pool, mode == 0 ? &lock : NULL};
+            struct timespec  tic, toc;
+            clock_gettime(CLOCK_MONOTONIC, &tic);
+            for (uint32_t t = 0; t < nthreads; t++) {
+                pthread_create(&threads[t], NULL, pool_worker, &args);
+            }
+            for (uint32_t t = 0; t < nthreads; t++) {
+                pthread_join(threads[t], NULL);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &toc);
+            double s = (toc.tv_sec - tic.tv_sec) + (toc.tv_nsec - tic.tv_nsec) / 1e9;
+            printf(" %ut = %.2f Mops/s", nthreads, 2 * nthreads * N / s / 1e6);
+            memory_pool_destroy(&pool);
+            pthread_mutex_destroy(&lock);
+        }
+        printf("\n");
+    }
+}
+
 void print_hashmap(hashmap_t* map) {
     printf(" { capacity = %u, size = %u, current = %u, freelist = [ ", map->__capacity, map->__size, map->__current);
     for (int32_t i = map->__freelist; i >= 0; i = map->__entries[i].next)
@@ -111,15 +1276,15 @@ void print_hashmap(hashmap_t* map) {
 
     for (uint32_t bucket_at = 0; bucket_at < map->__capacity; bucket_at++) {
         printf(" \033[1;33m• [Bucket %2u]:\033[0m ", bucket_at);
-        if (map->__buckets[bucket_at].type == 2) {
+        // A positive index is one more than the head entry, a negative one one less than minus the skiplist's entry.
+        int32_t index = map->__buckets[bucket_at].index;
+        if (index < 0) {
             printf("\n");
-            print_skiplist(map->__buckets[bucket_at].skiplist);
+            print_skiplist((skiplist_t*) map->__vs[-index - 1]);
         } else {
             printf("\033[34m[HEAD]\033[0m -> ");
-            if (map->__buckets[bucket_at].type == 1) {
-                for (int32_t i = map->__buckets[bucket_at].entry; i >= 0; i = map->__entries[i].next) {
-                    printf("\033[30;42m[%s]\033[0m -> ", (char*) map->__entries[i].k);
-                }
+            for (int32_t i = index - 1; i >= 0; i = map->__entries[i].next) {
+                printf("\033[30;42m[%s]\033[0m -> ", (char*) map->__ks[i]);
             }
             printf("\033[34m[NIL]\033[0m\n");
         }